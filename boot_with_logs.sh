@@ -2,11 +2,13 @@
 # Boot Pebble QEMU 10.x with live PebbleOS logs
 #
 # Usage:
-#   bash boot_with_logs.sh [--sdk|--full]
+#   bash boot_with_logs.sh [--sdk|--full] [--idle-warp]
 #
 # Firmware options:
 #   --full  Full PebbleOS firmware (default)
 #   --sdk   SDK PebbleOS firmware (from Pebble SDK 4.9.77)
+#
+#   --idle-warp  Skip virtual time while the watch sleeps (see README "Idle warp")
 
 set -euo pipefail
 
@@ -15,16 +17,26 @@ QEMU="${SCRIPT_DIR}/../qemu-10.0/build/qemu-system-arm"
 
 # Parse firmware selection (default: full)
 FW_VARIANT="full"
+WARP_ARGS=()
 for arg in "$@"; do
     case "$arg" in
         --sdk) FW_VARIANT="sdk" ;;
         --full) FW_VARIANT="full" ;;
-        *) echo "Unknown option: $arg"; echo "Usage: $0 [--sdk|--full]"; exit 1 ;;
+        --idle-warp) WARP_ARGS=(-icount "shift=${PEBBLE_IDLE_WARP_SHIFT:-3},sleep=off" -rtc clock=vm) ;;
+        *) echo "Unknown option: $arg"; echo "Usage: $0 [--sdk|--full] [--idle-warp]"; exit 1 ;;
     esac
 done
 
 FW_DIR="${SCRIPT_DIR}/firmware/${FW_VARIANT}"
 
+# Flash writes go to a sector delta next to the pristine image; delete it to
+# factory-reset. Set PEBBLE_SPI_FLASH_DELTA= (empty) to write the image in place.
+export PEBBLE_SPI_FLASH_DELTA="${PEBBLE_SPI_FLASH_DELTA-${FW_DIR}/qemu_spi_flash.delta}"
+SPI_DRIVE_OPTS=""
+if [ -n "${PEBBLE_SPI_FLASH_DELTA}" ]; then
+    SPI_DRIVE_OPTS=",readonly=on"
+fi
+
 if [ ! -f "${FW_DIR}/qemu_micro_flash.bin" ]; then
     echo "Error: Firmware not found at ${FW_DIR}/"
     echo "Expected: qemu_micro_flash.bin and qemu_spi_flash.bin"
@@ -48,17 +60,19 @@ cleanup() {
 
 echo "=== Starting Pebble QEMU 10.x (emery) ==="
 echo "  Firmware: ${FW_VARIANT} PebbleOS"
+echo "  Idle warp: ${WARP_ARGS[1]:-off}"
 echo "  Press Ctrl-C to stop"
 echo ""
 
 "$QEMU" \
   -machine pebble-snowy-emery-bb \
   -kernel "${FW_DIR}/qemu_micro_flash.bin" \
-  -drive if=none,id=spi-flash,file="${FW_DIR}/qemu_spi_flash.bin",format=raw \
+  -drive if=none,id=spi-flash,file="${FW_DIR}/qemu_spi_flash.bin",format=raw${SPI_DRIVE_OPTS} \
   -serial null \
   -serial null \
   -serial file:"${SERIAL_LOG}" \
   -d unimp -D /tmp/qemu_unimp.log \
+  ${WARP_ARGS[@]+"${WARP_ARGS[@]}"} \
   >"$DEBUG_LOG" 2>&1 &
 
 QEMU_PID=$!
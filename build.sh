@@ -81,6 +81,9 @@ patch_meson "${QEMU_SRC}/hw/arm/meson.build" "CONFIG_PEBBLE" \
   'pebble_robert.c',
   'pebble_silk.c',
   'pebble_control.c',
+  'pebble_flash_delta.c',
+  'pebble_pflash_notify.c',
+  'pebble_rewind.c',
   'pebble_stm32f4xx_soc.c',
 ))"
 
@@ -98,6 +101,9 @@ patch_meson "${QEMU_SRC}/hw/misc/meson.build" "stm32_pebble" \
   'stm32_pebble_flash.c',
   'stm32_pebble_dummy.c',
   'stm32_pebble_i2c.c',
+  'pebble_bmi160.c',
+  'pebble_i2c_regs.c',
+  'pebble_mag3110.c',
 ))"
 
 # hw/timer/meson.build - timers AND RTC (RTC is in timer dir)
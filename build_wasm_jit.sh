@@ -121,6 +121,9 @@ patch_meson hw/arm/meson.build "CONFIG_PEBBLE" \
   '"'"'pebble_robert.c'"'"',
   '"'"'pebble_silk.c'"'"',
   '"'"'pebble_control.c'"'"',
+  '"'"'pebble_flash_delta.c'"'"',
+  '"'"'pebble_pflash_notify.c'"'"',
+  '"'"'pebble_rewind.c'"'"',
   '"'"'pebble_stm32f4xx_soc.c'"'"',
 ))"
 
@@ -138,6 +141,9 @@ patch_meson hw/misc/meson.build "stm32_pebble" \
   '"'"'stm32_pebble_flash.c'"'"',
   '"'"'stm32_pebble_dummy.c'"'"',
   '"'"'stm32_pebble_i2c.c'"'"',
+  '"'"'pebble_bmi160.c'"'"',
+  '"'"'pebble_i2c_regs.c'"'"',
+  '"'"'pebble_mag3110.c'"'"',
 ))"
 
 # hw/timer/meson.build
@@ -249,6 +255,10 @@ docker cp "${CONTAINER_NAME}:/build/qemu-system-arm.js" "${WEB_DIR}/"
 docker cp "${CONTAINER_NAME}:/build/qemu-system-arm.wasm" "${WEB_DIR}/"
 docker cp "${CONTAINER_NAME}:/build/qemu-system-arm.worker.js" "${WEB_DIR}/"
 
+# Machine images only resume on the QEMU version that saved them; make_snapshot.sh
+# and index.html check ?snapshot images against this
+docker cp "${CONTAINER_NAME}:/qemu-rw/VERSION" "${WEB_DIR}/qemu-version.txt"
+
 echo ""
 echo "=== WASM JIT build complete ==="
 ls -lh "${WEB_DIR}/qemu-system-arm"*
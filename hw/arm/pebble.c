@@ -43,12 +43,16 @@
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
 #include "hw/ssi/ssi.h"
+#include "hw/i2c/i2c.h"
 #include "hw/block/flash.h"
 #include "hw/loader.h"
 #include "hw/arm/boot.h"
 #include "hw/arm/stm32_common.h"
 #include "hw/arm/pebble.h"
 #include "pebble_control.h"
+#include "pebble_flash_delta.h"
+#include "pebble_pflash_notify.h"
+#include "pebble_rewind.h"
 #include "ui/console.h"
 #include "ui/input.h"
 #include "chardev/char.h"
@@ -80,6 +84,11 @@ const static PblBoardConfig s_board_config_snowy_bb = {
         {STM32_GPIOG_INDEX, 1, false}, /* select */
         {STM32_GPIOG_INDEX, 2, false}, /* down */
     },
+    .i2c_sensors = {
+        { "pebble-bmi160", 0, 0x68, STM32_GPIOG_INDEX, 5 },  /* accel, INT1 on PG5 */
+        { "pebble-max14690", 0, 0x28, -1, 0 },               /* PMIC */
+        { "pebble-mag3110", 0, 0x0E, STM32_GPIOG_INDEX, 6 }, /* compass, INT on PG6 */
+    },
     .flash_size = 4096,
     .ram_size = 256,
     .num_rows = 172,
@@ -101,6 +110,11 @@ const static PblBoardConfig s_board_config_snowy_emery_bb = {
         {STM32_GPIOG_INDEX, 1, false}, /* select */
         {STM32_GPIOG_INDEX, 2, false}, /* down */
     },
+    .i2c_sensors = {
+        { "pebble-bmi160", 0, 0x68, STM32_GPIOG_INDEX, 5 },  /* accel, INT1 on PG5 */
+        { "pebble-max14690", 0, 0x28, -1, 0 },               /* PMIC */
+        { "pebble-mag3110", 0, 0x0E, STM32_GPIOG_INDEX, 6 }, /* compass, INT on PG6 */
+    },
     .flash_size = 4096,
     .ram_size = 512,
     .num_rows = 228,
@@ -122,6 +136,11 @@ const static PblBoardConfig s_board_config_s4_bb = {
         {STM32_GPIOG_INDEX, 1, false},
         {STM32_GPIOG_INDEX, 2, false},
     },
+    .i2c_sensors = {
+        { "pebble-bmi160", 0, 0x68, STM32_GPIOG_INDEX, 5 },  /* accel, INT1 on PG5 */
+        { "pebble-max14690", 0, 0x28, -1, 0 },               /* PMIC */
+        { "pebble-mag3110", 0, 0x0E, STM32_GPIOG_INDEX, 6 }, /* compass, INT on PG6 */
+    },
     .flash_size = 4096,
     .ram_size = 256,
     .num_rows = 180,
@@ -151,6 +170,7 @@ static void prv_send_key_up(void *opaque)
         return;
     }
     DPRINTF("button %d released\n", s_waiting_key_up_id);
+    pebble_rewind_note_buttons(0);
     qemu_set_irq(button_irqs[s_waiting_key_up_id], true);
     qemu_set_irq(s_button_wakeup, false);
     s_waiting_key_up_id = PBL_BUTTON_ID_NONE;
@@ -171,6 +191,47 @@ static int pebble_qcode_to_button(int qcode)
     }
 }
 
+/* Press-to-first-frame latency. Each button press is stamped on the host and
+ * virtual clocks, and the next frame the display publishes with changed rows
+ * closes the measurement. PEBBLE_INPUT_LATENCY=1 logs every one. */
+static bool s_press_pending;
+static int64_t s_press_host_ns;
+static int64_t s_press_virt_ns;
+static int64_t s_latency_host_us = -1;
+static int64_t s_latency_virt_us = -1;
+static uint32_t s_latency_count;
+static bool s_latency_log;
+
+static void pebble_note_button_press(void)
+{
+    s_press_host_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s_press_virt_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    s_press_pending = true;
+}
+
+static void pebble_note_frame(void)
+{
+    int64_t host_us, virt_us;
+
+    if (!s_press_pending) {
+        return;
+    }
+    s_press_pending = false;
+    host_us = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s_press_host_ns) / SCALE_US;
+    virt_us = (qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - s_press_virt_ns) / SCALE_US;
+    __atomic_store_n(&s_latency_host_us, host_us, __ATOMIC_RELAXED);
+    __atomic_store_n(&s_latency_virt_us, virt_us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s_latency_count, 1, __ATOMIC_RELEASE);
+    DPRINTF("press to frame: %" PRId64 " us host, %" PRId64 " us virtual\n",
+            host_us, virt_us);
+    if (s_latency_log) {
+        info_report("pebble: press to first frame %" PRId64 ".%03" PRId64
+                    " ms (%" PRId64 ".%03" PRId64 " ms virtual)",
+                    host_us / 1000, host_us % 1000,
+                    virt_us / 1000, virt_us % 1000);
+    }
+}
+
 static void pebble_input_event(DeviceState *dev, QemuConsole *src,
                                 InputEvent *evt)
 {
@@ -184,6 +245,18 @@ static void pebble_input_event(DeviceState *dev, QemuConsole *src,
     key = evt->u.key.data;
     qcode = qemu_input_key_value_to_qcode(key->key);
     pressed = key->down;
+
+    /* PEBBLE_REWIND_MS: Page Up steps back a second, Page Down resumes */
+    if (pressed && pebble_rewind_enabled()) {
+        if (qcode == Q_KEY_CODE_PGUP) {
+            pebble_rewind_step_back(1000);
+            return;
+        } else if (qcode == Q_KEY_CODE_PGDN) {
+            pebble_rewind_resume();
+            return;
+        }
+    }
+
     button_id = pebble_qcode_to_button(qcode);
 
     if (button_id == PBL_BUTTON_ID_NONE || !pressed) {
@@ -198,6 +271,8 @@ static void pebble_input_event(DeviceState *dev, QemuConsole *src,
     if (s_waiting_key_up_id != button_id) {
         DPRINTF("button %d pressed\n", button_id);
         s_waiting_key_up_id = button_id;
+        pebble_note_button_press();
+        pebble_rewind_note_buttons(1 << button_id);
         qemu_set_irq(s_button_irq[button_id], false);
         qemu_set_irq(s_button_wakeup, true);
     }
@@ -221,6 +296,7 @@ void pebble_set_button_state(uint32_t button_state)
         return;
     }
     int button_id;
+    pebble_rewind_note_buttons(button_state);
     for (button_id = 0; button_id < PBL_NUM_BUTTONS; button_id++) {
         uint32_t mask = 1 << button_id;
         qemu_set_irq(s_button_irq[button_id], !(button_state & mask));
@@ -229,13 +305,30 @@ void pebble_set_button_state(uint32_t button_state)
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
+#include <emscripten/threading.h>
+#include <math.h>
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
 
 /* Shared button state for JavaScript → QEMU communication.
- * JavaScript writes button bitmask, QEMU timer reads and applies it.
+ * JavaScript writes the button bitmask and rings the doorbell with
+ * Atomics.notify() on the same word. A small thread sleeping on it takes the
+ * BQL and drives the GPIO edge straight away: the EXTI/NVIC path raises the
+ * interrupt and kicks the vCPU out of its current TB, so the press lands at
+ * the next TB exit instead of whenever the main loop next runs. Nothing polls.
  * Bit 0=back, 1=up, 2=select, 3=down. */
 static uint32_t pebble_wasm_button_state = 0;
 static uint32_t pebble_wasm_last_button_state = 0;
-static QEMUTimer *pebble_wasm_button_timer;
+static QemuThread pebble_wasm_button_thread;
+
+/* Shortest press the firmware is shown, in virtual time. A browser tap is
+ * over in tens of host milliseconds, which under TCI can be well inside the
+ * firmware's debounce window; releases that come sooner are held back. */
+#define PEBBLE_WASM_MIN_HOLD_NS (30 * SCALE_MS)
+
+static int64_t pebble_wasm_press_ns[PBL_NUM_BUTTONS];
+static QEMUTimer *pebble_wasm_release_timer;
 
 /* Export the address of button state so JavaScript can write directly
  * to shared memory via Atomics.store(), bypassing slow PROXY_TO_PTHREAD
@@ -248,17 +341,103 @@ EMSCRIPTEN_KEEPALIVE uint32_t pebble_button_state_addr(void)
 EMSCRIPTEN_KEEPALIVE void pebble_set_buttons(uint32_t state)
 {
     __atomic_store_n(&pebble_wasm_button_state, state, __ATOMIC_SEQ_CST);
+    emscripten_futex_wake(&pebble_wasm_button_state, INT_MAX);
+}
+
+/* Latest press-to-first-frame measurement; the count changes with each one */
+EMSCRIPTEN_KEEPALIVE uint32_t pebble_input_latency_count(void)
+{
+    return __atomic_load_n(&s_latency_count, __ATOMIC_ACQUIRE);
+}
+
+EMSCRIPTEN_KEEPALIVE double pebble_input_latency_host_ms(void)
+{
+    return __atomic_load_n(&s_latency_host_us, __ATOMIC_RELAXED) / 1000.0;
+}
+
+EMSCRIPTEN_KEEPALIVE double pebble_input_latency_virt_ms(void)
+{
+    return __atomic_load_n(&s_latency_virt_us, __ATOMIC_RELAXED) / 1000.0;
 }
 
-static void pebble_wasm_button_poll(void *opaque)
+/* Time-travel controls, only active with PEBBLE_REWIND_MS set */
+EMSCRIPTEN_KEEPALIVE void pebble_rewind(uint32_t ms)
 {
-    uint32_t state = __atomic_load_n(&pebble_wasm_button_state, __ATOMIC_SEQ_CST);
+    pebble_rewind_step_back(ms);
+}
+
+EMSCRIPTEN_KEEPALIVE void pebble_rewind_continue(void)
+{
+    pebble_rewind_resume();
+}
+
+/* Apply @state at the current virtual time, with the BQL held. Releases that
+ * would end a press before PEBBLE_WASM_MIN_HOLD_NS are left to the release
+ * timer, which applies whatever JavaScript has stored by then. */
+static void pebble_wasm_button_apply(uint32_t state)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t release_ns = INT64_MAX;
+    uint32_t pressed;
+    int button_id;
+
+    for (button_id = 0; button_id < PBL_NUM_BUTTONS; button_id++) {
+        uint32_t mask = 1 << button_id;
+        int64_t hold_ns = pebble_wasm_press_ns[button_id] + PEBBLE_WASM_MIN_HOLD_NS;
+
+        if ((pebble_wasm_last_button_state & mask) && !(state & mask) &&
+            now < hold_ns) {
+            state |= mask;
+            release_ns = MIN(release_ns, hold_ns);
+        }
+    }
+
+    pressed = state & ~pebble_wasm_last_button_state;
     if (state != pebble_wasm_last_button_state) {
+        for (button_id = 0; button_id < PBL_NUM_BUTTONS; button_id++) {
+            if (pressed & (1 << button_id)) {
+                pebble_wasm_press_ns[button_id] = now;
+            }
+        }
+        if (pressed) {
+            pebble_note_button_press();
+        }
+        DPRINTF("buttons 0x%x at %" PRId64 " us\n", state, now / SCALE_US);
         pebble_set_button_state(state);
         pebble_wasm_last_button_state = state;
     }
-    timer_mod(pebble_wasm_button_timer,
-              qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 16);
+    if (release_ns != INT64_MAX) {
+        timer_mod_ns(pebble_wasm_release_timer, release_ns);
+    }
+}
+
+static void pebble_wasm_button_release_cb(void *opaque)
+{
+    pebble_wasm_button_apply(__atomic_load_n(&pebble_wasm_button_state,
+                                             __ATOMIC_SEQ_CST));
+}
+
+/* Sleeps until JavaScript changes the button word. The state is sampled as
+ * soon as the futex wakes, before waiting for the BQL, so a quick tap is
+ * still seen as a press followed by a release. */
+static void *pebble_wasm_button_doorbell(void *opaque)
+{
+    uint32_t seen = __atomic_load_n(&pebble_wasm_button_state, __ATOMIC_SEQ_CST);
+
+    rcu_register_thread();
+    for (;;) {
+        uint32_t state;
+
+        emscripten_futex_wait(&pebble_wasm_button_state, seen, INFINITY);
+        state = __atomic_load_n(&pebble_wasm_button_state, __ATOMIC_SEQ_CST);
+        if (state != seen) {
+            seen = state;
+            bql_lock();
+            pebble_wasm_button_apply(state);
+            bql_unlock();
+        }
+    }
+    return NULL;
 }
 #endif
 
@@ -304,12 +483,15 @@ void pebble_init_buttons(Stm32Gpio *gpio[], const PblButtonMap *map)
         qemu_input_handler_register(NULL, &pebble_keyboard_handler);
     qemu_input_handler_activate(ihs);
 
+    s_latency_log = getenv("PEBBLE_INPUT_LATENCY") != NULL;
+
 #ifdef __EMSCRIPTEN__
-    /* Start polling timer for WASM button input */
-    pebble_wasm_button_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL,
-                                             pebble_wasm_button_poll, NULL);
-    timer_mod(pebble_wasm_button_timer,
-              qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 100);
+    /* Start the doorbell for WASM button input */
+    pebble_wasm_release_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                             pebble_wasm_button_release_cb,
+                                             NULL);
+    qemu_thread_create(&pebble_wasm_button_thread, "pebble-buttons",
+                       pebble_wasm_button_doorbell, NULL, QEMU_THREAD_DETACHED);
 #endif
 }
 
@@ -332,10 +514,20 @@ static void pebble_board_vibe_ctl(void *opaque, int n, int level)
     qemu_set_irq(s->vibe_out_irq, level);
 }
 
+static void pebble_board_frame(void *opaque, int n, int level)
+{
+    assert(n == 0);
+    if (level) {
+        pebble_note_frame();
+    }
+}
+
 static void pebble_board_realize(DeviceState *dev, Error **errp)
 {
     qdev_init_gpio_in_named(dev, pebble_board_vibe_ctl,
                             "pebble_board_vibe_in", 1);
+    qdev_init_gpio_in_named(dev, pebble_board_frame,
+                            "pebble_board_frame_in", 1);
 }
 
 static void pebble_board_class_init(ObjectClass *klass, const void *data)
@@ -370,12 +562,24 @@ DeviceState *pebble_init_board(Stm32Gpio *gpio[], qemu_irq display_vibe)
 /* ====================================================================
  * QEMU-specific RTC settings
  * ==================================================================== */
-void pebble_set_qemu_settings(DeviceState *rtc_dev)
-{
 #define QEMU_REG_0_FIRST_BOOT_LOGIC_ENABLE  0x00000001
 #define QEMU_REG_0_START_CONNECTED          0x00000002
 #define QEMU_REG_0_START_PLUGGED_IN         0x00000004
 
+static DeviceState *s_rtc_dev;
+
+static void pebble_update_qemu_setting(uint32_t flag, bool on)
+{
+    if (!s_rtc_dev) {
+        return;
+    }
+    uint32_t flags = f2xx_rtc_get_extra_bkup_reg(s_rtc_dev, 0);
+    flags = on ? (flags | flag) : (flags & ~flag);
+    f2xx_rtc_set_extra_bkup_reg(s_rtc_dev, 0, flags);
+}
+
+void pebble_set_qemu_settings(DeviceState *rtc_dev)
+{
     uint32_t flags = QEMU_REG_0_START_CONNECTED;
     char *strval;
 
@@ -407,6 +611,100 @@ void pebble_set_qemu_settings(DeviceState *rtc_dev)
     }
 
     f2xx_rtc_set_extra_bkup_reg(rtc_dev, 0, flags);
+    s_rtc_dev = rtc_dev;
+}
+
+/* ====================================================================
+ * Sensor input
+ * ==================================================================== */
+static const PblAccelSinkOps *s_accel_ops;
+static void *s_accel_opaque;
+static bool (*s_compass_set)(void *opaque, uint32_t heading, uint8_t calib_status);
+static void *s_compass_opaque;
+
+void pebble_sensor_register_accel(const PblAccelSinkOps *ops, void *opaque)
+{
+    s_accel_ops = ops;
+    s_accel_opaque = opaque;
+}
+
+void pebble_sensor_register_compass(
+        bool (*set)(void *opaque, uint32_t heading, uint8_t calib_status),
+        void *opaque)
+{
+    s_compass_set = set;
+    s_compass_opaque = opaque;
+}
+
+bool pebble_sensor_accel_samples(const PblAccelSample *samples, uint32_t n,
+                                 uint32_t *avail)
+{
+    if (!s_accel_ops || !s_accel_ops->samples) {
+        return false;
+    }
+    DPRINTF("accel: %u samples\n", n);
+    return s_accel_ops->samples(s_accel_opaque, samples, n, avail);
+}
+
+bool pebble_sensor_accel_tap(uint8_t axis, int8_t direction)
+{
+    if (!s_accel_ops || !s_accel_ops->tap || axis > 2) {
+        return false;
+    }
+    DPRINTF("accel: tap axis %d dir %d\n", axis, direction);
+    return s_accel_ops->tap(s_accel_opaque, axis, direction);
+}
+
+bool pebble_sensor_compass(uint32_t heading, uint8_t calib_status)
+{
+    if (!s_compass_set) {
+        return false;
+    }
+    DPRINTF("compass: heading 0x%x calib %d\n", heading, calib_status);
+    return s_compass_set(s_compass_opaque, heading, calib_status);
+}
+
+/* Battery and Bluetooth have no emulated hardware behind them: QEMU keeps the
+ * state in the boot flags so a reboot comes up in it, and the firmware's QEMU
+ * driver still gets the packet for the running system. */
+bool pebble_sensor_battery(uint8_t pct, bool charger_connected)
+{
+    DPRINTF("battery: %d%% charger %d\n", pct, charger_connected);
+    pebble_update_qemu_setting(QEMU_REG_0_START_PLUGGED_IN, charger_connected);
+    return false;
+}
+
+bool pebble_sensor_bt_connection(bool connected)
+{
+    DPRINTF("bluetooth: connected %d\n", connected);
+    pebble_update_qemu_setting(QEMU_REG_0_START_CONNECTED, connected);
+    return false;
+}
+
+/* ====================================================================
+ * I2C sensors
+ * ==================================================================== */
+static void pebble_init_i2c_sensors(struct stm32f4xx *stm, Stm32Gpio *gpio[],
+                                    const PblI2CSensorMap *map)
+{
+    int i;
+
+    for (i = 0; i < PBL_MAX_I2C_SENSORS && map[i].type; i++) {
+        assert(map[i].i2c < STM32F4XX_I2C_COUNT);
+        I2CBus *bus = (I2CBus *)qdev_get_child_bus(stm->i2c_dev[map[i].i2c], "i2c");
+        I2CSlave *dev = i2c_slave_new(map[i].type, map[i].addr);
+
+        /* Named by type so QMP can reach it, e.g. /machine/pebble-mag3110 */
+        object_property_add_child(qdev_get_machine(), map[i].type, OBJECT(dev));
+        i2c_slave_realize_and_unref(dev, bus, &error_fatal);
+
+        /* The interrupt line reaches the EXTI through its GPIO pin */
+        if (map[i].irq_gpio >= 0) {
+            qdev_connect_gpio_out_named(DEVICE(dev), "int", 0,
+                    qdev_get_gpio_in((DeviceState *)gpio[map[i].irq_gpio],
+                                     map[i].irq_pin));
+        }
+    }
 }
 
 /* ====================================================================
@@ -441,20 +739,28 @@ void pebble_32f439_init(MachineState *machine,
     /* Storage flash (NOR-flash on Snowy/Emery) - 16MB at 0x60000000.
      * Use pflash_cfi02 (AMD/JEDEC compatible) to emulate Macronix MX29VS128FB.
      * Pass via: -drive if=none,id=spi-flash,file=firmware/qemu_spi_flash.bin,format=raw
+     *
+     * With PEBBLE_SPI_FLASH_DELTA=<path> the drive is only read once (it can be
+     * opened readonly=on and shared) and flash writes go to a sector delta log
+     * at <path> instead, see pebble_flash_delta.c.
      */
     {
         const uint32_t flash_size_bytes = 16 * 1024 * 1024;
         const uint32_t sector_size = 32 * 1024;
+        const char *delta_path = getenv("PEBBLE_SPI_FLASH_DELTA");
         BlockBackend *blk = blk_by_name("spi-flash");
         if (!blk) {
             fprintf(stderr, "WARNING: pflash drive 'spi-flash' not found, flash will be empty\n");
         } else {
             fprintf(stderr, "DEBUG: pflash drive 'spi-flash' found\n");
         }
+        if (delta_path && !*delta_path) {
+            delta_path = NULL;
+        }
         pflash_cfi02_register(0x60000000,
                               "pebble.spi_flash",
                               flash_size_bytes,
-                              blk,
+                              delta_path ? NULL : blk,
                               sector_size,
                               1,      /* nb_mappings */
                               2,      /* width (16-bit) */
@@ -465,6 +771,11 @@ void pebble_32f439_init(MachineState *machine,
                               0x555,  /* unlock_addr0 */
                               0x2AA,  /* unlock_addr1 */
                               0);     /* big_endian = false */
+        pebble_pflash_notify_init(0x60000000, sector_size);
+        if (delta_path) {
+            pebble_flash_delta_init(0x60000000, flash_size_bytes, sector_size,
+                                    blk, delta_path);
+        }
     }
 
     /* === Display === */
@@ -530,6 +841,9 @@ void pebble_32f439_init(MachineState *machine,
     /* Init buttons */
     pebble_init_buttons(gpio, board_config->button_map);
 
+    /* Sensors */
+    pebble_init_i2c_sensors(&stm, gpio, board_config->i2c_sensors);
+
     /* Board device (vibrate fan-out) */
     qemu_irq display_vibe = qdev_get_gpio_in_named(display_dev,
                                                      "vibe_ctl", 0);
@@ -540,6 +854,15 @@ void pebble_32f439_init(MachineState *machine,
                                                       0);
     qdev_connect_gpio_out((DeviceState *)gpio[STM32_GPIOF_INDEX], 4,
                           board_vibe_in);
+
+    /* Frames close the press-to-first-frame latency measurement */
+    qdev_connect_gpio_out_named(display_dev, "frame_output", 0,
+                                qdev_get_gpio_in_named(board,
+                                                       "pebble_board_frame_in",
+                                                       0));
+
+    /* Time-travel checkpoints (PEBBLE_REWIND_MS), after all devices exist */
+    pebble_rewind_init();
 }
 
 /* ====================================================================
@@ -27,6 +27,7 @@
 #include "chardev/char-fe.h"
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
 
 #include "pebble_control.h"
@@ -150,6 +151,15 @@ typedef struct QEMU_PACKED {
 #define PBLCONTROL_BUF_LEN (QEMU_MAX_DATA_LEN + sizeof(QemuCommChannelHdr) \
                                 + sizeof(QemuCommChannelFooter))
 
+// Byte ring holding one direction of traffic: 'bytes' bytes starting at 'start', wrapping
+// at the end of buf. It holds one maximum-sized packet, and consuming from the front is
+// O(1) instead of a memmove of everything behind it.
+typedef struct {
+    uint8_t buf[PBLCONTROL_BUF_LEN];
+    uint32_t start;
+    uint32_t bytes;
+} PebbleControlRing;
+
 struct PebbleControl {
     /* Inherited */
     SysBusDevice parent_obj;
@@ -171,13 +181,11 @@ struct PebbleControl {
     // We buffer the characters we receive from our qemu_chr receive handler here until
     // we get a complete packet. From there, we can figure out if we should process it
     // directly or pass it onto the target's UART
-    uint8_t rcv_char_buf[PBLCONTROL_BUF_LEN];
-    uint32_t rcv_char_bytes;    /* number of bytes avaialable in rcv_char_buf */
+    PebbleControlRing rcv;
 
 
     // If we are passing a packet onto the target UART, this contains the number of bytes left
-    // to transfer. The bytes we are transferring are always at the front of the
-    // rcv_char_buf.
+    // to transfer. The bytes we are transferring are always at the front of rcv.
     uint32_t   target_send_bytes;
 
     // Timer used to wake us up to pump more data to the target
@@ -187,13 +195,17 @@ struct PebbleControl {
     // We only send it to the front end once we have a complete packet. This insures
     // that packets we went to send out don't interrupt midstream one that the target is
     // sending.
-    uint8_t send_char_buf[PBLCONTROL_BUF_LEN];
-    uint32_t send_char_bytes;    /* number of bytes avaialable in send_char_buf */
+    PebbleControlRing send;
+
+    // Packets are copied out of the rings here when they wrap, so handlers see them and
+    // the host gets them in one piece
+    uint8_t frame_buf[PBLCONTROL_BUF_LEN];
 };
 
 
-// Control channel handlers are defined using this structure
-typedef void (*PebbleControlMessageCallback)(PebbleControl *s, const uint8_t* data,
+// Control channel handlers are defined using this structure. A handler returns false
+// when it did not consume the packet, which then goes on to the target as usual.
+typedef bool (*PebbleControlMessageCallback)(PebbleControl *s, const uint8_t* data,
                                              uint32_t length);
 typedef struct {
   uint16_t protocol_id;
@@ -202,19 +214,103 @@ typedef struct {
 
 
 
+static void pebble_control_send_packet(PebbleControl *s, QemuProtocol protocol, void *data,
+                                       uint32_t len);
+
 // -----------------------------------------------------------------------------------
-static void pebble_control_button_msg_callback(PebbleControl *s, const uint8_t *data,
+static bool pebble_control_button_msg_callback(PebbleControl *s, const uint8_t *data,
                                               uint32_t len)
 {
     DPRINTF("%s: \n", __func__);
     QemuProtocolButtonHeader *hdr = (QemuProtocolButtonHeader *)data;
     if (len != sizeof(*hdr)) {
         EPRINTF("%s: invalid packet\n", __func__);
-        return;
+        return true;
     }
 
     DPRINTF("%s: new button state: 0x%x\n", __func__, (int)hdr->button_state);
     pebble_set_button_state(hdr->button_state);
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------------
+// Sensor packets go to the emulated sensor when one is registered (see
+// pebble_sensor_*() in pebble.c) and otherwise on to the firmware's QEMU driver.
+// Malformed packets are forwarded too, so the firmware reports them as it always has.
+static bool pebble_control_tap_msg_callback(PebbleControl *s, const uint8_t *data,
+                                            uint32_t len)
+{
+    QemuProtocolTapHeader *hdr = (QemuProtocolTapHeader *)data;
+    if (len != sizeof(*hdr)) {
+        return false;
+    }
+    return pebble_sensor_accel_tap(hdr->axis, hdr->direction);
+}
+
+
+static bool pebble_control_bt_msg_callback(PebbleControl *s, const uint8_t *data,
+                                           uint32_t len)
+{
+    QemuProtocolBluetoothConnectionHeader *hdr =
+        (QemuProtocolBluetoothConnectionHeader *)data;
+    if (len != sizeof(*hdr)) {
+        return false;
+    }
+    return pebble_sensor_bt_connection(hdr->connected != 0);
+}
+
+
+static bool pebble_control_compass_msg_callback(PebbleControl *s, const uint8_t *data,
+                                                uint32_t len)
+{
+    QemuProtocolCompassHeader *hdr = (QemuProtocolCompassHeader *)data;
+    if (len != sizeof(*hdr)) {
+        return false;
+    }
+    return pebble_sensor_compass(ntohl(hdr->magnetic_heading), hdr->calib_status);
+}
+
+
+static bool pebble_control_battery_msg_callback(PebbleControl *s, const uint8_t *data,
+                                                uint32_t len)
+{
+    QemuProtocolBatteryHeader *hdr = (QemuProtocolBatteryHeader *)data;
+    if (len != sizeof(*hdr)) {
+        return false;
+    }
+    return pebble_sensor_battery(MIN(hdr->battery_pct, 100), hdr->charger_connected != 0);
+}
+
+
+// The host paces its sample stream by the avail_space in our response, just as it
+// does with the firmware's own driver.
+static bool pebble_control_accel_msg_callback(PebbleControl *s, const uint8_t *data,
+                                              uint32_t len)
+{
+    QemuProtocolAccelHeader *hdr = (QemuProtocolAccelHeader *)data;
+    PblAccelSample samples[UINT8_MAX];
+    uint32_t avail = 0;
+    uint32_t i;
+
+    if (len < sizeof(*hdr)
+        || len != sizeof(*hdr) + hdr->num_samples * sizeof(QemuProtocolAccelSample)) {
+        return false;
+    }
+    for (i = 0; i < hdr->num_samples; i++) {
+        samples[i].x = (int16_t)ntohs(hdr->samples[i].x);
+        samples[i].y = (int16_t)ntohs(hdr->samples[i].y);
+        samples[i].z = (int16_t)ntohs(hdr->samples[i].z);
+    }
+    if (!pebble_sensor_accel_samples(samples, hdr->num_samples, &avail)) {
+        return false;
+    }
+
+    QemuProtocolAccelResponseHeader resp = {
+      .avail_space = htons(MIN(avail, UINT16_MAX))
+    };
+    pebble_control_send_packet(s, QemuProtocol_Accel, &resp, sizeof(resp));
+    return true;
 }
 
 
@@ -225,6 +321,11 @@ static const PebbleControlMessageHandler* pebble_control_find_handler(PebbleCont
                                                              uint16_t protocol_id) {
     static const PebbleControlMessageHandler s_msg_endpoints[] = {
       // IMPORTANT: These must be in sorted order!!
+      { QemuProtocol_Tap, pebble_control_tap_msg_callback },
+      { QemuProtocol_BluetoothConnection, pebble_control_bt_msg_callback },
+      { QemuProtocol_Compass, pebble_control_compass_msg_callback },
+      { QemuProtocol_Battery, pebble_control_battery_msg_callback },
+      { QemuProtocol_Accel, pebble_control_accel_msg_callback },
       { QemuProtocol_Button, pebble_control_button_msg_callback },
     };
 
@@ -247,12 +348,42 @@ static const PebbleControlMessageHandler* pebble_control_find_handler(PebbleCont
 
 
 // -----------------------------------------------------------------------------------
-// Drop the first N bytes out of the beginning of the receive buffer
-static void pebble_control_consume_rcv_bytes(PebbleControl *s, uint32_t n)
+// Ring helpers. Callers check that there is room (push) or data (peek, consume).
+static void pebble_control_ring_push(PebbleControlRing *r, const uint8_t *data, uint32_t n)
+{
+    uint32_t end = (r->start + r->bytes) % PBLCONTROL_BUF_LEN;
+    uint32_t first = MIN(n, PBLCONTROL_BUF_LEN - end);
+
+    assert(n <= PBLCONTROL_BUF_LEN - r->bytes);
+    memcpy(&r->buf[end], data, first);
+    memcpy(&r->buf[0], data + first, n - first);
+    r->bytes += n;
+}
+
+// Copy n bytes starting 'offset' bytes into the ring, without consuming them
+static void pebble_control_ring_peek(const PebbleControlRing *r, uint32_t offset,
+                                     void *dst, uint32_t n)
+{
+    uint32_t pos = (r->start + offset) % PBLCONTROL_BUF_LEN;
+    uint32_t first = MIN(n, PBLCONTROL_BUF_LEN - pos);
+
+    assert(offset + n <= r->bytes);
+    memcpy(dst, &r->buf[pos], first);
+    memcpy((uint8_t *)dst + first, &r->buf[0], n - first);
+}
+
+// Number of bytes at the front of the ring that are contiguous in buf
+static uint32_t pebble_control_ring_contig(const PebbleControlRing *r)
+{
+    return MIN(r->bytes, PBLCONTROL_BUF_LEN - r->start);
+}
+
+// Drop the first N bytes out of the ring
+static void pebble_control_ring_consume(PebbleControlRing *r, uint32_t n)
 {
-    assert (n <= s->rcv_char_bytes);
-    s->rcv_char_bytes -= n;
-    memmove(&s->rcv_char_buf[0], &s->rcv_char_buf[n], s->rcv_char_bytes);
+    assert (n <= r->bytes);
+    r->bytes -= n;
+    r->start = r->bytes ? (r->start + n) % PBLCONTROL_BUF_LEN : 0;
 }
 
 
@@ -266,11 +397,16 @@ static void pebble_control_forward_to_target(PebbleControl *s)
     }
     DPRINTF("%s: %d bytes left to send to target\n", __func__, s->target_send_bytes);
 
-    int can_read_bytes = s->uart_chr_can_read(s->uart);
-    if (can_read_bytes > 0) {
+    // Hand over contiguous runs of the ring for as long as the UART has room
+    while (s->target_send_bytes) {
+        int can_read_bytes = s->uart_chr_can_read(s->uart);
+        if (can_read_bytes <= 0) {
+            break;
+        }
         can_read_bytes = MIN(can_read_bytes, s->target_send_bytes);
-        s->uart_chr_read(s->uart, s->rcv_char_buf, can_read_bytes);
-        pebble_control_consume_rcv_bytes(s, can_read_bytes);
+        can_read_bytes = MIN(can_read_bytes, pebble_control_ring_contig(&s->rcv));
+        s->uart_chr_read(s->uart, &s->rcv.buf[s->rcv.start], can_read_bytes);
+        pebble_control_ring_consume(&s->rcv, can_read_bytes);
         s->target_send_bytes -= can_read_bytes;
         DPRINTF("%s: sent %d bytes to target, %d remaining\n", __func__, can_read_bytes,
                   s->target_send_bytes);
@@ -297,46 +433,52 @@ static void pebble_control_parse_receive_buffer(PebbleControl *s)
     }
 
     // Look for a complete packet
-    while (s->rcv_char_bytes >= sizeof(QemuCommChannelHdr) + sizeof(QemuCommChannelFooter)) {
-        QemuCommChannelHdr *hdr = (QemuCommChannelHdr *)s->rcv_char_buf;
+    while (s->rcv.bytes >= sizeof(QemuCommChannelHdr) + sizeof(QemuCommChannelFooter)) {
+        QemuCommChannelHdr hdr;
+        pebble_control_ring_peek(&s->rcv, 0, &hdr, sizeof(hdr));
 
         // Check the header signature
-        if (ntohs(hdr->signature) != QEMU_HEADER_SIGNATURE) {
+        if (ntohs(hdr.signature) != QEMU_HEADER_SIGNATURE) {
             DPRINTF("%s: invalid packet hdr signature detected\n", __func__);
-            pebble_control_consume_rcv_bytes(s, sizeof(hdr->signature));
+            pebble_control_ring_consume(&s->rcv, sizeof(hdr.signature));
+            continue;
         }
 
         // Validate the length
-        uint16_t data_len = ntohs(hdr->len);
+        uint16_t data_len = ntohs(hdr.len);
         if (data_len > QEMU_MAX_DATA_LEN) {
             DPRINTF("%s: invalid packet hdr len detected\n", __func__);
-            pebble_control_consume_rcv_bytes(s, sizeof(*hdr));
+            pebble_control_ring_consume(&s->rcv, sizeof(hdr));
+            continue;
         }
 
         // If not a complete packet yet, break out
         uint16_t total_size = sizeof(QemuCommChannelHdr) + data_len
                                 + sizeof(QemuCommChannelFooter);
-        if (s->rcv_char_bytes < total_size) {
+        if (s->rcv.bytes < total_size) {
             break;
         }
 
         // We have a complete packet, see if we should process it directly or pass it onto
         // the target
-        uint16_t protocol = ntohs(hdr->protocol);
+        uint16_t protocol = ntohs(hdr.protocol);
         const PebbleControlMessageHandler* handler = pebble_control_find_handler(s, protocol);
-        if (!handler) {
-            DPRINTF("%s: passing packet with protocol %d (%d bytes) onto target\n",
-                   __func__, protocol, total_size);
-            s->target_send_bytes = total_size;
-            pebble_control_forward_to_target(s);
-            if (s->target_send_bytes) {
-                // If we couldn't pass it all on, break out and wait for the timer callback
-                // to send the rest out
-                break;
+        if (handler) {
+            pebble_control_ring_peek(&s->rcv, sizeof(hdr), s->frame_buf, data_len);
+            if (handler->callback(s, s->frame_buf, data_len)) {
+                pebble_control_ring_consume(&s->rcv, total_size);
+                continue;
             }
-        } else {
-            handler->callback(s, (uint8_t *)(hdr+1), data_len);
-            pebble_control_consume_rcv_bytes(s, total_size);
+        }
+
+        DPRINTF("%s: passing packet with protocol %d (%d bytes) onto target\n",
+               __func__, protocol, total_size);
+        s->target_send_bytes = total_size;
+        pebble_control_forward_to_target(s);
+        if (s->target_send_bytes) {
+            // If we couldn't pass it all on, break out and wait for the timer callback
+            // to send the rest out
+            break;
         }
 
     }
@@ -358,7 +500,7 @@ static int pebble_control_can_receive(void *opaque)
     PebbleControl *s = (PebbleControl *)opaque;
 
     /* How much space do we have in our buffer? */
-    return (PBLCONTROL_BUF_LEN - s->rcv_char_bytes);
+    return (PBLCONTROL_BUF_LEN - s->rcv.bytes);
 }
 
 static void pebble_control_receive(void *opaque, const uint8_t *buf, int size)
@@ -375,9 +517,7 @@ static void pebble_control_receive(void *opaque, const uint8_t *buf, int size)
 #endif
 
     // Copy the characters into our buffer first
-    assert (size <= PBLCONTROL_BUF_LEN - s->rcv_char_bytes);
-    memmove(s->rcv_char_buf + s->rcv_char_bytes, buf, size);
-    s->rcv_char_bytes += size;
+    pebble_control_ring_push(&s->rcv, buf, size);
 
     // Process any complete packets in the receive buffer
     pebble_control_parse_receive_buffer(s);
@@ -385,12 +525,21 @@ static void pebble_control_receive(void *opaque, const uint8_t *buf, int size)
 
 
 // -----------------------------------------------------------------------------------
-// Drop the first N bytes out of the beginning of the send buffer
-static void pebble_control_consume_send_bytes(PebbleControl *s, uint32_t n)
+// Send the complete packet of total_size bytes at the front of the send ring to the host
+// as a single write
+static void pebble_control_send_to_host(PebbleControl *s, uint32_t total_size)
 {
-    assert (n <= s->send_char_bytes);
-    s->send_char_bytes -= n;
-    memmove(&s->send_char_buf[0], &s->send_char_buf[n], s->send_char_bytes);
+    const uint8_t *frame = &s->send.buf[s->send.start];
+
+    if (pebble_control_ring_contig(&s->send) < total_size) {
+        pebble_control_ring_peek(&s->send, 0, s->frame_buf, total_size);
+        frame = s->frame_buf;
+    }
+    if (qemu_chr_fe_write_all(&s->chr, frame, total_size) <= 0) {
+        // Write error (e.g. TCP client disconnected), discard packet
+        DPRINTF("%s: write failed, dropping %d byte packet\n", __func__, total_size);
+    }
+    pebble_control_ring_consume(&s->send, total_size);
 }
 
 
@@ -400,75 +549,61 @@ static void pebble_control_consume_send_bytes(PebbleControl *s, uint32_t n)
 //  we don't interrupt one mid-stream by sending a packet from QEMU
 static int pebble_control_write(void *opaque, const uint8_t *buf, int len) {
     PebbleControl *s = (PebbleControl *)opaque;
+    int accepted = len;
 
     while (len) {
         // Copy the new bytes in
-        uint32_t space_left = sizeof(s->send_char_buf) - s->send_char_bytes;
+        uint32_t space_left = PBLCONTROL_BUF_LEN - s->send.bytes;
 
         if (space_left == 0) {
             EPRINTF("%s: overflowed send buffer, aborting queued up data\n", __func__);
-            s->send_char_bytes = 0;
-            space_left = sizeof(s->send_char_buf);
+            s->send.start = 0;
+            s->send.bytes = 0;
+            space_left = PBLCONTROL_BUF_LEN;
         }
         uint32_t bytes_to_copy = MIN(space_left, len);
-        memmove(&s->send_char_buf[s->send_char_bytes], buf, bytes_to_copy);
-        s->send_char_bytes += bytes_to_copy;
+        pebble_control_ring_push(&s->send, buf, bytes_to_copy);
+        buf += bytes_to_copy;
         len -= bytes_to_copy;
 
 
         // ------------------------------------------------------------------
-        // See if we have a complete packet yet
-        if (s->send_char_bytes < sizeof(QemuCommChannelHdr)
-                                 + sizeof(QemuCommChannelFooter)) {
-            break;
-        }
-        QemuCommChannelHdr *hdr = (QemuCommChannelHdr *)s->send_char_buf;
-
-        // Check the header signature
-        if (ntohs(hdr->signature) != QEMU_HEADER_SIGNATURE) {
-            DPRINTF("%s: invalid packet hdr signature detected\n", __func__);
-            pebble_control_consume_send_bytes(s, sizeof(hdr->signature));
-        }
-
-        // Validate the length
-        uint16_t data_len = ntohs(hdr->len);
-        if (data_len > QEMU_MAX_DATA_LEN) {
-            DPRINTF("%s: invalid packet hdr len detected\n", __func__);
-            pebble_control_consume_send_bytes(s, sizeof(*hdr));
-        }
+        // Send out every complete packet we have
+        while (s->send.bytes >= sizeof(QemuCommChannelHdr) + sizeof(QemuCommChannelFooter)) {
+            QemuCommChannelHdr hdr;
+            pebble_control_ring_peek(&s->send, 0, &hdr, sizeof(hdr));
+
+            // Check the header signature
+            if (ntohs(hdr.signature) != QEMU_HEADER_SIGNATURE) {
+                DPRINTF("%s: invalid packet hdr signature detected\n", __func__);
+                pebble_control_ring_consume(&s->send, sizeof(hdr.signature));
+                continue;
+            }
 
-        // If not a complete packet yet, break out
-        uint16_t total_size = sizeof(QemuCommChannelHdr) + data_len
-                                + sizeof(QemuCommChannelFooter);
-        if (s->send_char_bytes < total_size) {
-            if (len > 0) {
-                // If we still have not put in all the bytes the caller wanted,
-                // we must be off-frame because we ran out of room.
-                EPRINTF("%s: overflowed send buffer, aborting queued up data\n", __func__);
-                s->send_char_bytes = 0;
+            // Validate the length
+            uint16_t data_len = ntohs(hdr.len);
+            if (data_len > QEMU_MAX_DATA_LEN) {
+                DPRINTF("%s: invalid packet hdr len detected\n", __func__);
+                pebble_control_ring_consume(&s->send, sizeof(hdr));
                 continue;
             }
-            break;
-        }
 
-        // We have a complete packet, send it out the front end
-        int bytes_sent;
-        DPRINTF("%s: Sending packet of %d bytes to host (proto=0x%04x)\n",
-               __func__, total_size, ntohs(hdr->protocol));
-        while (total_size) {
-            bytes_sent = qemu_chr_fe_write_all(&s->chr, s->send_char_buf, total_size);
-            if (bytes_sent <= 0) {
-                // Write error (e.g. TCP client disconnected), discard packet
-                pebble_control_consume_send_bytes(s, total_size);
+            // If not a complete packet yet, wait for more bytes. A valid packet always
+            // fits in the ring, so this cannot leave it full.
+            uint16_t total_size = sizeof(QemuCommChannelHdr) + data_len
+                                    + sizeof(QemuCommChannelFooter);
+            if (s->send.bytes < total_size) {
                 break;
             }
-            total_size -= bytes_sent;
-            pebble_control_consume_send_bytes(s, bytes_sent);
-        }
 
+            // We have a complete packet, send it out the front end
+            DPRINTF("%s: Sending packet of %d bytes to host (proto=0x%04x)\n",
+                   __func__, total_size, ntohs(hdr.protocol));
+            pebble_control_send_to_host(s, total_size);
+        }
     }
 
-    return qemu_chr_fe_write_all(&s->chr, buf, len);
+    return accepted;
 }
 
 
@@ -476,23 +611,24 @@ static int pebble_control_write(void *opaque, const uint8_t *buf, int len) {
 static void pebble_control_send_packet(PebbleControl *s, QemuProtocol protocol, void *data,
                                 uint32_t len)
 {
-  // Send the header
+  uint8_t packet[PBLCONTROL_BUF_LEN];
+
+  assert(len <= QEMU_MAX_DATA_LEN);
+
+  // Header, data and footer go out in one write
   QemuCommChannelHdr hdr = (QemuCommChannelHdr) {
     .signature = htons(QEMU_HEADER_SIGNATURE),
     .protocol = htons(protocol),
     .len = htons(len)
   };
-  qemu_chr_fe_write_all(&s->chr, (uint8_t *)&hdr, sizeof(hdr));
-
-  // Send the data
-  qemu_chr_fe_write_all(&s->chr, data, len);
-
-  // Send the footer
   QemuCommChannelFooter footer = (QemuCommChannelFooter) {
     .signature = htons(QEMU_FOOTER_SIGNATURE)
   };
+  memcpy(packet, &hdr, sizeof(hdr));
+  memcpy(packet + sizeof(hdr), data, len);
+  memcpy(packet + sizeof(hdr) + len, &footer, sizeof(footer));
 
-  qemu_chr_fe_write_all(&s->chr, (uint8_t *)&footer, sizeof(footer));
+  qemu_chr_fe_write_all(&s->chr, packet, sizeof(hdr) + len + sizeof(footer));
 }
 
 // -----------------------------------------------------------------------------------
@@ -507,6 +643,43 @@ void pebble_control_send_vibe_notification(PebbleControl *s, bool on)
     pebble_control_send_packet(s, QemuProtocol_Vibration, &hdr, sizeof(hdr));
 }
 
+// -----------------------------------------------------------------------------------
+// Migration. PebbleControl is not a qdev, so pebble_control_create() registers this
+// directly. A packet that was part-way through being forwarded to the target UART
+// stays at the front of rcv, so kick the pump timer again after a load.
+static int pebble_control_post_load(void *opaque, int version_id)
+{
+    PebbleControl *s = (PebbleControl *)opaque;
+
+    if (s->rcv.bytes > PBLCONTROL_BUF_LEN || s->send.bytes > PBLCONTROL_BUF_LEN
+        || s->rcv.start >= PBLCONTROL_BUF_LEN || s->send.start >= PBLCONTROL_BUF_LEN
+        || s->target_send_bytes > s->rcv.bytes) {
+        return -EINVAL;
+    }
+    if (s->target_send_bytes) {
+        timer_mod(s->target_send_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) + 1);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_pebble_control = {
+    .name = "pebble-control",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = pebble_control_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT8_ARRAY(rcv.buf, PebbleControl, PBLCONTROL_BUF_LEN),
+        VMSTATE_UINT32(rcv.bytes, PebbleControl),
+        VMSTATE_UINT32(rcv.start, PebbleControl),
+        VMSTATE_UINT32(target_send_bytes, PebbleControl),
+        VMSTATE_UINT8_ARRAY(send.buf, PebbleControl, PBLCONTROL_BUF_LEN),
+        VMSTATE_UINT32(send.bytes, PebbleControl),
+        VMSTATE_UINT32(send.start, PebbleControl),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+
 // -----------------------------------------------------------------------------------
 PebbleControl *pebble_control_create(Chardev *chr, Stm32Uart *uart)
 {
@@ -536,6 +709,8 @@ PebbleControl *pebble_control_create(Chardev *chr, Stm32Uart *uart)
                         (void *)s,
                         NULL,
                         true);
+
+        vmstate_register(NULL, VMSTATE_INSTANCE_ID_ANY, &vmstate_pebble_control, s);
     }
 
     return s;
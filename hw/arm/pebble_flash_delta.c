@@ -0,0 +1,380 @@
+/*
+ * Pebble storage flash copy-on-write delta.
+ *
+ * The 16MB NOR flash used to be backed directly by a raw drive, so every boot
+ * either rewrote the image in place (native) or FS.writeFile'd the whole image
+ * into MEMFS (web) and lost the changes on reload. Instead, the pflash is
+ * registered without a drive and this module:
+ *
+ *   - copies the pristine image from the (read-only) "spi-flash" drive into
+ *     the pflash RAM,
+ *   - replays a sidecar log of sector records on top of it,
+ *   - subscribes to the pflash write notifier (pebble_pflash_notify.c) and
+ *     marks the sectors it reports dirty,
+ *   - periodically appends only the changed sectors to the log.
+ *
+ * Log format (little endian):
+ *   header:  "PBLDELTA" u32 version, u32 sector_size, u32 flash_size, u32 reserved
+ *   records: u32 sector index, sector_size bytes of data
+ * Later records for the same sector win. A torn record at the end of the file
+ * (crash in the middle of a sync) is ignored. The log is compacted to one
+ * record per sector every time it is loaded.
+ *
+ * While a delta is attached the pflash RAM is not migrated: a machine image
+ * only resumes correctly on top of the same pristine image and log.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/notify.h"
+#include "qemu/timer.h"
+#include "hw/sysbus.h"
+#include "migration/vmstate.h"
+#include "system/address-spaces.h"
+#include "system/block-backend.h"
+#include "system/system.h"
+
+#include "pebble_flash_delta.h"
+#include "pebble_pflash_notify.h"
+
+//#define DEBUG_PEBBLE_FLASH_DELTA
+#ifdef DEBUG_PEBBLE_FLASH_DELTA
+#define DPRINTF(fmt, ...)                                     \
+    do { printf("PEBBLE_FLASH_DELTA: " fmt , ## __VA_ARGS__); \
+    } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define PEBBLE_FLASH_DELTA_MAGIC        "PBLDELTA"
+#define PEBBLE_FLASH_DELTA_VERSION      1
+#define PEBBLE_FLASH_DELTA_SYNC_MS      2000
+
+typedef struct QEMU_PACKED {
+    char magic[8];
+    uint32_t version;
+    uint32_t sector_size;
+    uint32_t flash_size;
+    uint32_t reserved;
+} PebbleFlashDeltaHdr;
+
+typedef struct PebbleFlashDelta {
+    MemoryRegion *mr;
+    uint8_t *storage;
+    uint32_t flash_size;
+    uint32_t sector_size;
+    uint32_t num_sectors;
+
+    /* Sectors written since the last sync, and the hash of their contents as
+     * last persisted, so unlock cycles and no-op programs don't hit the log. */
+    unsigned long *dirty;
+    uint64_t *persisted_hash;
+
+    char *path;
+    FILE *log;
+    QEMUTimer *sync_timer;
+    Notifier write_notifier;
+    Notifier exit_notifier;
+} PebbleFlashDelta;
+
+static PebbleFlashDelta *flash_delta;
+
+static uint64_t pebble_flash_delta_hash(PebbleFlashDelta *s, uint32_t sector)
+{
+    const uint8_t *p = s->storage + (size_t)sector * s->sector_size;
+    uint64_t h = 0xcbf29ce484222325ULL;     /* FNV-1a, 64-bit lanes */
+
+    for (uint32_t i = 0; i < s->sector_size; i += 8) {
+        h = (h ^ ldq_le_p(p + i)) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void pebble_flash_delta_mark(PebbleFlashDelta *s, uint32_t sector)
+{
+    if (!test_and_set_bit(sector, s->dirty)) {
+        /* Not modified since the last sync: the RAM still holds what the log
+         * (or the pristine image) has, so remember that before the write. */
+        s->persisted_hash[sector] = pebble_flash_delta_hash(s, sector);
+    }
+}
+
+/* Mark every sector overlapping [offset, offset + len) */
+static void pebble_flash_delta_mark_range(PebbleFlashDelta *s, hwaddr offset,
+                                          hwaddr len)
+{
+    hwaddr end = MIN(offset + len, s->flash_size);
+
+    if (offset >= end) {
+        return;
+    }
+    for (uint32_t i = offset / s->sector_size; i <= (end - 1) / s->sector_size; i++) {
+        pebble_flash_delta_mark(s, i);
+    }
+}
+
+static void pebble_flash_delta_write(Notifier *n, void *data)
+{
+    PebbleFlashDelta *s = container_of(n, PebbleFlashDelta, write_notifier);
+    PebblePflashWrite *w = data;
+
+    pebble_flash_delta_mark_range(s, w->offset, w->len);
+}
+
+void pebble_flash_delta_mark_dirty(hwaddr offset, hwaddr len)
+{
+    if (flash_delta) {
+        pebble_flash_delta_mark_range(flash_delta, offset, len);
+    }
+}
+
+static bool pebble_flash_delta_write_record(PebbleFlashDelta *s, FILE *f,
+                                            uint32_t sector)
+{
+    uint32_t idx = cpu_to_le32(sector);
+
+    return fwrite(&idx, sizeof(idx), 1, f) == 1 &&
+           fwrite(s->storage + (size_t)sector * s->sector_size,
+                  s->sector_size, 1, f) == 1;
+}
+
+static bool pebble_flash_delta_write_hdr(PebbleFlashDelta *s, FILE *f)
+{
+    PebbleFlashDeltaHdr hdr = {
+        .version = cpu_to_le32(PEBBLE_FLASH_DELTA_VERSION),
+        .sector_size = cpu_to_le32(s->sector_size),
+        .flash_size = cpu_to_le32(s->flash_size),
+    };
+
+    memcpy(hdr.magic, PEBBLE_FLASH_DELTA_MAGIC, sizeof(hdr.magic));
+    return fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+}
+
+/* Apply the log at s->path to the flash RAM. Sectors it contains are set in
+ * present. A missing log is not an error. */
+static bool pebble_flash_delta_replay(PebbleFlashDelta *s, unsigned long *present)
+{
+    PebbleFlashDeltaHdr hdr;
+    uint32_t idx;
+    uint8_t *buf;
+    unsigned records = 0;
+    FILE *f = fopen(s->path, "rb");
+
+    if (!f) {
+        return errno == ENOENT;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, PEBBLE_FLASH_DELTA_MAGIC, sizeof(hdr.magic)) ||
+        le32_to_cpu(hdr.version) != PEBBLE_FLASH_DELTA_VERSION ||
+        le32_to_cpu(hdr.sector_size) != s->sector_size ||
+        le32_to_cpu(hdr.flash_size) != s->flash_size) {
+        error_report("pebble: %s is not a flash delta for this machine", s->path);
+        fclose(f);
+        return false;
+    }
+
+    buf = g_malloc(s->sector_size);
+    while (fread(&idx, sizeof(idx), 1, f) == 1) {
+        idx = le32_to_cpu(idx);
+        if (fread(buf, s->sector_size, 1, f) != 1) {
+            warn_report("pebble: ignoring torn record at the end of %s", s->path);
+            break;
+        }
+        if (idx >= s->num_sectors) {
+            error_report("pebble: %s: bad sector index %u", s->path, idx);
+            break;
+        }
+        memcpy(s->storage + (size_t)idx * s->sector_size, buf, s->sector_size);
+        set_bit(idx, present);
+        records++;
+    }
+    g_free(buf);
+    fclose(f);
+
+    DPRINTF("replayed %u records from %s\n", records, s->path);
+    return true;
+}
+
+/* Rewrite the log with one record per present sector, then reopen it for
+ * appending. */
+static bool pebble_flash_delta_compact(PebbleFlashDelta *s, unsigned long *present)
+{
+    g_autofree char *tmp_path = g_strdup_printf("%s.tmp", s->path);
+    unsigned long sector;
+    bool ok;
+    FILE *f = fopen(tmp_path, "wb");
+
+    if (!f) {
+        error_report("pebble: cannot create %s: %s", tmp_path, strerror(errno));
+        return false;
+    }
+
+    ok = pebble_flash_delta_write_hdr(s, f);
+    for (sector = find_first_bit(present, s->num_sectors);
+         ok && sector < s->num_sectors;
+         sector = find_next_bit(present, s->num_sectors, sector + 1)) {
+        ok = pebble_flash_delta_write_record(s, f, sector);
+    }
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmp_path, s->path) != 0) {
+        error_report("pebble: cannot write %s: %s", s->path, strerror(errno));
+        unlink(tmp_path);
+        return false;
+    }
+
+    s->log = fopen(s->path, "ab");
+    if (!s->log) {
+        error_report("pebble: cannot open %s: %s", s->path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void pebble_flash_delta_sync(void)
+{
+    PebbleFlashDelta *s = flash_delta;
+    unsigned long sector;
+    unsigned records = 0;
+
+    if (!s || !s->log) {
+        return;
+    }
+
+    for (sector = find_first_bit(s->dirty, s->num_sectors);
+         sector < s->num_sectors;
+         sector = find_next_bit(s->dirty, s->num_sectors, sector + 1)) {
+        uint64_t h = pebble_flash_delta_hash(s, sector);
+
+        clear_bit(sector, s->dirty);
+        if (h == s->persisted_hash[sector]) {
+            continue;
+        }
+        if (!pebble_flash_delta_write_record(s, s->log, sector)) {
+            error_report("pebble: flash delta write failed: %s", strerror(errno));
+            /* Retry on the next sync */
+            set_bit(sector, s->dirty);
+            break;
+        }
+        s->persisted_hash[sector] = h;
+        records++;
+    }
+
+    if (records) {
+        fflush(s->log);
+        qemu_fdatasync(fileno(s->log));
+        DPRINTF("synced %u sectors to %s\n", records, s->path);
+    }
+}
+
+static void pebble_flash_delta_timer_cb(void *opaque)
+{
+    PebbleFlashDelta *s = opaque;
+
+    pebble_flash_delta_sync();
+    timer_mod(s->sync_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + PEBBLE_FLASH_DELTA_SYNC_MS);
+}
+
+static void pebble_flash_delta_exit(Notifier *n, void *data)
+{
+    pebble_flash_delta_sync();
+}
+
+bool pebble_flash_delta_init(hwaddr flash_base, uint32_t flash_size,
+                             uint32_t sector_size, BlockBackend *blk,
+                             const char *delta_path)
+{
+    PebbleFlashDelta *s;
+    MemoryRegionSection section;
+    unsigned long *present;
+    uint32_t pristine_len = 0;
+    bool ok;
+
+    assert(!flash_delta);
+    assert(flash_size % sector_size == 0 && sector_size % 8 == 0);
+
+    section = memory_region_find(get_system_memory(), flash_base, 1);
+    if (!section.mr || !memory_region_get_ram_ptr(section.mr) ||
+        !section.mr->ops || !section.mr->ops->write) {
+        error_report("pebble: no pflash at 0x%" HWADDR_PRIx " for the flash delta",
+                     flash_base);
+        if (section.mr) {
+            memory_region_unref(section.mr);
+        }
+        return false;
+    }
+
+    s = g_new0(PebbleFlashDelta, 1);
+    s->mr = section.mr;
+    s->storage = memory_region_get_ram_ptr(s->mr);
+    s->flash_size = flash_size;
+    s->sector_size = sector_size;
+    s->num_sectors = flash_size / sector_size;
+    s->dirty = bitmap_new(s->num_sectors);
+    s->persisted_hash = g_new0(uint64_t, s->num_sectors);
+    s->path = g_strdup(delta_path);
+    memory_region_unref(section.mr);
+
+    /* Pristine image */
+    if (blk) {
+        int64_t len = blk_getlength(blk);
+
+        pristine_len = len < 0 ? 0 : MIN(len, flash_size);
+        if (pristine_len &&
+            blk_pread(blk, 0, pristine_len, s->storage, 0) < 0) {
+            error_report("pebble: cannot read pristine flash image");
+            pristine_len = 0;
+        }
+    }
+    memset(s->storage + pristine_len, 0xFF, flash_size - pristine_len);
+
+    present = bitmap_new(s->num_sectors);
+    ok = pebble_flash_delta_replay(s, present) &&
+         pebble_flash_delta_compact(s, present);
+    fprintf(stderr, "pebble: flash delta %s: %lu modified sectors\n",
+            s->path, (unsigned long)bitmap_count_one(present, s->num_sectors));
+    g_free(present);
+    if (!ok) {
+        /* Keep running on the in-RAM copy; nothing will be persisted */
+        error_report("pebble: flash changes will not be saved");
+    }
+
+    flash_delta = s;
+
+    /* The flash contents are the pristine image plus the log, so migration
+     * leaves the 16MB pflash RAM out; make_snapshot.sh ships the log next to
+     * the machine image instead. */
+    vmstate_unregister_ram(s->mr, DEVICE(s->mr->owner));
+
+    s->write_notifier.notify = pebble_flash_delta_write;
+    if (!pebble_pflash_add_write_notifier(&s->write_notifier)) {
+        error_report("pebble: flash writes are not watched, "
+                     "changes will not be saved");
+    }
+
+    s->sync_timer = timer_new_ms(QEMU_CLOCK_REALTIME, pebble_flash_delta_timer_cb, s);
+    timer_mod(s->sync_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + PEBBLE_FLASH_DELTA_SYNC_MS);
+
+    s->exit_notifier.notify = pebble_flash_delta_exit;
+    qemu_add_exit_notifier(&s->exit_notifier);
+
+    return true;
+}
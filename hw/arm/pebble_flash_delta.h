@@ -0,0 +1,33 @@
+#ifndef PEBBLE_FLASH_DELTA_H
+#define PEBBLE_FLASH_DELTA_H
+
+#include "qemu/typedefs.h"
+#include "exec/hwaddr.h"
+
+/* Copy-on-write backend for the NOR storage flash.
+ *
+ * The pristine image (blk, usually opened readonly=on) is copied into the
+ * pflash RAM at boot and never written back. Sectors the firmware programs
+ * or erases are appended to a small sidecar log at delta_path, which is
+ * replayed on top of the pristine image on the next boot. The pflash RAM is
+ * left out of migration, so a machine image has to be resumed with the log
+ * it was taken with.
+ *
+ * flash_base: guest physical address of a pflash_cfi02 registered with blk=NULL
+ * blk:        pristine image (may be NULL for an empty, all-0xFF flash)
+ * delta_path: sidecar log file, created if it does not exist
+ */
+bool pebble_flash_delta_init(hwaddr flash_base, uint32_t flash_size,
+                             uint32_t sector_size, BlockBackend *blk,
+                             const char *delta_path);
+
+/* Mark the sectors overlapping [offset, offset + len) as modified, for
+ * writes to the flash RAM that bypass the pflash (rewind restores). Call it
+ * before the write. No-op without a delta. */
+void pebble_flash_delta_mark_dirty(hwaddr offset, hwaddr len);
+
+/* Append every modified sector to the log now (also runs periodically and
+ * at exit). */
+void pebble_flash_delta_sync(void);
+
+#endif /* PEBBLE_FLASH_DELTA_H */
@@ -0,0 +1,110 @@
+/*
+ * Pebble storage flash write notifier.
+ *
+ * The flash delta and the rewind checkpoints both need to know which
+ * sectors the firmware programs or erases. They used to interpose the pflash
+ * write op separately, each with its own copy of the chip-erase decoding, so
+ * the result depended on which one was installed last. This module owns the
+ * interposed op and the decoding; both features register a Notifier.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "hw/sysbus.h"
+#include "system/address-spaces.h"
+
+#include "pebble_pflash_notify.h"
+
+/* pflash_cfi02 decodes commands on the low 11 bits of the word offset */
+#define PFLASH_UNLOCK_ADDR0             0x555
+#define PFLASH_CMD_CHIP_ERASE           0x10
+
+typedef struct PebblePflashNotify {
+    MemoryRegion *mr;
+    uint64_t flash_size;
+    uint32_t sector_size;
+
+    /* pflash ops with .write interposed */
+    const MemoryRegionOps *orig_ops;
+    MemoryRegionOps ops;
+
+    NotifierList write_notifiers;
+} PebblePflashNotify;
+
+static PebblePflashNotify *pflash_notify;
+
+static void pebble_pflash_notify_write(void *opaque, hwaddr addr,
+                                       uint64_t value, unsigned size)
+{
+    PebblePflashNotify *s = pflash_notify;
+    PebblePflashWrite w;
+
+    if (((addr >> 1) & 0x7FF) == PFLASH_UNLOCK_ADDR0 &&
+        (value & 0xFF) == PFLASH_CMD_CHIP_ERASE) {
+        w.offset = 0;
+        w.len = s->flash_size;
+        notifier_list_notify(&s->write_notifiers, &w);
+    } else if (addr < s->flash_size) {
+        w.offset = addr & ~(hwaddr)(s->sector_size - 1);
+        w.len = s->sector_size;
+        notifier_list_notify(&s->write_notifiers, &w);
+    }
+
+    s->orig_ops->write(opaque, addr, value, size);
+}
+
+bool pebble_pflash_notify_init(hwaddr flash_base, uint32_t sector_size)
+{
+    PebblePflashNotify *s;
+    MemoryRegionSection section;
+
+    assert(!pflash_notify);
+    assert(is_power_of_2(sector_size));
+
+    section = memory_region_find(get_system_memory(), flash_base, 1);
+    if (!section.mr || !section.mr->ops || !section.mr->ops->write) {
+        error_report("pebble: no pflash at 0x%" HWADDR_PRIx " to watch",
+                     flash_base);
+        if (section.mr) {
+            memory_region_unref(section.mr);
+        }
+        return false;
+    }
+
+    s = g_new0(PebblePflashNotify, 1);
+    s->mr = section.mr;
+    s->flash_size = memory_region_size(s->mr);
+    s->sector_size = sector_size;
+    notifier_list_init(&s->write_notifiers);
+    memory_region_unref(section.mr);
+
+    s->orig_ops = s->mr->ops;
+    s->ops = *s->mr->ops;
+    s->ops.write = pebble_pflash_notify_write;
+    s->mr->ops = &s->ops;
+
+    pflash_notify = s;
+    return true;
+}
+
+bool pebble_pflash_add_write_notifier(Notifier *n)
+{
+    if (!pflash_notify) {
+        return false;
+    }
+    notifier_list_add(&pflash_notify->write_notifiers, n);
+    return true;
+}
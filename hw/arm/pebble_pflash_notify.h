@@ -0,0 +1,29 @@
+#ifndef PEBBLE_PFLASH_NOTIFY_H
+#define PEBBLE_PFLASH_NOTIFY_H
+
+#include "qemu/typedefs.h"
+#include "qemu/notify.h"
+#include "exec/hwaddr.h"
+
+/* Write notifier for the NOR storage flash.
+ *
+ * pflash_cfi02 keeps the array in a ROM device and applies programs and
+ * erases from its MMIO write op, so that is the only place flash content
+ * changes. This module interposes that op once and tells every subscriber
+ * which byte range a guest write may modify before the write is applied:
+ * the whole flash for a chip erase, otherwise the sector containing the
+ * address. The flash delta and the rewind checkpoints both subscribe.
+ */
+typedef struct PebblePflashWrite {
+    hwaddr offset;
+    hwaddr len;
+} PebblePflashWrite;
+
+/* flash_base: guest physical address of a registered pflash_cfi02 */
+bool pebble_pflash_notify_init(hwaddr flash_base, uint32_t sector_size);
+
+/* n->notify is called with a PebblePflashWrite *. Returns false if no
+ * notifier has been set up. */
+bool pebble_pflash_add_write_notifier(Notifier *n);
+
+#endif /* PEBBLE_PFLASH_NOTIFY_H */
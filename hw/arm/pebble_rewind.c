@@ -0,0 +1,689 @@
+/*
+ * Pebble time-travel checkpoints.
+ *
+ * Reproducing a rendering glitch used to mean rebooting and re-navigating to
+ * it. With PEBBLE_REWIND_MS=<K> this module keeps a ring of checkpoints taken
+ * every K virtual milliseconds so the UI can be stepped back and replayed.
+ *
+ * Each checkpoint is the device state (qemu_save_device_state, i.e. every
+ * VMState except RAM, including the virtual clock) plus only the memory pages
+ * written since the previous checkpoint:
+ *
+ *   - SRAM, CCM and SDRAM pages come from the DIRTY_MEMORY_VGA dirty log,
+ *   - storage flash is a ROM device written through its MMIO ops, so writes
+ *     come from the pflash write notifier (the whole sector per write, since
+ *     an erase is a single command write).
+ *
+ * The oldest checkpoint in the ring is a full copy; when the ring is full the
+ * next one is folded into it. Restoring checkpoint j copies back, for every
+ * page written after j, the newest version at or before j.
+ *
+ * Button input is journaled with its virtual timestamp so that the replay
+ * after a step-back sees the same input; with -icount the replay is then
+ * deterministic up to the host-time based RTC.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "hw/sysbus.h"
+#include "io/channel-buffer.h"
+#include "migration/qemu-file.h"
+#include "migration/savevm.h"
+#include "system/address-spaces.h"
+#include "system/runstate.h"
+#include "hw/arm/pebble.h"
+
+#include "pebble_flash_delta.h"
+#include "pebble_pflash_notify.h"
+#include "pebble_rewind.h"
+
+//#define DEBUG_PEBBLE_REWIND
+#ifdef DEBUG_PEBBLE_REWIND
+#define DPRINTF(fmt, ...)                                 \
+    do { printf("PEBBLE_REWIND: " fmt , ## __VA_ARGS__);  \
+    } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define REWIND_PAGE_SIZE        4096
+#define REWIND_MAX_REGIONS      4
+#define REWIND_DEFAULT_DEPTH    64
+#define REWIND_POLL_MS          50
+
+typedef struct RewindRegion {
+    const char *name;
+    MemoryRegion *mr;
+    hwaddr base;
+    uint64_t size;
+    uint32_t num_pages;
+    uint8_t *host;
+    bool is_ram;                /* false: ROM device, tracked by notifier */
+    unsigned long *pending;     /* written since the newest checkpoint */
+} RewindRegion;
+
+typedef struct RewindCheckpoint {
+    int64_t vtime_ns;
+    uint8_t *devstate;
+    size_t devstate_len;
+    /* pages[i] holds the pages set in dirty[i], packed in page order. The
+     * oldest checkpoint has every bit set. */
+    unsigned long *dirty[REWIND_MAX_REGIONS];
+    uint8_t *pages[REWIND_MAX_REGIONS];
+} RewindCheckpoint;
+
+typedef struct RewindInput {
+    int64_t vtime_ns;
+    uint32_t button_state;
+} RewindInput;
+
+typedef struct PebbleRewind {
+    RewindRegion region[REWIND_MAX_REGIONS];
+    int num_regions;
+    RewindRegion *flash;
+    Notifier flash_notifier;
+
+    int64_t interval_ns;
+    uint32_t depth;
+    GPtrArray *ring;            /* RewindCheckpoint *, oldest first */
+
+    GArray *journal;            /* RewindInput, in time order */
+    bool replaying;
+    guint replay_next;
+    int64_t replay_target_ns;
+
+    QEMUTimer *checkpoint_timer;
+    QEMUTimer *stop_timer;      /* end of a step-back replay */
+    QEMUTimer *input_timer;     /* next journaled input during replay */
+    QEMUTimer *poll_timer;      /* realtime, so requests work while paused */
+    QEMUBH *bh;
+
+    bool want_checkpoint;
+    bool want_stop;
+    uint32_t request_ms;        /* atomic */
+    uint32_t request_resume;    /* atomic */
+} PebbleRewind;
+
+static PebbleRewind *rewind_state;
+
+/* ====================================================================
+ * Dirty tracking
+ * ==================================================================== */
+static void pebble_rewind_flash_write(Notifier *n, void *data)
+{
+    PebbleRewind *s = container_of(n, PebbleRewind, flash_notifier);
+    PebblePflashWrite *w = data;
+    RewindRegion *r = s->flash;
+    hwaddr end = MIN(w->offset + w->len, r->size);
+
+    if (w->offset < end) {
+        unsigned long first = w->offset / REWIND_PAGE_SIZE;
+
+        bitmap_set(r->pending, first,
+                   DIV_ROUND_UP(end, REWIND_PAGE_SIZE) - first);
+    }
+}
+
+/* Move the RAM dirty log into each region's pending bitmap */
+static void pebble_rewind_collect_dirty(PebbleRewind *s)
+{
+    for (int i = 0; i < s->num_regions; i++) {
+        RewindRegion *r = &s->region[i];
+        DirtyBitmapSnapshot *snap;
+
+        if (!r->is_ram) {
+            continue;
+        }
+        snap = memory_region_snapshot_and_clear_dirty(r->mr, 0, r->size,
+                                                      DIRTY_MEMORY_VGA);
+        for (uint32_t p = 0; p < r->num_pages; p++) {
+            if (memory_region_snapshot_get_dirty(r->mr, snap,
+                                                 (hwaddr)p * REWIND_PAGE_SIZE,
+                                                 REWIND_PAGE_SIZE)) {
+                set_bit(p, r->pending);
+            }
+        }
+        g_free(snap);
+    }
+}
+
+/* ====================================================================
+ * Checkpoints
+ * ==================================================================== */
+static void pebble_rewind_checkpoint_free(gpointer data)
+{
+    RewindCheckpoint *c = data;
+
+    for (int i = 0; i < REWIND_MAX_REGIONS; i++) {
+        g_free(c->dirty[i]);
+        g_free(c->pages[i]);
+    }
+    g_free(c->devstate);
+    g_free(c);
+}
+
+static bool pebble_rewind_save_devices(RewindCheckpoint *c)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(64 * KiB);
+    QEMUFile *f = qemu_file_new_output(QIO_CHANNEL(bioc));
+    int ret;
+
+    ret = qemu_save_device_state(f);
+    qemu_fflush(f);
+    if (!ret) {
+        ret = qemu_file_get_error(f);
+    }
+    /* Closing the QEMUFile closes (and empties) the buffer channel */
+    c->devstate_len = bioc->usage;
+    c->devstate = g_memdup2(bioc->data, bioc->usage);
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+
+    if (ret) {
+        error_report("pebble: rewind: saving device state failed: %d", ret);
+    }
+    return !ret;
+}
+
+/* The saved stream starts with the savevm header and configuration
+ * section, so it is loaded like a whole (RAM-less) snapshot, as
+ * xen_load_devices_state() does. */
+static bool pebble_rewind_load_devices(RewindCheckpoint *c)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(c->devstate_len);
+    QEMUFile *f;
+    int ret;
+
+    memcpy(bioc->data, c->devstate, c->devstate_len);
+    bioc->usage = c->devstate_len;
+    f = qemu_file_new_input(QIO_CHANNEL(bioc));
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+
+    if (ret) {
+        error_report("pebble: rewind: loading device state failed: %d", ret);
+    }
+    return !ret;
+}
+
+/* Called with the VM stopped */
+static void pebble_rewind_take_checkpoint(PebbleRewind *s)
+{
+    RewindCheckpoint *c = g_new0(RewindCheckpoint, 1);
+    bool full = s->ring->len == 0;
+    size_t bytes = 0;
+
+    c->vtime_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    pebble_rewind_collect_dirty(s);
+
+    for (int i = 0; i < s->num_regions; i++) {
+        RewindRegion *r = &s->region[i];
+        unsigned long p, n;
+        uint8_t *dst;
+
+        if (full) {
+            bitmap_fill(r->pending, r->num_pages);
+        }
+        n = bitmap_count_one(r->pending, r->num_pages);
+
+        c->dirty[i] = r->pending;
+        r->pending = bitmap_new(r->num_pages);
+        c->pages[i] = dst = g_malloc(n * REWIND_PAGE_SIZE);
+        for (p = find_first_bit(c->dirty[i], r->num_pages); p < r->num_pages;
+             p = find_next_bit(c->dirty[i], r->num_pages, p + 1)) {
+            memcpy(dst, r->host + p * REWIND_PAGE_SIZE, REWIND_PAGE_SIZE);
+            dst += REWIND_PAGE_SIZE;
+        }
+        bytes += n * REWIND_PAGE_SIZE;
+    }
+
+    if (!pebble_rewind_save_devices(c)) {
+        /* Keep the pages pending so the next checkpoint still covers them */
+        for (int i = 0; i < s->num_regions; i++) {
+            bitmap_or(s->region[i].pending, s->region[i].pending, c->dirty[i],
+                      s->region[i].num_pages);
+        }
+        pebble_rewind_checkpoint_free(c);
+        return;
+    }
+
+    g_ptr_array_add(s->ring, c);
+    DPRINTF("checkpoint %u at %" PRId64 " ms: %zu KB pages, %zu B devices\n",
+            s->ring->len - 1, c->vtime_ns / SCALE_MS, bytes / KiB,
+            c->devstate_len);
+
+    /* Fold the oldest incremental checkpoint into the full base copy */
+    if (s->ring->len > s->depth) {
+        RewindCheckpoint *base = g_ptr_array_index(s->ring, 0);
+        RewindCheckpoint *next = g_ptr_array_index(s->ring, 1);
+        guint drop = 0;
+
+        for (int i = 0; i < s->num_regions; i++) {
+            RewindRegion *r = &s->region[i];
+            const uint8_t *src = next->pages[i];
+            unsigned long p;
+
+            for (p = find_first_bit(next->dirty[i], r->num_pages); p < r->num_pages;
+                 p = find_next_bit(next->dirty[i], r->num_pages, p + 1)) {
+                memcpy(base->pages[i] + p * REWIND_PAGE_SIZE, src, REWIND_PAGE_SIZE);
+                src += REWIND_PAGE_SIZE;
+            }
+        }
+        base->vtime_ns = next->vtime_ns;
+        g_free(base->devstate);
+        base->devstate = next->devstate;
+        base->devstate_len = next->devstate_len;
+        next->devstate = NULL;
+        g_ptr_array_remove_index(s->ring, 1);
+
+        while (drop < s->journal->len &&
+               g_array_index(s->journal, RewindInput, drop).vtime_ns <= base->vtime_ns) {
+            drop++;
+        }
+        g_array_remove_range(s->journal, 0, drop);
+    }
+}
+
+/* Called with the VM stopped. Returns to the state of ring[j] and drops
+ * every later checkpoint. On failure no memory has been written and the
+ * ring is unchanged, but the devices may be partly loaded. */
+static bool pebble_rewind_restore(PebbleRewind *s, guint j)
+{
+    RewindCheckpoint *c = g_ptr_array_index(s->ring, j);
+
+    /* Devices go first since that is the only step that can fail. None of
+     * their post_load hooks read guest memory, so they do not need the pages
+     * restored before them. */
+    if (!pebble_rewind_load_devices(c)) {
+        return false;
+    }
+
+    pebble_rewind_collect_dirty(s);
+
+    for (int i = 0; i < s->num_regions; i++) {
+        RewindRegion *r = &s->region[i];
+        unsigned long *restore = r->pending;
+        const uint8_t **src = g_new0(const uint8_t *, r->num_pages);
+        unsigned long p;
+
+        /* Pages written after checkpoint j... */
+        for (guint k = j + 1; k < s->ring->len; k++) {
+            RewindCheckpoint *later = g_ptr_array_index(s->ring, k);
+            bitmap_or(restore, restore, later->dirty[i], r->num_pages);
+        }
+
+        /* ...take their newest version at or before j */
+        for (guint k = 0; k <= j; k++) {
+            RewindCheckpoint *older = g_ptr_array_index(s->ring, k);
+            const uint8_t *data = older->pages[i];
+
+            for (p = find_first_bit(older->dirty[i], r->num_pages); p < r->num_pages;
+                 p = find_next_bit(older->dirty[i], r->num_pages, p + 1)) {
+                if (test_bit(p, restore)) {
+                    src[p] = data;
+                }
+                data += REWIND_PAGE_SIZE;
+            }
+        }
+
+        for (p = find_first_bit(restore, r->num_pages); p < r->num_pages;
+             p = find_next_bit(restore, r->num_pages, p + 1)) {
+            hwaddr offset = (hwaddr)p * REWIND_PAGE_SIZE;
+
+            if (r->is_ram) {
+                /* Goes through the memory API so stale TBs are invalidated */
+                address_space_write(&address_space_memory, r->base + offset,
+                                    MEMTXATTRS_UNSPECIFIED, src[p],
+                                    REWIND_PAGE_SIZE);
+            } else {
+                /* The flash delta only sees writes through the pflash */
+                pebble_flash_delta_mark_dirty(offset, REWIND_PAGE_SIZE);
+                memcpy(r->host + offset, src[p], REWIND_PAGE_SIZE);
+            }
+        }
+        g_free(src);
+
+        /* pflash_cfi02 has no VMState, so a half-entered command sequence or
+         * a pending erase would survive the rewind; back to read-array mode,
+         * as after the firmware issues a reset command. */
+        if (!r->is_ram) {
+            device_cold_reset(DEVICE(r->mr->owner));
+        }
+
+        bitmap_zero(r->pending, r->num_pages);
+        if (r->is_ram) {
+            memory_region_reset_dirty(r->mr, 0, r->size, DIRTY_MEMORY_VGA);
+        }
+    }
+
+    if (j + 1 < s->ring->len) {
+        g_ptr_array_remove_range(s->ring, j + 1, s->ring->len - j - 1);
+    }
+    return true;
+}
+
+/* ====================================================================
+ * Step back / replay
+ * ==================================================================== */
+static void pebble_rewind_arm_input(PebbleRewind *s)
+{
+    if (s->replaying && s->replay_next < s->journal->len) {
+        timer_mod(s->input_timer,
+                  g_array_index(s->journal, RewindInput, s->replay_next).vtime_ns);
+    } else {
+        timer_del(s->input_timer);
+    }
+}
+
+static void pebble_rewind_do_step_back(PebbleRewind *s, uint32_t ms)
+{
+    RewindCheckpoint *c;
+    RewindCheckpoint undo = { 0 };
+    bool was_running = runstate_is_running();
+    int64_t now, target;
+    guint j, keep;
+
+    if (!s->ring->len) {
+        return;
+    }
+
+    if (was_running) {
+        vm_stop(RUN_STATE_RESTORE_VM);
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    target = now - (int64_t)ms * SCALE_MS;
+
+    for (j = s->ring->len - 1; j > 0; j--) {
+        c = g_ptr_array_index(s->ring, j);
+        if (c->vtime_ns <= target) {
+            break;
+        }
+    }
+    c = g_ptr_array_index(s->ring, j);
+    target = MAX(target, c->vtime_ns);
+
+    /* The current device state, to put back if the restore fails */
+    if (!pebble_rewind_save_devices(&undo)) {
+        g_free(undo.devstate);
+        if (was_running) {
+            vm_start();
+        }
+        return;
+    }
+    if (!pebble_rewind_restore(s, j)) {
+        if (pebble_rewind_load_devices(&undo)) {
+            error_report("pebble: rewind: step back failed, machine unchanged");
+            if (was_running) {
+                vm_start();
+            }
+        } else {
+            error_report("pebble: rewind: machine state is inconsistent, "
+                         "leaving it stopped");
+        }
+        g_free(undo.devstate);
+        return;
+    }
+    g_free(undo.devstate);
+
+    /* Input after the target never happened in the new timeline */
+    for (keep = 0; keep < s->journal->len; keep++) {
+        if (g_array_index(s->journal, RewindInput, keep).vtime_ns > target) {
+            break;
+        }
+    }
+    g_array_set_size(s->journal, keep);
+    for (s->replay_next = 0; s->replay_next < s->journal->len; s->replay_next++) {
+        if (g_array_index(s->journal, RewindInput, s->replay_next).vtime_ns >
+            c->vtime_ns) {
+            break;
+        }
+    }
+
+    info_report("pebble: rewind: %" PRId64 " ms -> %" PRId64 " ms "
+                "(checkpoint at %" PRId64 " ms, replaying %u inputs)",
+                now / SCALE_MS, target / SCALE_MS, c->vtime_ns / SCALE_MS,
+                s->journal->len - s->replay_next);
+
+    /* The virtual clock is back at c->vtime_ns; re-arm our own timers */
+    s->replaying = true;
+    s->replay_target_ns = target;
+    s->want_checkpoint = false;
+    s->want_stop = false;
+    timer_mod(s->checkpoint_timer, c->vtime_ns + s->interval_ns);
+    timer_mod(s->stop_timer, target);
+    pebble_rewind_arm_input(s);
+
+    vm_start();
+}
+
+static void pebble_rewind_bh(void *opaque)
+{
+    PebbleRewind *s = opaque;
+    uint32_t ms = qatomic_xchg(&s->request_ms, 0);
+
+    if (ms) {
+        pebble_rewind_do_step_back(s, ms);
+        return;
+    }
+
+    if (qatomic_xchg(&s->request_resume, 0)) {
+        s->replaying = false;
+        s->want_stop = false;
+        timer_del(s->stop_timer);
+        timer_del(s->input_timer);
+        if (runstate_check(RUN_STATE_PAUSED)) {
+            vm_start();
+        }
+    }
+
+    if (s->want_stop) {
+        s->want_stop = false;
+        s->replaying = false;
+        timer_del(s->input_timer);
+        if (runstate_is_running()) {
+            vm_stop(RUN_STATE_PAUSED);
+        }
+        info_report("pebble: rewind: paused at %" PRId64 " ms",
+                    qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) / SCALE_MS);
+    }
+
+    if (s->want_checkpoint) {
+        s->want_checkpoint = false;
+        if (runstate_is_running()) {
+            vm_stop(RUN_STATE_SAVE_VM);
+            pebble_rewind_take_checkpoint(s);
+            vm_start();
+        }
+        timer_mod(s->checkpoint_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->interval_ns);
+    }
+}
+
+/* Virtual-clock timers run wherever the clock is serviced; do the actual
+ * stop/save/load from a bottom half on the main loop. */
+static void pebble_rewind_checkpoint_cb(void *opaque)
+{
+    PebbleRewind *s = opaque;
+
+    s->want_checkpoint = true;
+    qemu_bh_schedule(s->bh);
+}
+
+static void pebble_rewind_stop_cb(void *opaque)
+{
+    PebbleRewind *s = opaque;
+
+    s->want_stop = true;
+    qemu_bh_schedule(s->bh);
+}
+
+static void pebble_rewind_input_cb(void *opaque)
+{
+    PebbleRewind *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    while (s->replaying && s->replay_next < s->journal->len) {
+        RewindInput *in = &g_array_index(s->journal, RewindInput, s->replay_next);
+
+        if (in->vtime_ns > now) {
+            break;
+        }
+        DPRINTF("replay buttons 0x%x at %" PRId64 " ms\n", in->button_state,
+                in->vtime_ns / SCALE_MS);
+        pebble_set_button_state(in->button_state);
+        s->replay_next++;
+    }
+    pebble_rewind_arm_input(s);
+}
+
+static void pebble_rewind_poll_cb(void *opaque)
+{
+    PebbleRewind *s = opaque;
+
+    if (qatomic_read(&s->request_ms) || qatomic_read(&s->request_resume)) {
+        qemu_bh_schedule(s->bh);
+    }
+    timer_mod(s->poll_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + REWIND_POLL_MS);
+}
+
+/* ====================================================================
+ * Public API
+ * ==================================================================== */
+bool pebble_rewind_enabled(void)
+{
+    return rewind_state != NULL;
+}
+
+void pebble_rewind_step_back(uint32_t ms)
+{
+    if (rewind_state && ms) {
+        qatomic_set(&rewind_state->request_ms, ms);
+    }
+}
+
+void pebble_rewind_resume(void)
+{
+    if (rewind_state) {
+        qatomic_set(&rewind_state->request_resume, 1);
+    }
+}
+
+void pebble_rewind_note_buttons(uint32_t button_state)
+{
+    PebbleRewind *s = rewind_state;
+    RewindInput in;
+
+    /* Live input during a replay is applied but not recorded */
+    if (!s || s->replaying) {
+        return;
+    }
+    in.vtime_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    in.button_state = button_state;
+    g_array_append_val(s->journal, in);
+}
+
+void pebble_rewind_init(void)
+{
+    static const struct {
+        hwaddr addr;
+        const char *name;
+    } regions[] = {
+        { 0x20000000, "sram" },
+        { 0x10000000, "ccm" },
+        { 0xC0000000, "sdram" },
+        { 0x60000000, "storage flash" },
+    };
+    PebbleRewind *s;
+    const char *strval = getenv("PEBBLE_REWIND_MS");
+    int interval_ms = strval ? atoi(strval) : 0;
+
+    if (interval_ms <= 0) {
+        return;
+    }
+
+    s = g_new0(PebbleRewind, 1);
+    s->interval_ns = (int64_t)interval_ms * SCALE_MS;
+    s->depth = REWIND_DEFAULT_DEPTH;
+    strval = getenv("PEBBLE_REWIND_DEPTH");
+    if (strval && atoi(strval) >= 2) {
+        s->depth = atoi(strval);
+    }
+    s->ring = g_ptr_array_new_with_free_func(pebble_rewind_checkpoint_free);
+    s->journal = g_array_new(false, false, sizeof(RewindInput));
+
+    for (int i = 0; i < ARRAY_SIZE(regions); i++) {
+        MemoryRegionSection section = memory_region_find(get_system_memory(),
+                                                         regions[i].addr, 1);
+        RewindRegion *r = &s->region[s->num_regions];
+        MemoryRegion *mr = section.mr;
+
+        if (!mr) {
+            continue;
+        }
+        memory_region_unref(mr);
+        if (!memory_region_is_ram(mr) &&
+            !(mr->rom_device && mr->ops && mr->ops->write && !s->flash)) {
+            continue;
+        }
+
+        r->name = regions[i].name;
+        r->mr = mr;
+        r->base = regions[i].addr - section.offset_within_region;
+        r->size = memory_region_size(mr);
+        r->num_pages = DIV_ROUND_UP(r->size, REWIND_PAGE_SIZE);
+        r->host = memory_region_get_ram_ptr(mr);
+        r->is_ram = memory_region_is_ram(mr);
+        r->pending = bitmap_new(r->num_pages);
+        assert(r->size % REWIND_PAGE_SIZE == 0);
+
+        if (r->is_ram) {
+            memory_region_set_log(mr, true, DIRTY_MEMORY_VGA);
+        } else {
+            s->flash_notifier.notify = pebble_rewind_flash_write;
+            if (!pebble_pflash_add_write_notifier(&s->flash_notifier)) {
+                g_free(r->pending);
+                continue;
+            }
+            s->flash = r;
+        }
+        s->num_regions++;
+        DPRINTF("tracking %s: %" PRIu64 " KB at 0x%" HWADDR_PRIx "\n",
+                r->name, r->size / KiB, r->base);
+    }
+
+    s->bh = qemu_bh_new(pebble_rewind_bh, s);
+    s->checkpoint_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                       pebble_rewind_checkpoint_cb, s);
+    s->stop_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, pebble_rewind_stop_cb, s);
+    s->input_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, pebble_rewind_input_cb, s);
+    s->poll_timer = timer_new_ms(QEMU_CLOCK_REALTIME, pebble_rewind_poll_cb, s);
+
+    rewind_state = s;
+
+    /* The base checkpoint is taken as soon as the machine runs */
+    timer_mod(s->checkpoint_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    timer_mod(s->poll_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + REWIND_POLL_MS);
+
+    info_report("pebble: rewind checkpoints every %d ms, ring of %u",
+                interval_ms, s->depth);
+}
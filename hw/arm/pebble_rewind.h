@@ -0,0 +1,28 @@
+#ifndef PEBBLE_REWIND_H
+#define PEBBLE_REWIND_H
+
+#include "qemu/typedefs.h"
+
+/* Time-travel checkpoints for UI debugging.
+ *
+ * Enabled with PEBBLE_REWIND_MS=<K>: every K virtual milliseconds the machine
+ * is paused and a checkpoint is added to a ring of PEBBLE_REWIND_DEPTH
+ * (default 64). A checkpoint holds the device state plus only the SRAM, CCM,
+ * SDRAM and storage flash pages written since the previous one; the oldest
+ * checkpoint is a full copy that later ones are folded into.
+ *
+ * Stepping back restores the newest checkpoint at or before the target time,
+ * replays forward to the target (re-applying journaled button input) and
+ * pauses there.
+ */
+void pebble_rewind_init(void);
+bool pebble_rewind_enabled(void);
+
+/* Thread-safe requests, serviced from the main loop */
+void pebble_rewind_step_back(uint32_t ms);
+void pebble_rewind_resume(void);
+
+/* Record a button state change so it can be re-applied after a rewind */
+void pebble_rewind_note_buttons(uint32_t button_state);
+
+#endif /* PEBBLE_REWIND_H */
@@ -356,6 +356,7 @@ void stm32f4xx_init(
         }
         stm32_init_periph(uart_dev, periph, uart_desc[i].addr, irq);
         stm32_uart[i] = (Stm32Uart *)uart_dev;
+        stm32_uart_set_rcc(stm32_uart[i], (Stm32Rcc *)rcc_dev);
     }
 
     /* === SPI === */
@@ -431,9 +432,11 @@ void stm32f4xx_init(
         assert(i < STM32F4XX_TIM_COUNT);
         const stm32_periph_t periph = STM32_TIM1 + timer_desc[i].timer_num - 1;
         DeviceState *timer = qdev_new("f2xx_tim");
+        qdev_prop_set_int32(timer, "periph", periph);
         stm32_init_periph(timer, periph, timer_desc[i].addr,
                           qdev_get_gpio_in(armv7m_dev, timer_desc[i].irq_idx));
         stm32_timer[timer_desc[i].timer_num - 1] = (Stm32Timer *)timer;
+        stm32_timer_set_rcc(stm32_timer[timer_desc[i].timer_num - 1], (Stm32Rcc *)rcc_dev);
     }
 
     /* === I2C === */
@@ -458,6 +461,10 @@ void stm32f4xx_init(
     sysbus_connect_irq(SYS_BUS_DEVICE(i2c3), 1,
                        qdev_get_gpio_in(armv7m_dev, STM32_I2C3_ER_IRQ));
 
+    stm->i2c_dev[0] = i2c1;
+    stm->i2c_dev[1] = i2c2;
+    stm->i2c_dev[2] = i2c3;
+
     /* === CRC === */
     DeviceState *crc = qdev_new("f2xx_crc");
     stm32_init_periph(crc, STM32_CRC, 0x40023000, NULL);
@@ -493,6 +500,43 @@ void stm32f4xx_init(
                            qdev_get_gpio_in(armv7m_dev, dma2_irqs[i]));
     }
 
+    /* UART DMA requests (RM0090 tables 42 and 43). USART1 and USART6 can
+     * each be served by two RX and two TX streams, hence the line index. */
+    struct {
+        uint8_t uart;
+        bool tx;
+        uint8_t line;
+        uint8_t dma;
+        uint8_t stream;
+        uint8_t channel;
+    } const uart_dma_desc[] = {
+        {STM32_UART1_INDEX, false, 0, 2, 2, 4},
+        {STM32_UART1_INDEX, false, 1, 2, 5, 4},
+        {STM32_UART1_INDEX, true,  0, 2, 7, 4},
+        {STM32_UART2_INDEX, false, 0, 1, 5, 4},
+        {STM32_UART2_INDEX, true,  0, 1, 6, 4},
+        {STM32_UART3_INDEX, false, 0, 1, 1, 4},
+        {STM32_UART3_INDEX, true,  0, 1, 3, 4},
+        {STM32_UART3_INDEX, true,  1, 1, 4, 7},
+        {STM32_UART4_INDEX, false, 0, 1, 2, 4},
+        {STM32_UART4_INDEX, true,  0, 1, 4, 4},
+        {STM32_UART5_INDEX, false, 0, 1, 0, 4},
+        {STM32_UART5_INDEX, true,  0, 1, 7, 4},
+        {STM32_UART6_INDEX, false, 0, 2, 1, 5},
+        {STM32_UART6_INDEX, false, 1, 2, 2, 5},
+        {STM32_UART6_INDEX, true,  0, 2, 6, 5},
+        {STM32_UART6_INDEX, true,  1, 2, 7, 5},
+    };
+    for (i = 0; i < ARRAY_LENGTH(uart_dma_desc); ++i) {
+        DeviceState *dma = uart_dma_desc[i].dma == 1 ? dma1 : dma2;
+        qdev_connect_gpio_out_named(DEVICE(stm32_uart[uart_dma_desc[i].uart]),
+            uart_dma_desc[i].tx ? "dma-tx-request" : "dma-rx-request",
+            uart_dma_desc[i].line,
+            qdev_get_gpio_in_named(dma, STM32_DMA_REQUEST,
+                STM32_DMA_REQUEST_LINE(uart_dma_desc[i].stream,
+                                       uart_dma_desc[i].channel)));
+    }
+
     /* === External SDRAM at 0xC0000000 (8MB for Emery framebuffer) === */
     {
         MemoryRegion *sdram = g_new(MemoryRegion, 1);
@@ -59,11 +59,15 @@
 #include "ui/console.h"
 #include "ui/pixel_ops.h"
 #include "hw/ssi/ssi.h"
+#include "hw/arm/stm32_common.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "qapi/error.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qemu/bitmap.h"
 #include "hw/core/cpu.h"
+#include "migration/vmstate.h"
 #include "pebble_snowy_display.h"
 #include "pebble_snowy_display_overlays.h"
 
@@ -94,6 +98,29 @@ EMSCRIPTEN_KEEPALIVE int pebble_display_frame_count(void) {
 EMSCRIPTEN_KEEPALIVE uint8_t *pebble_display_data(void) {
     return (uint8_t *)pebble_wasm_fb_ptr;
 }
+
+/* The same frame as canvas-ready RGBA8888 (width * 4 bytes per row), so the
+ * page can copy it straight into an ImageData without converting pixels.
+ * Writes are bracketed by a seqlock: the count is odd while the buffer is
+ * being updated, and a reader that sees it change across its copy retries. */
+static uint8_t *pebble_wasm_rgba = NULL;
+static uint32_t pebble_wasm_rgba_seq = 0;
+EMSCRIPTEN_KEEPALIVE uint8_t *pebble_display_rgba(void) {
+    return pebble_wasm_rgba;
+}
+EMSCRIPTEN_KEEPALIVE uint32_t pebble_display_rgba_seq(void) {
+    return __atomic_load_n(&pebble_wasm_rgba_seq, __ATOMIC_ACQUIRE);
+}
+
+static void pebble_wasm_rgba_write_begin(void)
+{
+    __atomic_fetch_add(&pebble_wasm_rgba_seq, 1, __ATOMIC_SEQ_CST);
+}
+
+static void pebble_wasm_rgba_write_end(void)
+{
+    __atomic_fetch_add(&pebble_wasm_rgba_seq, 1, __ATOMIC_SEQ_CST);
+}
 static volatile int pebble_wasm_timer_ticks = 0;
 static volatile int pebble_wasm_redraw_pending = 0;
 static volatile int pebble_wasm_cpu_halted = -1;
@@ -110,6 +137,25 @@ static volatile uint32_t pebble_wasm_cpu_pc = 0;
 EMSCRIPTEN_KEEPALIVE uint32_t pebble_cpu_pc(void) {
     return pebble_wasm_cpu_pc;
 }
+
+/* Rows of the exported surface changed since JavaScript last looked, one bit
+ * per row (bit y%32 of word y/32). QEMU sets bits with atomic OR; JavaScript
+ * takes them with Atomics.exchange(HEAPU32, word, 0) and only converts and
+ * uploads those scanlines. */
+#define PEBBLE_WASM_DIRTY_ROW_WORDS 8     /* up to 256 rows */
+static uint32_t pebble_wasm_dirty_rows[PEBBLE_WASM_DIRTY_ROW_WORDS];
+EMSCRIPTEN_KEEPALIVE uint32_t *pebble_display_dirty_rows(void) {
+    return pebble_wasm_dirty_rows;
+}
+
+static void pebble_wasm_mark_rows(uint32_t first, uint32_t count)
+{
+    for (uint32_t y = first; y < first + count; y++) {
+        uint32_t word = MIN(y / 32, PEBBLE_WASM_DIRTY_ROW_WORDS - 1);
+        __atomic_fetch_or(&pebble_wasm_dirty_rows[word], 1u << (y % 32),
+                          __ATOMIC_SEQ_CST);
+    }
+}
 #endif
 
 /* Disable verbose debug output for WASM builds — the usleep() calls in
@@ -203,6 +249,9 @@ typedef struct {
     // It is generally to an IRQ
     qemu_irq intn_output;
 
+    // Pulsed each time a frame publishes rows that changed on screen
+    qemu_irq frame_output;
+
     uint32_t num_rows;
     uint32_t num_cols;
     int32_t num_border_rows;
@@ -216,22 +265,29 @@ typedef struct {
     // Other state variables
     QemuConsole   *con;
     bool          redraw;
+    bool          full_redraw;          // repaint every row (LUT, vibrate, invalidate)
+    unsigned long *dirty_rows;          // framebuffer rows written since the last frame
+    unsigned long *copy_dirty_rows;     // framebuffer_copy rows not yet on the surface
     uint32_t      bytes_per_row;
     uint32_t      bytes_per_frame;
     uint8_t       *framebuffer;
     uint8_t       *framebuffer_copy;
+    uint8_t       *line_buffer;         // scrambled scan line being received
+    uint8_t       *line_out;            // unscrambled column before it is scattered
+    uint32_t      line_buffer_size;
     int           col_index;
     int           row_index;
     bool          backlight_enabled;
-    float         brightness;
+    uint32_t      backlight_level;      // last level from backlight_level input
+    float         brightness;           // derived from backlight_level
     bool          power_on;
 
     /* State variables */
-    PSDisplayState  state;
+    uint32_t        state;              // PSDisplayState
     uint8_t         cmd;
     uint32_t        parameter;
     uint32_t        parameter_byte_offset;
-    PDisplayScene   scene;
+    uint32_t        scene;              // PDisplayScene
 
     bool      sclk_value;
     bool      cs_value;                 // low means asserted
@@ -244,11 +300,12 @@ typedef struct {
     uint8_t       prog_header[256];
     uint32_t      prog_byte_offset;
 
-    // Which command set we are emulating
-    PDisplayCmdSet cmd_set;
+    // Which command set we are emulating, one of PDisplayCmdSet
+    uint32_t      cmd_set;
 
 #ifdef __EMSCRIPTEN__
-    QEMUTimer *wasm_refresh_timer;
+    QEMUBH    *wasm_refresh_bh;
+    QEMUTimer *wasm_vibe_timer;
 #endif
 } PSDisplayGlobals;
 
@@ -267,9 +324,55 @@ static void ps_set_state(PSDisplayGlobals *s, PSDisplayState new_state) {
 }
 
 // -----------------------------------------------------------------------------
+static void ps_mark_rows(PSDisplayGlobals *s, uint32_t first, uint32_t count) {
+    bitmap_set(s->dirty_rows, first, count);
+}
+
+// -----------------------------------------------------------------------------
+// Something needs repainting. Natively the console's refresh timer picks it up;
+// in WASM nothing polls the surface, so schedule an update now.
+static void ps_schedule_refresh(PSDisplayGlobals *s) {
+#ifdef __EMSCRIPTEN__
+    if (s->wasm_refresh_bh) {
+        qemu_bh_schedule(s->wasm_refresh_bh);
+    }
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// A frame is complete: publish the rows that were written and actually changed
+// to framebuffer_copy. The firmware usually resends the whole frame per update, so
+// comparing against the copy is what keeps unchanged scanlines off the surface.
 static void ps_set_redraw(PSDisplayGlobals *s) {
+    unsigned long row;
+    bool changed = false;
+
+    for (row = find_first_bit(s->dirty_rows, s->num_rows); row < s->num_rows;
+         row = find_next_bit(s->dirty_rows, s->num_rows, row + 1)) {
+        const uint8_t *src = s->framebuffer + row * s->bytes_per_row;
+        uint8_t *dst = s->framebuffer_copy + row * s->bytes_per_row;
+
+        if (memcmp(dst, src, s->bytes_per_row)) {
+            memcpy(dst, src, s->bytes_per_row);
+            set_bit(row, s->copy_dirty_rows);
+            s->redraw = true;
+            changed = true;
+        }
+    }
+    bitmap_zero(s->dirty_rows, s->num_rows);
+    if (changed) {
+        qemu_irq_pulse(s->frame_output);
+    }
+    if (s->redraw) {
+        ps_schedule_refresh(s);
+    }
+}
+
+// -----------------------------------------------------------------------------
+static void ps_set_full_redraw(PSDisplayGlobals *s) {
+    s->full_redraw = true;
     s->redraw = true;
-    memmove(s->framebuffer_copy, s->framebuffer, s->bytes_per_frame);
+    ps_schedule_refresh(s);
 }
 
 
@@ -277,6 +380,7 @@ static void ps_set_redraw(PSDisplayGlobals *s) {
 static void ps_display_set_pixel(PSDisplayGlobals *s, uint32_t x, uint32_t y,
                             uint8_t pixel_byte) {
     s->framebuffer[y * s->bytes_per_row + x] = pixel_byte;
+    set_bit(y, s->dirty_rows);
 }
 
 
@@ -441,6 +545,7 @@ static void ps_display_execute_current_cmd_set0(PSDisplayGlobals *s)
             switch (s->scene) {
             case PSDISPLAYSCENE_BLACK:
                 memset(s->framebuffer, SNOWY_COLOR_BLACK, s->bytes_per_frame);
+                ps_mark_rows(s, 0, s->num_rows);
                 break;
             case PSDISPLAYSCENE_SPLASH:
                 pixels = get_pebble_logo_4colors_image(&width, &height);
@@ -527,115 +632,261 @@ static void ps_display_execute_current_cmd_set1(PSDisplayGlobals *s)
 
 
 // -----------------------------------------------------------------------------
-static void ps_display_cmd_set_2_unscramble_column(PSDisplayGlobals *s, uint32_t col_index)
+// Unscramble one scan line of command set 2 frame data.
+//
+// In the desription below, the bits in the first pixel in a line are
+// identified as follows:
+//  r0_msb r0_lsb g0_msb g0_lsb b0_msb b0_lsb 0 0
+// The second pixel:
+//  r1_msb r1_lsb g1_msb g1_lsb b1_msb b1_lsb 0 0
+//
+// Each scan line contains N bytes of data for the N pixels, as two halves of
+// N/2 bytes: one holds the least significant bit of every colour channel, the
+// other the most significant bit.
+//
+// LSB0 contains the following bits:
+//  0 0 r1_lsb r0_lsb g1_lsb g0_lsb b1_lsb b0_lsb
+// MSB0 contains the following bits:
+//  0 0 r1_msb r0_msb g1_msb g0_msb b1_msb b0_msb
+//
+// so byte i of each half forms two pixels:
+//  pixel_0 = ((ms & 0b00010101) << 3) | ((ls & 0b00010101) << 2)
+//  pixel_1 = ((ms & 0b00101010) << 2) | ((ls & 0b00101010) << 1)
+//
+// None of the masked bits crosses a byte boundary when shifted, so the vector
+// versions use whatever lane width the instruction set has for shifts and do
+// 16 byte pairs (32 output pixels) per step; an emery row is 6 steps plus a
+// scalar tail. The pixel pairs are written to dst in order (pixel_1 first when
+// requested), or mirrored end to start when reversed is set.
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define PS_UNSCRAMBLE_VEC 1
+typedef v128_t PSVec;
+
+static inline PSVec ps_vec_load(const uint8_t *p) { return wasm_v128_load(p); }
+static inline void ps_vec_store(uint8_t *p, PSVec v) { wasm_v128_store(p, v); }
+
+static inline PSVec ps_vec_pixel_0(PSVec ms, PSVec ls)
 {
-    int row_idx;
-    const int line_bytes = s->num_rows - 2 * s->num_border_rows;
-    uint8_t col_buffer[line_bytes];
+    const PSVec mask = wasm_i8x16_splat(0b00010101);
+    return wasm_v128_or(wasm_i8x16_shl(wasm_v128_and(ms, mask), 3),
+                        wasm_i8x16_shl(wasm_v128_and(ls, mask), 2));
+}
+
+static inline PSVec ps_vec_pixel_1(PSVec ms, PSVec ls)
+{
+    const PSVec mask = wasm_i8x16_splat(0b00101010);
+    return wasm_v128_or(wasm_i8x16_shl(wasm_v128_and(ms, mask), 2),
+                        wasm_i8x16_shl(wasm_v128_and(ls, mask), 1));
+}
+
+static inline PSVec ps_vec_zip_lo(PSVec a, PSVec b)
+{
+    return wasm_i8x16_shuffle(a, b, 0, 16, 1, 17, 2, 18, 3, 19,
+                              4, 20, 5, 21, 6, 22, 7, 23);
+}
+
+static inline PSVec ps_vec_zip_hi(PSVec a, PSVec b)
+{
+    return wasm_i8x16_shuffle(a, b, 8, 24, 9, 25, 10, 26, 11, 27,
+                              12, 28, 13, 29, 14, 30, 15, 31);
+}
 
-    // Copy the column into temp buffer first, without border pixels
-    for (row_idx = 0; row_idx < line_bytes; row_idx++) {
-      col_buffer[row_idx] = s->framebuffer[(row_idx + s->num_border_rows) * s->bytes_per_row
-                                            + col_index];
+static inline PSVec ps_vec_reverse(PSVec v)
+{
+    return wasm_i8x16_shuffle(v, v, 15, 14, 13, 12, 11, 10, 9, 8,
+                              7, 6, 5, 4, 3, 2, 1, 0);
+}
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PS_UNSCRAMBLE_VEC 1
+typedef __m128i PSVec;
+
+static inline PSVec ps_vec_load(const uint8_t *p) { return _mm_loadu_si128((const __m128i *)p); }
+static inline void ps_vec_store(uint8_t *p, PSVec v) { _mm_storeu_si128((__m128i *)p, v); }
+
+static inline PSVec ps_vec_pixel_0(PSVec ms, PSVec ls)
+{
+    const PSVec mask = _mm_set1_epi8(0b00010101);
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(ms, mask), 3),
+                        _mm_slli_epi16(_mm_and_si128(ls, mask), 2));
+}
+
+static inline PSVec ps_vec_pixel_1(PSVec ms, PSVec ls)
+{
+    const PSVec mask = _mm_set1_epi8(0b00101010);
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(ms, mask), 2),
+                        _mm_slli_epi16(_mm_and_si128(ls, mask), 1));
+}
+
+static inline PSVec ps_vec_zip_lo(PSVec a, PSVec b) { return _mm_unpacklo_epi8(a, b); }
+static inline PSVec ps_vec_zip_hi(PSVec a, PSVec b) { return _mm_unpackhi_epi8(a, b); }
+
+static inline PSVec ps_vec_reverse(PSVec v)
+{
+    // Swap the bytes of each word, then reverse the eight words
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PS_UNSCRAMBLE_VEC 1
+typedef uint8x16_t PSVec;
+
+static inline PSVec ps_vec_load(const uint8_t *p) { return vld1q_u8(p); }
+static inline void ps_vec_store(uint8_t *p, PSVec v) { vst1q_u8(p, v); }
+
+static inline PSVec ps_vec_pixel_0(PSVec ms, PSVec ls)
+{
+    const PSVec mask = vdupq_n_u8(0b00010101);
+    return vorrq_u8(vshlq_n_u8(vandq_u8(ms, mask), 3),
+                    vshlq_n_u8(vandq_u8(ls, mask), 2));
+}
+
+static inline PSVec ps_vec_pixel_1(PSVec ms, PSVec ls)
+{
+    const PSVec mask = vdupq_n_u8(0b00101010);
+    return vorrq_u8(vshlq_n_u8(vandq_u8(ms, mask), 2),
+                    vshlq_n_u8(vandq_u8(ls, mask), 1));
+}
+
+static inline PSVec ps_vec_zip_lo(PSVec a, PSVec b) { return vzipq_u8(a, b).val[0]; }
+static inline PSVec ps_vec_zip_hi(PSVec a, PSVec b) { return vzipq_u8(a, b).val[1]; }
+
+static inline PSVec ps_vec_reverse(PSVec v)
+{
+    v = vrev64q_u8(v);
+    return vextq_u8(v, v, 8);
+}
+#endif
+
+static void ps_display_unscramble_line(uint8_t *dst, const uint8_t *ms,
+                                       const uint8_t *ls, int pairs,
+                                       bool pixel_1_first, bool reversed)
+{
+    const int line_bytes = 2 * pairs;
+    int i = 0;
+
+#ifdef PS_UNSCRAMBLE_VEC
+    for (; i + 16 <= pairs; i += 16) {
+        const PSVec m = ps_vec_load(ms + i);
+        const PSVec l = ps_vec_load(ls + i);
+        const PSVec p0 = ps_vec_pixel_0(m, l);
+        const PSVec p1 = ps_vec_pixel_1(m, l);
+        const PSVec first = pixel_1_first ? p1 : p0;
+        const PSVec second = pixel_1_first ? p0 : p1;
+        PSVec lo = ps_vec_zip_lo(first, second);
+        PSVec hi = ps_vec_zip_hi(first, second);
+
+        if (reversed) {
+            ps_vec_store(dst + line_bytes - 2 * i - 16, ps_vec_reverse(lo));
+            ps_vec_store(dst + line_bytes - 2 * i - 32, ps_vec_reverse(hi));
+        } else {
+            ps_vec_store(dst + 2 * i, lo);
+            ps_vec_store(dst + 2 * i + 16, hi);
+        }
+    }
+#endif
+
+    for (; i < pairs; i++) {
+        const uint8_t pixel_0 = ((ms[i] & 0b00010101) << 3) | ((ls[i] & 0b00010101) << 2);
+        const uint8_t pixel_1 = ((ms[i] & 0b00101010) << 2) | ((ls[i] & 0b00101010) << 1);
+        const uint8_t first = pixel_1_first ? pixel_1 : pixel_0;
+        const uint8_t second = pixel_1_first ? pixel_0 : pixel_1;
+
+        if (reversed) {
+            dst[line_bytes - 2 * i - 1] = first;
+            dst[line_bytes - 2 * i - 2] = second;
+        } else {
+            dst[2 * i] = first;
+            dst[2 * i + 1] = second;
+        }
     }
+}
+
+
+// -----------------------------------------------------------------------------
+// A column arrives in line_buffer as [LSB0 LSB2 ... MSB0 MSB2 ...], bottom row
+// first. The framebuffer is row-major, so the result is scattered one byte per row.
+static void ps_display_cmd_set_2_unscramble_column(PSDisplayGlobals *s, uint32_t col_index)
+{
+    const int line_bytes = s->num_rows - 2 * s->num_border_rows;
+    uint8_t *fb = &s->framebuffer[s->num_border_rows * s->bytes_per_row + col_index];
 
-    // Unscramble the bytes in the scanline.
-    //
-    // In the desription below, the bits in the first pixel in a column are
-    // identified as follows:
-    //  r0_msb r0_lsb g0_msb g0_lsb b0_msb b0_lsb 0 0
-    // The second pixel:
-    //  r1_msb r1_lsb g1_msb g1_lsb b1_msb b1_lsb 0 0
-    //
-    // Each scan line contains N bytes of data for the N pixels.
-    // [LSB0 LSB2 .................LSBN MSB0 MSB2 ....................MSBN]
-    //
-    // LSB0 contains the following bits:
-    //  0 0 r1_lsb r0_lsb g1_lsb g0_lsb b1_lsb b0_lsb
-    // MSB0 contains the following bits:
-    //  0 0 r1_msb r0_msb g1_msb g0_msb b1_msb b0_msb
-
-    // LSB2 contains the following bits:
-    //  0 0 r3_lsb r2_lsb g3_lsb g2_lsb b3_lsb b2_lsb
-    // MSB2 contains the following bits:
-    //  0 0 r3_msb r2_msb g3_msb g2_msb b3_msb b2_msb
-    //
-    uint8_t ms_bits, ls_bits;
-    for (row_idx = 0; row_idx < line_bytes; row_idx += 2) {
-        ls_bits = col_buffer[row_idx/2];
-        ms_bits = col_buffer[row_idx/2 + line_bytes/2];
-
-        // Form the 2 pixels whose data is found in ls_bits and ms_bits
-        uint8_t pixel_0, pixel_1;
-        pixel_0 = ((ms_bits & 0b00010101) << 1) |  (ls_bits & 0b00010101);
-        pixel_0 <<= 2;
-        pixel_1 =  (ms_bits & 0b00101010)       | ((ls_bits & 0b00101010) >> 1);
-        pixel_1 <<= 2;
-
-        // Write them to the frame buffer
-        s->framebuffer[(row_idx + s->num_border_rows) * s->bytes_per_row
-                        + col_index] = pixel_0;
-        s->framebuffer[(row_idx + s->num_border_rows + 1) * s->bytes_per_row
-                        + col_index] = pixel_1;
+    ps_display_unscramble_line(s->line_out, s->line_buffer + line_bytes / 2,
+                               s->line_buffer, line_bytes / 2, false, false);
+    for (int row_idx = 0; row_idx < line_bytes; row_idx++) {
+        fb[row_idx * s->bytes_per_row] = s->line_out[row_idx];
     }
+    ps_mark_rows(s, s->num_border_rows, line_bytes);
 }
 
 
 // -----------------------------------------------------------------------------
+// A row arrives in line_buffer as [MSB0 MSB2 ... LSB0 LSB2 ...] and is written
+// to the framebuffer in one pass.
 static void ps_display_cmd_set_2_unscramble_row(PSDisplayGlobals *s, uint32_t row_index)
 {
     const int line_bytes = s->num_cols - 2 * s->num_border_cols;
-    uint8_t row_buffer[line_bytes];
     uint8_t *fb = &s->framebuffer[row_index * s->bytes_per_row + s->num_border_cols];
 
-    // Copy the row into temp buffer first, without border pixels
-    memcpy(row_buffer, fb, line_bytes);
-
-    // Unscramble the bytes in the scanline.
-    //
-    // In the desription below, the bits in the first pixel in a column are
-    // identified as follows:
-    //  r0_msb r0_lsb g0_msb g0_lsb b0_msb b0_lsb 0 0
-    // The second pixel:
-    //  r1_msb r1_lsb g1_msb g1_lsb b1_msb b1_lsb 0 0
-    //
-    // Each scan line contains N bytes of data for the N pixels.
-    // [LSB0 LSB2 .................LSBN MSB0 MSB2 ....................MSBN]
-    //
-    // LSB0 contains the following bits:
-    //  0 0 r1_lsb r0_lsb g1_lsb g0_lsb b1_lsb b0_lsb
-    // MSB0 contains the following bits:
-    //  0 0 r1_msb r0_msb g1_msb g0_msb b1_msb b0_msb
-
-    // LSB2 contains the following bits:
-    //  0 0 r3_lsb r2_lsb g3_lsb g2_lsb b3_lsb b2_lsb
-    // MSB2 contains the following bits:
-    //  0 0 r3_msb r2_msb g3_msb g2_msb b3_msb b2_msb
-    //
-    for (int col_idx = 0; col_idx < line_bytes; col_idx += 2) {
-        const uint8_t ms_bits = row_buffer[col_idx / 2];
-        const uint8_t ls_bits = row_buffer[col_idx / 2 + line_bytes / 2];
-
-        // Form the 2 pixels whose data is found in ls_bits and ms_bits
-        uint8_t pixel_0, pixel_1;
-        pixel_0 = ((ms_bits & 0b00010101) << 1) |  (ls_bits & 0b00010101);
-        pixel_0 <<= 2;
-        pixel_1 =  (ms_bits & 0b00101010)       | ((ls_bits & 0b00101010) >> 1);
-        pixel_1 <<= 2;
-
-        // Write them to the frame buffer
-        if (s->col_inverted) {
-            fb[line_bytes - col_idx - 2] = pixel_0;
-            fb[line_bytes - col_idx - 1] = pixel_1;
-        } else {
-            fb[col_idx] = pixel_1;
-            fb[col_idx + 1] = pixel_0;
-        }
-    }
+    ps_display_unscramble_line(fb, s->line_buffer, s->line_buffer + line_bytes / 2,
+                               line_bytes / 2, true, s->col_inverted);
+    set_bit(row_index, s->dirty_rows);
 }
 
 static bool newdisp = true;
 
+// -----------------------------------------------------------------------------
+static void ps_display_frame_received(PSDisplayGlobals *s)
+{
+    DPRINTF("Got last byte in frame row %d, col %d -- bytes: %u\n",
+            s->row_index, s->col_index, display_bytes);
+    ps_set_state(s, PSDISPLAYSTATE_ACCEPTING_CMD);
+    ps_set_redraw(s);
+    newdisp = true;
+    ++frameno;
+}
+
+// -----------------------------------------------------------------------------
+// Reached end of row, unscramble the one we just received and go onto the
+// next row
+static void ps_display_row_received(PSDisplayGlobals *s)
+{
+    bool got_last_byte;
+
+    ps_display_cmd_set_2_unscramble_row(s, s->row_index);
+    s->col_index = s->num_border_cols;
+    if (s->row_inverted) {
+        s->row_index--;
+        got_last_byte = (s->row_index < s->num_border_rows);
+    } else {
+        s->row_index++;
+        got_last_byte = (s->row_index >= s->num_rows - s->num_border_rows);
+    }
+    if (got_last_byte) {
+        ps_display_frame_received(s);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Reached top of column, unscramble the one we just received and go onto the
+// next column
+static void ps_display_column_received(PSDisplayGlobals *s)
+{
+    ps_display_cmd_set_2_unscramble_column(s, s->col_index);
+    s->row_index = s->num_rows - s->num_border_rows - 1;
+    s->col_index += 1;
+    if (s->col_index >= s->num_cols - s->num_border_cols) {
+        ps_display_frame_received(s);
+    }
+}
+
 // -----------------------------------------------------------------------------
 static uint32_t ps_display_transfer(SSIPeripheral *dev, uint32_t data)
 {
@@ -713,49 +964,21 @@ static uint32_t ps_display_transfer(SSIPeripheral *dev, uint32_t data)
             DPRINTF("Frame data start row=%d col=%d\n", s->row_index, s->col_index);
             newdisp = false;
         }
-        s->framebuffer[s->row_index * s->bytes_per_row + s->col_index] = data;
+        // Stage the line; it is unscrambled into the framebuffer once complete
         if (s->row_major) {
             // We get sent one row at a time
+            s->line_buffer[s->col_index - s->num_border_cols] = data;
             s->col_index++;
             if (s->col_index >= s->num_cols - s->num_border_cols) {
-                // Reached end of row, unscramble the one we just received and go onto the
-                // next row
-                ps_display_cmd_set_2_unscramble_row(s, s->row_index);
-                s->col_index = s->num_border_cols;
-                bool got_last_byte;
-                if (s->row_inverted) {
-                    s->row_index--;
-                    got_last_byte = (s->row_index < s->num_border_rows);
-                } else {
-                    s->row_index++;
-                    got_last_byte = (s->row_index >= s->num_rows - s->num_border_rows);
-                }
-                if (got_last_byte) {
-                    DPRINTF("Got last byte in frame (row) row %d, col %d -- bytes: %u\n",
-                            s->row_index, s->col_index, display_bytes);
-                    ps_set_state(s, PSDISPLAYSTATE_ACCEPTING_CMD);
-                    ps_set_redraw(s);
-                    newdisp = true;
-                    ++frameno;
-                }
+                ps_display_row_received(s);
             }
         } else {
-          // We get sent one column at a time
-          s->row_index--;
-          if (s->row_index < s->num_border_rows) {
-              // Reached top of column, unscramble the one we just received and go onto the
-              // next column
-              ps_display_cmd_set_2_unscramble_column(s, s->col_index);
-              s->row_index = s->num_rows - s->num_border_rows - 1;
-              s->col_index += 1;
-              if (s->col_index >= s->num_cols - s->num_border_cols) {
-                  DPRINTF("Got last byte in frame (col) row %d, col %d\n", s->row_index, s->col_index);
-                  ps_set_state(s, PSDISPLAYSTATE_ACCEPTING_CMD);
-                  ps_set_redraw(s);
-                  newdisp = true;
-                  ++frameno;
-              }
-          }
+            // We get sent one column at a time
+            s->line_buffer[s->row_index - s->num_border_rows] = data;
+            s->row_index--;
+            if (s->row_index < s->num_border_rows) {
+                ps_display_column_received(s);
+            }
         }
         break;
     }
@@ -763,6 +986,53 @@ static uint32_t ps_display_transfer(SSIPeripheral *dev, uint32_t data)
 }
 
 
+// -----------------------------------------------------------------------------
+// Bulk path used by the SPI controller for DMA bursts. Frame data is copied a
+// line at a time and completed lines are unscrambled as they fill; we stop at
+// the end of the frame and leave whatever follows (commands, parameters) to
+// ps_display_transfer.
+static uint32_t ps_display_transfer_bulk(DeviceState *dev, const uint8_t *buf,
+                                         uint32_t len)
+{
+    PSDisplayGlobals *s = (PSDisplayGlobals *)(dev);
+    uint32_t done = 0;
+
+    /* Ignore incoming data if our chip select is not asserted */
+    if (s->cs_value) {
+        display_bytes += len;
+        return len;
+    }
+
+    while (done < len && s->state == PSDISPLAYSTATE_ACCEPTING_FRAME_DATA) {
+        if (newdisp) {
+            DPRINTF("Frame data start row=%d col=%d\n", s->row_index, s->col_index);
+            newdisp = false;
+        }
+        if (s->row_major) {
+            const int line_end = s->num_cols - s->num_border_cols;
+            const uint32_t n = MIN(len - done, (uint32_t)(line_end - s->col_index));
+
+            memcpy(&s->line_buffer[s->col_index - s->num_border_cols], buf + done, n);
+            s->col_index += n;
+            done += n;
+            if (s->col_index >= line_end) {
+                ps_display_row_received(s);
+            }
+        } else {
+            while (done < len && s->row_index >= s->num_border_rows) {
+                s->line_buffer[s->row_index - s->num_border_rows] = buf[done++];
+                s->row_index--;
+            }
+            if (s->row_index < s->num_border_rows) {
+                ps_display_column_received(s);
+            }
+        }
+    }
+    display_bytes += done;
+    return done;
+}
+
+
 // -----------------------------------------------------------------------------
 // Pre-computed color lookup table (256 entries).
 // Rebuilt when brightness/backlight changes. Eliminates float math per pixel.
@@ -832,8 +1102,25 @@ static void ps_display_update_display(void *arg)
         } else {
             memmove(d - s->vibrate_offset * bytes_per_pixel, d, total_bytes);
         }
+#ifdef __EMSCRIPTEN__
+        {
+            uint8_t *rgba = pebble_wasm_rgba;
+            int rgba_bytes = s->num_rows * s->num_cols * 4 - abs(s->vibrate_offset) * 4;
+
+            pebble_wasm_rgba_write_begin();
+            if (s->vibrate_offset > 0) {
+                memmove(rgba, rgba + s->vibrate_offset * 4, rgba_bytes);
+            } else {
+                memmove(rgba - s->vibrate_offset * 4, rgba, rgba_bytes);
+            }
+            pebble_wasm_rgba_write_end();
+        }
+#endif
         s->vibrate_offset *= -1;
         dpy_gfx_update(s->con, 0, 0, s->num_cols, s->num_rows);
+#ifdef __EMSCRIPTEN__
+        pebble_wasm_mark_rows(0, s->num_rows);
+#endif
         return;
     }
 
@@ -841,11 +1128,35 @@ static void ps_display_update_display(void *arg)
         return;
     }
 
+    if (s->full_redraw) {
+        bitmap_fill(s->copy_dirty_rows, s->num_rows);
+    }
+
     // Only use the 180x180 overlay for 180x180 displays (s4), not for larger round displays
     const bool use_overlay = s->round_mask && s->num_rows == 180 && s->num_cols == 180;
     const PSDisplayPixelColorWithAlpha *overlay = use_overlay ? g_spalding_overlay : NULL;
     const int radius = s->num_cols / 2;
-    for (y = 0; y < s->num_rows; y++) {
+    int run_start = -1;
+#ifdef __EMSCRIPTEN__
+    uint32_t *rgba = (uint32_t *)pebble_wasm_rgba;
+    pebble_wasm_rgba_write_begin();
+#endif
+    for (y = 0; y <= s->num_rows; y++) {
+        // Convert only rows that changed, flushing each contiguous run of them
+        if (y == s->num_rows || !test_bit(y, s->copy_dirty_rows)) {
+            if (run_start >= 0) {
+                dpy_gfx_update(s->con, 0, run_start, s->num_cols, y - run_start);
+#ifdef __EMSCRIPTEN__
+                pebble_wasm_mark_rows(run_start, y - run_start);
+#endif
+                run_start = -1;
+            }
+            continue;
+        }
+        if (run_start < 0) {
+            run_start = y;
+        }
+        d = surface_data(surface) + y * surface_stride(surface);
         for (x = 0; x < s->num_cols; x++) {
           uint32_t offset = y * s->bytes_per_row + x;
           uint8_t pixel = s->framebuffer_copy[offset];
@@ -875,6 +1186,12 @@ static void ps_display_update_display(void *arg)
               color.blue = MIN(255, (factor_over * blend_color.color.blue + factor_dest * color.blue) / 255);
             }
 
+#ifdef __EMSCRIPTEN__
+            // wasm is little endian: bytes R, G, B, A as the canvas expects
+            rgba[y * s->num_cols + x] = color.red | (color.green << 8)
+                                      | (color.blue << 16) | 0xFF000000u;
+#endif
+
             switch(bpp) {
             case 8:
                 *((uint8_t *)d) = rgb_to_pixel8(color.red, color.green, color.blue);
@@ -901,8 +1218,11 @@ static void ps_display_update_display(void *arg)
             }
         }
     }
-
-    dpy_gfx_update(s->con, 0, 0, s->num_cols, s->num_rows);
+#ifdef __EMSCRIPTEN__
+    pebble_wasm_rgba_write_end();
+#endif
+    bitmap_zero(s->copy_dirty_rows, s->num_rows);
+    s->full_redraw = false;
 
     /* FPS measurement — wall-clock based, logs every 3 seconds */
     {
@@ -1010,7 +1330,7 @@ static void ps_display_set_sclk_pin_cb(void *opaque, int n, int level)
 static void ps_display_invalidate_display(void *arg)
 {
     PSDisplayGlobals *s = arg;
-    s->redraw = true;
+    ps_set_full_redraw(s);
 }
 
 // -----------------------------------------------------------------------------
@@ -1031,7 +1351,7 @@ static void ps_display_backlight_enable_cb(void *opaque, int n, int level)
     if (s->backlight_enabled != enable) {
         s->backlight_enabled = enable;
         s_color_lut_valid = false;
-        s->redraw = true;
+        ps_set_full_redraw(s);
     }
 }
 
@@ -1043,6 +1363,7 @@ static void ps_display_set_backlight_level_cb(void *opaque, int n, int level)
     PSDisplayGlobals *s = (PSDisplayGlobals *)opaque;
     assert(n == 0);
 
+    s->backlight_level = level;
     float bright_f = (float)level / 255;
 
     // Temp hack - the Pebble sets the PWM to 25% for max brightness
@@ -1051,7 +1372,7 @@ static void ps_display_set_backlight_level_cb(void *opaque, int n, int level)
         s->brightness = MIN(1.0, bright_f * 4);
         s_color_lut_valid = false;
         if (s->backlight_enabled) {
-            s->redraw = true;
+            ps_set_full_redraw(s);
         }
     }
 }
@@ -1063,7 +1384,7 @@ static void ps_display_vibe_ctl(void *opaque, int n, int level)
     assert(n == 0);
 
     s->vibrate_on = (level != 0);
-    s->redraw = true;
+    ps_set_full_redraw(s);
 }
 
 
@@ -1075,6 +1396,7 @@ static void ps_display_power_ctl(void *opaque, int n, int level)
 
     if (!level && s->power_on) {
         memset(s->framebuffer, 0, s->bytes_per_frame);
+        ps_mark_rows(s, 0, s->num_rows);
         ps_set_redraw(s);
         s->power_on = false;
     }
@@ -1087,15 +1409,17 @@ static void ps_display_reset(DeviceState *dev)
 {
     PSDisplayGlobals *s = (PSDisplayGlobals *)dev;
     memset(s->framebuffer, 0, s->bytes_per_frame);
+    ps_mark_rows(s, 0, s->num_rows);
     ps_set_redraw(s);
+    ps_set_full_redraw(s);
 }
 
 
 #ifdef __EMSCRIPTEN__
-/* Timer callback to periodically refresh the display surface in WASM.
- * With -display none, no display listeners exist, so graphic_hw_update()
- * is never called. This timer ensures the QEMU surface gets updated so
- * JavaScript can read the framebuffer via Module._pebble_display_*(). */
+/* Refresh the display surface in WASM. With -display none, no display
+ * listeners exist, so graphic_hw_update() is never called for us. This runs
+ * from a bottom half scheduled by ps_set_redraw(), so the surface is updated
+ * once per completed frame and nothing runs while the screen is static. */
 static void ps_display_wasm_refresh_cb(void *opaque)
 {
     PSDisplayGlobals *s = opaque;
@@ -1112,9 +1436,11 @@ static void ps_display_wasm_refresh_cb(void *opaque)
         pebble_wasm_cpu_pc = cpu->cc->get_pc(cpu);
     }
 
-    /* Re-arm: use VIRTUAL clock so icount deadlines wake cpu_exec() */
-    timer_mod(s->wasm_refresh_timer,
-              qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 100);
+    /* The vibrate jiggle is the only animation the model makes by itself.
+     * Use the VIRTUAL clock so icount deadlines wake cpu_exec(). */
+    if (s->vibrate_on) {
+        timer_mod(s->wasm_vibe_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 100);
+    }
 }
 #endif
 
@@ -1132,7 +1458,15 @@ static void ps_display_realize(SSIPeripheral *dev, Error **errp)
     s->bytes_per_row = s->num_cols;
     s->bytes_per_frame = s->bytes_per_row * s->num_rows;
     s->framebuffer = g_malloc(s->num_rows * s->bytes_per_row);
-    s->framebuffer_copy = g_malloc(s->num_rows * s->bytes_per_row);
+    s->framebuffer_copy = g_malloc0(s->num_rows * s->bytes_per_row);
+    s->line_buffer_size = MAX(s->num_rows, s->num_cols);
+    s->line_buffer = g_malloc0(s->line_buffer_size);
+    s->line_out = g_malloc0(s->line_buffer_size);
+    s->dirty_rows = bitmap_new(s->num_rows);
+    s->copy_dirty_rows = bitmap_new(s->num_rows);
+#ifdef __EMSCRIPTEN__
+    pebble_wasm_rgba = g_malloc0(s->num_rows * s->num_cols * 4);
+#endif
 
     s->con = graphic_console_init(DEVICE(dev), 0, &ps_display_ops, s);
     qemu_console_resize(s->con, s->num_cols, s->num_rows);
@@ -1140,6 +1474,7 @@ static void ps_display_realize(SSIPeripheral *dev, Error **errp)
     /* Create our IRQ outputs for done and intn signals */
     qdev_init_gpio_out_named(DEVICE(dev), &s->done_output, "done_output", 1);
     qdev_init_gpio_out_named(DEVICE(dev), &s->intn_output, "intn_output", 1);
+    qdev_init_gpio_out_named(DEVICE(dev), &s->frame_output, "frame_output", 1);
 
     /* Create our inputs that will be connected to GPIOs from the STM32 */
     qdev_init_gpio_in_named(DEVICE(dev), ps_display_set_reset_pin_cb,
@@ -1168,15 +1503,93 @@ static void ps_display_realize(SSIPeripheral *dev, Error **errp)
 #ifdef __EMSCRIPTEN__
     /* In WASM builds with -display none, no display change listeners exist,
      * so graphic_hw_update() is never called and the framebuffer surface
-     * never gets refreshed. Add a periodic timer to drive display updates
-     * so JavaScript can read the framebuffer via the exported functions. */
-    s->wasm_refresh_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL,
-                                          ps_display_wasm_refresh_cb, s);
-    timer_mod(s->wasm_refresh_timer,
-              qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 100);
+     * never gets refreshed. Completed frames schedule this bottom half to
+     * drive display updates so JavaScript can read the framebuffer via the
+     * exported functions. */
+    s->wasm_refresh_bh = qemu_bh_new(ps_display_wasm_refresh_cb, s);
+    s->wasm_vibe_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL,
+                                      ps_display_wasm_refresh_cb, s);
+    qemu_bh_schedule(s->wasm_refresh_bh);
 #endif
 }
 
+// -----------------------------------------------------------------------------
+static int ps_display_post_load(void *opaque, int version_id)
+{
+    PSDisplayGlobals *s = opaque;
+
+    if (s->state > PSDISPLAYSTATE_ACCEPTING_FRAME_DATA
+        || s->prog_byte_offset > sizeof(s->prog_header)
+        || s->row_index < -1 || s->row_index > (int)s->num_rows
+        || s->col_index < 0 || s->col_index > (int)s->num_cols) {
+        return -EINVAL;
+    }
+
+    // Rebuild the float brightness and colour LUT, and repaint from the restored copy
+    s->brightness = MIN(1.0, (float)s->backlight_level / 255 * 4);
+    // The dirty bitmaps are not migrated: recompare every row on the next frame
+    s_color_lut_valid = false;
+    ps_mark_rows(s, 0, s->num_rows);
+    ps_set_full_redraw(s);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+static bool ps_display_line_needed(void *opaque)
+{
+    PSDisplayGlobals *s = opaque;
+    return s->state == PSDISPLAYSTATE_ACCEPTING_FRAME_DATA;
+}
+
+static const VMStateDescription vmstate_ps_display_line = {
+    .name = "pebble-snowy-display/line",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = ps_display_line_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_VBUFFER_UINT32(line_buffer, PSDisplayGlobals, 1, NULL,
+                               line_buffer_size),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+// -----------------------------------------------------------------------------
+static const VMStateDescription vmstate_ps_display = {
+    .name = "pebble-snowy-display",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = ps_display_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_SSI_PERIPHERAL(parent_obj, PSDisplayGlobals),
+        VMSTATE_VBUFFER_UINT32(framebuffer, PSDisplayGlobals, 1, NULL,
+                               bytes_per_frame),
+        VMSTATE_VBUFFER_UINT32(framebuffer_copy, PSDisplayGlobals, 1, NULL,
+                               bytes_per_frame),
+        VMSTATE_INT32(col_index, PSDisplayGlobals),
+        VMSTATE_INT32(row_index, PSDisplayGlobals),
+        VMSTATE_BOOL(backlight_enabled, PSDisplayGlobals),
+        VMSTATE_UINT32(backlight_level, PSDisplayGlobals),
+        VMSTATE_BOOL(power_on, PSDisplayGlobals),
+        VMSTATE_UINT32(state, PSDisplayGlobals),
+        VMSTATE_UINT8(cmd, PSDisplayGlobals),
+        VMSTATE_UINT32(parameter, PSDisplayGlobals),
+        VMSTATE_UINT32(parameter_byte_offset, PSDisplayGlobals),
+        VMSTATE_UINT32(scene, PSDisplayGlobals),
+        VMSTATE_BOOL(sclk_value, PSDisplayGlobals),
+        VMSTATE_BOOL(cs_value, PSDisplayGlobals),
+        VMSTATE_BOOL(vibrate_on, PSDisplayGlobals),
+        VMSTATE_INT32(vibrate_offset, PSDisplayGlobals),
+        VMSTATE_UINT8_ARRAY(prog_header, PSDisplayGlobals, 256),
+        VMSTATE_UINT32(prog_byte_offset, PSDisplayGlobals),
+        VMSTATE_UINT32(cmd_set, PSDisplayGlobals),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * const []) {
+        &vmstate_ps_display_line,
+        NULL
+    }
+};
+
 // -----------------------------------------------------------------------------
 static const Property ps_display_init_properties[] = {
     DEFINE_PROP_UINT32("num_rows", PSDisplayGlobals, num_rows, 172),
@@ -1200,12 +1613,15 @@ static void ps_display_class_init(ObjectClass *klass, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     SSIPeripheralClass *k = SSI_PERIPHERAL_CLASS(klass);
+    Stm32SpiBulkClass *bk = STM32_SPI_BULK_CLASS(klass);
 
     device_class_set_props(dc, ps_display_init_properties);
+    dc->vmsd = &vmstate_ps_display;
     k->realize = ps_display_realize;
     k->transfer = ps_display_transfer;
     k->cs_polarity = SSI_CS_LOW;
     k->set_cs = ps_display_set_cs;
+    bk->transfer_bulk = ps_display_transfer_bulk;
     device_class_set_legacy_reset(dc, ps_display_reset);
 }
 
@@ -1215,6 +1631,10 @@ static const TypeInfo ps_display_info = {
     .parent        = TYPE_SSI_PERIPHERAL,
     .instance_size = sizeof(PSDisplayGlobals),
     .class_init    = ps_display_class_init,
+    .interfaces    = (const InterfaceInfo[]) {
+        { TYPE_STM32_SPI_BULK },
+        { }
+    },
 };
 
 // -----------------------------------------------------------------------------
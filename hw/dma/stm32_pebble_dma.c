@@ -27,8 +27,11 @@
 #include "hw/sysbus.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
+#include "hw/arm/stm32_common.h"
 #include "system/address-spaces.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
+#include "qemu/timer.h"
 #include "qapi/error.h"
 
 ////#define DEBUG_STM32F2XX_DMA
@@ -61,6 +64,14 @@
 #define R_DMA_Sx_REGS            6
 #define R_DMA_SxCR           (0x00 / 4)
 #define R_DMA_SxCR_EN   0x00000001
+#define R_DMA_SxCR_HTIE 0x00000008
+#define R_DMA_SxCR_TCIE 0x00000010
+#define R_DMA_SxCR_CIRC 0x00000100
+#define R_DMA_SxCR_PINC 0x00000200
+#define R_DMA_SxCR_MINC 0x00000400
+#define R_DMA_SxCR_DBM  0x00040000
+#define R_DMA_SxCR_CT   0x00080000
+#define R_DMA_SxCR_CHSEL(cr) (((cr) >> 25) & 0x7)
 #define R_DMA_SxNDTR         (0x04 / 4)
 #define R_DMA_SxNDTR_EN 0x00000001
 #define R_DMA_SxPAR          (0x08 / 4)
@@ -70,8 +81,16 @@
 
 #define R_DMA_MAX            (0xd0 / 4)
 
+/* Most elements moved per engine step; a long transfer is split into steps so
+ * the vCPU keeps running while it is in flight. */
+#define F2XX_DMA_BURST       1024
+
+struct f2xx_dma;
+
 typedef struct f2xx_dma_stream {
     qemu_irq irq;
+    struct f2xx_dma *dma;
+    int stream_no;
 
     uint32_t cr;
     uint16_t ndtr;
@@ -79,14 +98,25 @@ typedef struct f2xx_dma_stream {
     uint32_t m0ar;
     uint32_t m1ar;
     uint8_t isr;
+
+    /* Transfer in flight: NDTR as loaded at enable (reloaded in circular and
+     * double-buffer mode), and the virtual-time step that moves the next burst */
+    uint16_t ndtr_reload;
+    QEMUTimer *timer;
 } f2xx_dma_stream;
 
 static int msize_table[] = {1, 2, 4, 0};
 
+/* Bit offset of each stream's flags within {L,H}ISR and {L,H}IFCR */
+static const int isr_shift[4] = {0, 6, 16, 22};
+
 typedef struct f2xx_dma {
     SysBusDevice parent_obj;
     MemoryRegion iomem;
 
+    /* Virtual time per element moved, which paces every stream */
+    uint32_t element_ns;
+
     uint32_t ifcr[R_DMA_HIFCR - R_DMA_LIFCR + 1];
     f2xx_dma_stream stream[R_DMA_Sx_COUNT];
 } f2xx_dma;
@@ -99,11 +129,37 @@ f2xx_dma_pack_isr(struct f2xx_dma *s, int start_stream)
     int i;
 
     for (i = 0; i < 4; i++) {
-        r |= s->stream[i + start_stream].isr << (6 * i);
+        r |= s->stream[i + start_stream].isr << isr_shift[i];
     }
     return r;
 }
 
+static void
+f2xx_dma_stream_update_irq(f2xx_dma_stream *s)
+{
+    bool level = ((s->isr & R_DMA_ISR_TCIF) && (s->cr & R_DMA_SxCR_TCIE)) ||
+                 ((s->isr & R_DMA_ISR_HTIF) && (s->cr & R_DMA_SxCR_HTIE));
+
+    qemu_set_irq(s->irq, level);
+}
+
+/* Clear the flags written to {L,H}IFCR for four streams. */
+static void
+f2xx_dma_clear_isr(struct f2xx_dma *s, int start_stream, uint32_t data)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        f2xx_dma_stream *st = &s->stream[i + start_stream];
+        uint8_t clear = (data >> isr_shift[i]) & 0x3d;
+
+        if (clear) {
+            st->isr &= ~clear;
+            f2xx_dma_stream_update_irq(st);
+        }
+    }
+}
+
 /* Per-stream read. */
 static uint32_t
 f2xx_dma_stream_read(f2xx_dma_stream *s, int stream_no, uint32_t reg)
@@ -189,62 +245,334 @@ f2xx_dma_read(void *arg, hwaddr addr, unsigned int size)
     return result;
 }
 
-/* Start a DMA transfer for a given stream. */
+/* Whether len bytes at addr are plain RAM (or, for reads, ROM) that can be
+ * accessed through a host pointer instead of per-element dispatch. */
+static bool
+f2xx_dma_is_direct(hwaddr addr, hwaddr len, bool is_write)
+{
+    MemoryRegionSection section;
+    MemoryRegion *mr;
+    bool direct;
+
+    section = memory_region_find(get_system_memory(), addr, len);
+    mr = section.mr;
+    if (!mr) {
+        return false;
+    }
+    direct = int128_get64(section.size) == len && !memory_region_is_ram_device(mr);
+    if (is_write) {
+        direct = direct && memory_region_is_ram(mr) && !mr->readonly;
+    } else {
+        direct = direct && (memory_region_is_ram(mr) || memory_region_is_romd(mr));
+    }
+    memory_region_unref(mr);
+    return direct;
+}
+
+/* Map one side of a transfer if it is direct; NULL means use MMIO dispatch. */
+static uint8_t *
+f2xx_dma_map(hwaddr addr, hwaddr len, bool is_write)
+{
+    hwaddr mapped = len;
+    uint8_t *p;
+
+    if (!f2xx_dma_is_direct(addr, len, is_write)) {
+        return NULL;
+    }
+    p = address_space_map(&address_space_memory, addr, &mapped, is_write,
+                          MEMTXATTRS_UNSPECIFIED);
+    if (p && mapped < len) {
+        address_space_unmap(&address_space_memory, p, mapped, is_write, 0);
+        p = NULL;
+    }
+    return p;
+}
+
+/* The SPI controller that owns the data register at addr, if any */
+static DeviceState *
+f2xx_dma_spi_at(hwaddr addr)
+{
+    MemoryRegionSection section;
+    DeviceState *spi = NULL;
+
+    section = memory_region_find(get_system_memory(), addr, 1);
+    if (section.mr) {
+        if (section.offset_within_region == STM32F2XX_SPI_DR_OFFSET &&
+            object_dynamic_cast(section.mr->owner, TYPE_STM32F2XX_SPI)) {
+            spi = DEVICE(section.mr->owner);
+        }
+        memory_region_unref(section.mr);
+    }
+    return spi;
+}
+
+/* The UART that owns the data register at addr, if any */
+static Stm32Uart *
+f2xx_dma_uart_at(hwaddr addr)
+{
+    MemoryRegionSection section;
+    Stm32Uart *uart = NULL;
+
+    section = memory_region_find(get_system_memory(), addr, 1);
+    if (section.mr) {
+        if (section.offset_within_region == STM32_UART_DR_OFFSET &&
+            object_dynamic_cast(section.mr->owner, TYPE_STM32_UART)) {
+            uart = STM32_UART(section.mr->owner);
+        }
+        memory_region_unref(section.mr);
+    }
+    return uart;
+}
+
+/* Move up to count bytes between memory and a UART data register, paced by
+ * what the UART has received (dir 0) or can send (dir 1). Returns the number
+ * moved; 0 means the stream waits for the UART's DMA request. */
+static uint32_t
+f2xx_dma_uart_copy(Stm32Uart *uart, int dir, hwaddr mem, bool mem_inc,
+                   uint32_t count)
+{
+    uint8_t buf[F2XX_DMA_BURST];
+    uint32_t n;
+
+    count = MIN(count, sizeof(buf));
+    if (dir == 0) {
+        n = stm32_uart_dma_rx(uart, buf, count);
+        if (n && mem_inc) {
+            address_space_write(&address_space_memory, mem,
+                                MEMTXATTRS_UNSPECIFIED, buf, n);
+        } else if (n) {
+            /* Every byte lands on the same address; the last one stays */
+            address_space_write(&address_space_memory, mem,
+                                MEMTXATTRS_UNSPECIFIED, &buf[n - 1], 1);
+        }
+    } else {
+        if (mem_inc) {
+            address_space_read(&address_space_memory, mem,
+                               MEMTXATTRS_UNSPECIFIED, buf, count);
+        } else {
+            address_space_read(&address_space_memory, mem,
+                               MEMTXATTRS_UNSPECIFIED, buf, 1);
+            memset(buf, buf[0], count);
+        }
+        n = stm32_uart_dma_tx(uart, buf, count);
+    }
+    return n;
+}
+
+/* Move count elements of size bytes from src to dst. Each side is classified
+ * once: RAM goes through a mapped host pointer (one memmove when both sides
+ * are RAM), MMIO keeps one access per element so FIFO registers see every
+ * element. A byte stream into an SPI data register is handed to the
+ * controller as a burst. */
+static void
+f2xx_dma_copy(hwaddr src, bool src_inc, hwaddr dst, bool dst_inc,
+              int size, uint32_t count)
+{
+    const hwaddr src_len = src_inc ? (hwaddr)count * size : size;
+    const hwaddr dst_len = dst_inc ? (hwaddr)count * size : size;
+    uint8_t *src_p, *dst_p;
+    DeviceState *spi = NULL;
+    uint8_t buf[256];
+    uint32_t i;
+
+    if (!count) {
+        return;
+    }
+    src_p = f2xx_dma_map(src, src_len, false);
+    dst_p = f2xx_dma_map(dst, dst_len, true);
+    if (!dst_p && !dst_inc && size == 1) {
+        spi = f2xx_dma_spi_at(dst);
+    }
+
+    if (src_p && dst_p && src_inc && dst_inc) {
+        memmove(dst_p, src_p, src_len);
+    } else if (spi) {
+        if (!src_inc) {
+            /* Same byte over and over (dummy clocks for a read) */
+            if (src_p) {
+                buf[0] = *src_p;
+            } else {
+                address_space_read(&address_space_memory, src,
+                                   MEMTXATTRS_UNSPECIFIED, buf, 1);
+            }
+            memset(buf, buf[0], sizeof(buf));
+        }
+        for (i = 0; i < count; ) {
+            uint32_t n = MIN(count - i, sizeof(buf));
+            const uint8_t *p = buf;
+
+            if (src_inc && src_p) {
+                p = src_p + i;
+            } else if (src_inc) {
+                address_space_read(&address_space_memory, src + i,
+                                   MEMTXATTRS_UNSPECIFIED, buf, n);
+            }
+            stm32f2xx_spi_write_bulk(spi, p, n);
+            i += n;
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            const hwaddr src_off = src_inc ? (hwaddr)i * size : 0;
+            const hwaddr dst_off = dst_inc ? (hwaddr)i * size : 0;
+
+            if (src_p) {
+                memcpy(buf, src_p + src_off, size);
+            } else {
+                address_space_read(&address_space_memory, src + src_off,
+                                   MEMTXATTRS_UNSPECIFIED, buf, size);
+            }
+            if (dst_p) {
+                memcpy(dst_p + dst_off, buf, size);
+            } else {
+                address_space_write(&address_space_memory, dst + dst_off,
+                                    MEMTXATTRS_UNSPECIFIED, buf, size);
+            }
+        }
+    }
+
+    if (src_p) {
+        address_space_unmap(&address_space_memory, src_p, src_len, false, src_len);
+    }
+    if (dst_p) {
+        /* Marks the range dirty and drops any translated code in it */
+        address_space_unmap(&address_space_memory, dst_p, dst_len, true, dst_len);
+    }
+}
+
+/* Number of elements the next engine step moves: at most a burst, and never
+ * past the half-transfer point so HTIF is raised where the hardware raises it. */
+static uint32_t
+f2xx_dma_stream_burst_len(f2xx_dma_stream *s)
+{
+    uint32_t pos = s->ndtr_reload - s->ndtr;
+    uint32_t half = s->ndtr_reload / 2;
+    uint32_t n = MIN(s->ndtr, F2XX_DMA_BURST);
+
+    if (pos < half) {
+        n = MIN(n, half - pos);
+    }
+    return n;
+}
+
+static void
+f2xx_dma_stream_schedule(f2xx_dma_stream *s)
+{
+    int64_t ns = (int64_t)f2xx_dma_stream_burst_len(s) * s->dma->element_ns;
+
+    timer_mod(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + ns);
+}
+
+/* Engine step: move the elements whose time has come, raise HTIF/TCIF, and
+ * either reload (circular / double buffer), finish, or schedule the next step. */
+static void
+f2xx_dma_stream_step(void *opaque)
+{
+    f2xx_dma_stream *s = opaque;
+    int msize = msize_table[(s->cr >> 13) & 0x3];
+    int dir = (s->cr >> 6) & 0x3;
+    bool pinc = s->cr & R_DMA_SxCR_PINC;
+    bool minc = s->cr & R_DMA_SxCR_MINC;
+    uint32_t half = s->ndtr_reload / 2;
+    uint32_t pos, n;
+    hwaddr mem, per;
+    Stm32Uart *uart = NULL;
+
+    if (!(s->cr & R_DMA_SxCR_EN)) {
+        return;
+    }
+
+    pos = s->ndtr_reload - s->ndtr;
+    n = f2xx_dma_stream_burst_len(s);
+    mem = ((s->cr & R_DMA_SxCR_CT) ? s->m1ar : s->m0ar) + (minc ? pos * msize : 0);
+    per = s->par + (pinc ? pos * msize : 0);
+    if (dir != 2 && !pinc && msize == 1) {
+        uart = f2xx_dma_uart_at(per);
+    }
+
+    if (uart) {
+        n = f2xx_dma_uart_copy(uart, dir, mem, minc, n);
+        if (n == 0) {
+            /* Idle until the UART raises its DMA request */
+            return;
+        }
+    } else if (dir == 1) {
+        f2xx_dma_copy(mem, minc, per, pinc, msize, n);
+    } else {
+        /* Peripheral to memory, or memory to memory with PAR as the source */
+        f2xx_dma_copy(per, pinc, mem, minc, msize, n);
+    }
+    s->ndtr -= n;
+    pos += n;
+
+    if (pos >= half && pos - n < half) {
+        s->isr |= R_DMA_ISR_HTIF;
+    }
+    if (s->ndtr == 0) {
+        s->isr |= R_DMA_ISR_TCIF;
+        DPRINTF("stream %d TC, isr=0x%02x\n", s->stream_no, s->isr);
+        if (s->cr & R_DMA_SxCR_DBM) {
+            /* Switch to the other buffer; the guest refills the idle one */
+            s->cr ^= R_DMA_SxCR_CT;
+            s->ndtr = s->ndtr_reload;
+        } else if ((s->cr & R_DMA_SxCR_CIRC) && dir != 2) {
+            s->ndtr = s->ndtr_reload;
+        } else {
+            s->cr &= ~R_DMA_SxCR_EN;
+        }
+    }
+    f2xx_dma_stream_update_irq(s);
+
+    if (s->cr & R_DMA_SxCR_EN) {
+        f2xx_dma_stream_schedule(s);
+    }
+}
+
+/* Start a DMA transfer for a given stream. The data moves in bursts on
+ * QEMU_CLOCK_VIRTUAL, element_ns per element, so the enabling CR write
+ * returns straight away and the flags appear as the transfer progresses. */
 static void
 f2xx_dma_stream_start(f2xx_dma_stream *s, int stream_no)
 {
-    uint8_t buf[4];
     int msize = msize_table[(s->cr >> 13) & 0x3];
     int dir = (s->cr >> 6) & 0x3;
 
-    DPRINTF("stream %d start ndtr=%d par=0x%08x m0ar=0x%08x dir=%d msize=%d cr=0x%08x\n",
-            stream_no, s->ndtr, s->par, s->m0ar, dir, msize, s->cr);
+    DPRINTF("stream %d start ndtr=%d par=0x%08x m0ar=0x%08x m1ar=0x%08x dir=%d msize=%d cr=0x%08x\n",
+            stream_no, s->ndtr, s->par, s->m0ar, s->m1ar, dir, msize, s->cr);
 
     if (msize == 0) {
         qemu_log_mask(LOG_GUEST_ERROR, "f2xx dma: invalid MSIZE\n");
+        s->cr &= ~R_DMA_SxCR_EN;
+        return;
+    }
+    if (dir == 3) {
+        qemu_log_mask(LOG_GUEST_ERROR, "f2xx dma: invalid DIR %d\n", dir);
+        s->cr &= ~R_DMA_SxCR_EN;
         return;
     }
-    /* XXX Skip USART, as pacing control is not yet in place. */
-    if (s->par == 0x40011004) {
-        qemu_log_mask(LOG_UNIMP, "f2xx dma: skipping USART\n");
+    if (s->ndtr == 0) {
+        /* Nothing to move; the hardware disables the stream at once */
+        s->cr &= ~R_DMA_SxCR_EN;
         return;
     }
 
-    /* Transfer data between memory and peripherals.
-     * Use address_space_write/read to ensure MMIO handlers are dispatched. */
-    while (s->ndtr--) {
-        switch (dir) {
-        case 0: /* Peripheral to memory */
-            address_space_read(&address_space_memory, s->par,
-                              MEMTXATTRS_UNSPECIFIED, buf, msize);
-            address_space_write(&address_space_memory, s->m0ar,
-                               MEMTXATTRS_UNSPECIFIED, buf, msize);
-            s->m0ar += msize;
-            break;
-        case 1: /* Memory to peripheral */
-            address_space_read(&address_space_memory, s->m0ar,
-                              MEMTXATTRS_UNSPECIFIED, buf, msize);
-            address_space_write(&address_space_memory, s->par,
-                               MEMTXATTRS_UNSPECIFIED, buf, msize);
-            s->m0ar += msize;
-            break;
-        case 2: /* Memory to memory */
-            address_space_read(&address_space_memory, s->par,
-                              MEMTXATTRS_UNSPECIFIED, buf, msize);
-            address_space_write(&address_space_memory, s->m0ar,
-                               MEMTXATTRS_UNSPECIFIED, buf, msize);
-            s->m0ar += msize;
-            break;
-        default:
-            qemu_log_mask(LOG_GUEST_ERROR, "f2xx dma: invalid DIR %d\n", dir);
-            return;
-        }
+    s->ndtr_reload = s->ndtr;
+    f2xx_dma_stream_schedule(s);
+}
+
+/* Peripheral DMA request line n (stream * 8 + channel). A raised request wakes
+ * the stream if it is enabled on that channel and not already scheduled;
+ * paced streams stop scheduling themselves when their peripheral runs dry. */
+static void
+f2xx_dma_request(void *opaque, int n, int level)
+{
+    f2xx_dma *s = opaque;
+    f2xx_dma_stream *st = &s->stream[n / 8];
+
+    if (!level || !(st->cr & R_DMA_SxCR_EN) ||
+        R_DMA_SxCR_CHSEL(st->cr) != n % 8 || timer_pending(st->timer)) {
+        return;
     }
-    /* Transfer complete. */
-    s->cr &= ~R_DMA_SxCR_EN;
-    s->isr |= R_DMA_ISR_TCIF;
-    DPRINTF("stream %d TC, isr=0x%02x\n", stream_no, s->isr);
-    qemu_set_irq(s->irq, 1);
+    timer_mod(st->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->element_ns);
 }
 
 /* Per-stream register write. */
@@ -256,10 +584,20 @@ f2xx_dma_stream_write(f2xx_dma_stream *s, int stream_no, uint32_t addr, uint32_t
         if ((s->cr & R_DMA_SxCR_EN) == 0 && (data & R_DMA_SxCR_EN) != 0) {
             s->cr = data;
             f2xx_dma_stream_start(s, stream_no);
-            /* EN bit was cleared by stream_start after transfer completed */
         } else {
+            if ((s->cr & R_DMA_SxCR_EN) && !(data & R_DMA_SxCR_EN)) {
+                /* Stream disabled by software: stop where it is. An aborted
+                 * transfer still sets TCIF (RM0090 10.3.17), which drivers
+                 * wait on before reprogramming the stream. */
+                DPRINTF("stream %d stopped, ndtr=%d\n", stream_no, s->ndtr);
+                timer_del(s->timer);
+                if (s->ndtr) {
+                    s->isr |= R_DMA_ISR_TCIF;
+                }
+            }
             s->cr = data;
         }
+        f2xx_dma_stream_update_irq(s);
         break;
     case R_DMA_SxNDTR:
         DPRINTF("%s: stream: %d, register NDTR, data:0x%x\n", __func__, stream_no, data);
@@ -327,45 +665,13 @@ f2xx_dma_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
         break;
     case R_DMA_LIFCR:
         DPRINTF("%s: register LIFCR, data: 0x%llx\n", __func__, data);
-        // Any interrupt clear write to stream x clears all interrupts for that stream
         s->ifcr[addr - R_DMA_LIFCR] = data;
-        if (data & 0x0f400000) {
-            s->stream[3].isr = 0;
-            qemu_set_irq(s->stream[3].irq, 0);
-        }
-        if (data & 0x003d0000) {
-            s->stream[2].isr = 0;
-            qemu_set_irq(s->stream[2].irq, 0);
-        }
-        if (data & 0x00000f40) {
-            s->stream[1].isr = 0;
-            qemu_set_irq(s->stream[1].irq, 0);
-        }
-        if (data & 0x0000003d) {
-            s->stream[0].isr = 0;
-            qemu_set_irq(s->stream[0].irq, 0);
-        }
+        f2xx_dma_clear_isr(s, 0, data);
         break;
     case R_DMA_HIFCR:
         DPRINTF("%s: register HIFCR, data: 0x%llx\n", __func__, data);
-        // Any interrupt clear write to stream x clears all interrupts for that stream
         s->ifcr[addr - R_DMA_LIFCR] = data;
-        if (data & 0x0f400000) {
-            s->stream[7].isr = 0;
-            qemu_set_irq(s->stream[7].irq, 0);
-        }
-        if (data & 0x003d0000) {
-            s->stream[6].isr = 0;
-            qemu_set_irq(s->stream[6].irq, 0);
-        }
-        if (data & 0x00000f40) {
-            s->stream[5].isr = 0;
-            qemu_set_irq(s->stream[5].irq, 0);
-        }
-        if (data & 0x0000003d) {
-            s->stream[4].isr = 0;
-            qemu_set_irq(s->stream[4].irq, 0);
-        }
+        f2xx_dma_clear_isr(s, 4, data);
         break;
     default:
         qemu_log_mask(LOG_UNIMP, "f2xx dma unimpl write reg 0x%02x\n",
@@ -392,9 +698,15 @@ f2xx_dma_realize(DeviceState *dev, Error **errp)
 
     memory_region_init_io(&s->iomem, OBJECT(dev), &f2xx_dma_ops, s, "dma", 0x400);
     sysbus_init_mmio(sbd, &s->iomem);
+    qdev_init_gpio_in_named(dev, f2xx_dma_request, STM32_DMA_REQUEST,
+                            R_DMA_Sx_COUNT * 8);
 
     for (i = 0; i < R_DMA_Sx_COUNT; i++) {
         sysbus_init_irq(sbd, &s->stream[i].irq);
+        s->stream[i].dma = s;
+        s->stream[i].stream_no = i;
+        s->stream[i].timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                          f2xx_dma_stream_step, &s->stream[i]);
     }
 }
 
@@ -407,18 +719,82 @@ f2xx_dma_reset(DeviceState *ds)
 
     int i;
     for (i=0; i<R_DMA_Sx_COUNT; i++) {
-        qemu_irq save = s->stream[i].irq;
-        memset(&s->stream[i], 0, sizeof(f2xx_dma_stream));
-        s->stream[i].irq = save;
+        f2xx_dma_stream *st = &s->stream[i];
+
+        timer_del(st->timer);
+        st->cr = 0;
+        st->ndtr = 0;
+        st->par = 0;
+        st->m0ar = 0;
+        st->m1ar = 0;
+        st->isr = 0;
+        st->ndtr_reload = 0;
     }
 }
 
+static bool
+f2xx_dma_stream_engine_needed(void *opaque)
+{
+    f2xx_dma_stream *s = opaque;
+    return s->cr & R_DMA_SxCR_EN;
+}
+
+static const VMStateDescription vmstate_f2xx_dma_stream_engine = {
+    .name = "f2xx_dma_stream/engine",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = f2xx_dma_stream_engine_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT16(ndtr_reload, f2xx_dma_stream),
+        VMSTATE_TIMER_PTR(timer, f2xx_dma_stream),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_f2xx_dma_stream = {
+    .name = "f2xx_dma_stream",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(cr, f2xx_dma_stream),
+        VMSTATE_UINT16(ndtr, f2xx_dma_stream),
+        VMSTATE_UINT32(par, f2xx_dma_stream),
+        VMSTATE_UINT32(m0ar, f2xx_dma_stream),
+        VMSTATE_UINT32(m1ar, f2xx_dma_stream),
+        VMSTATE_UINT8(isr, f2xx_dma_stream),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * const []) {
+        &vmstate_f2xx_dma_stream_engine,
+        NULL
+    }
+};
+
+static const VMStateDescription vmstate_f2xx_dma = {
+    .name = "f2xx_dma",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(ifcr, f2xx_dma, R_DMA_HIFCR - R_DMA_LIFCR + 1),
+        VMSTATE_STRUCT_ARRAY(stream, f2xx_dma, R_DMA_Sx_COUNT, 1,
+                             vmstate_f2xx_dma_stream, f2xx_dma_stream),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const Property f2xx_dma_properties[] = {
+    /* 20ns per element: a 45KB display frame takes under a millisecond */
+    DEFINE_PROP_UINT32("element-ns", f2xx_dma, element_ns, 20),
+};
+
 static void
 f2xx_dma_class_init(ObjectClass *klass, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = f2xx_dma_realize;
+    dc->vmsd = &vmstate_f2xx_dma;
     device_class_set_legacy_reset(dc, f2xx_dma_reset);
+    device_class_set_props(dc, f2xx_dma_properties);
 }
 
 static const TypeInfo
@@ -28,6 +28,7 @@
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/arm/stm32_common.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "qemu/log.h"
 
@@ -263,12 +264,24 @@ static const Property stm32f2xx_gpio_properties[] = {
     DEFINE_PROP_UINT32("idr-mask", stm32f2xx_gpio, idr_mask, 0),
 };
 
+static const VMStateDescription vmstate_stm32f2xx_gpio = {
+    .name = TYPE_STM32F2XX_GPIO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, stm32f2xx_gpio, R_GPIO_MAX),
+        VMSTATE_UINT32(ccr, stm32f2xx_gpio),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void
 stm32f2xx_gpio_class_init(ObjectClass *klass, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = stm32f2xx_gpio_realize;
+    dc->vmsd = &vmstate_stm32f2xx_gpio;
     device_class_set_legacy_reset(dc, stm32f2xx_gpio_reset);
     device_class_set_props(dc, stm32f2xx_gpio_properties);
 }
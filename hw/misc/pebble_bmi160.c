@@ -0,0 +1,531 @@
+/*
+ * Pebble accelerometer: the accel half of a Bosch BMI160 on I2C (the gyro
+ * reads as zero).
+ *
+ * There is no sampling clock: samples come from the host over the control
+ * channel (pebble_sensor_accel_samples()) and are queued straight into the
+ * FIFO, so a recorded motion trace plays back in batches with no per-sample
+ * traffic. The host paces itself by the free FIFO space we report back.
+ *
+ * Supported: chip id, accel data and STATUS, SENSORTIME, the accel FIFO in
+ * headerless and header mode with FIFO_LENGTH, the watermark, FIFO-full and
+ * data-ready interrupts, single tap, INT1/INT2 mapping, level and output
+ * enable, and the FIFO flush / interrupt reset / soft reset commands. INT1
+ * and INT2 are the "int" GPIO outputs; the board wires them to a GPIO pin so
+ * they arrive on that pin's EXTI line.
+ *
+ * Reads of FIFO_DATA do not advance the register pointer, so a burst read
+ * drains frames straight out of the sample ring.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/i2c/i2c.h"
+#include "hw/irq.h"
+#include "hw/qdev-properties.h"
+#include "hw/arm/pebble.h"
+#include "migration/vmstate.h"
+#include "qemu/log.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+
+//#define DEBUG_PEBBLE_BMI160
+#ifdef DEBUG_PEBBLE_BMI160
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("PEBBLE_BMI160: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define R_BMI160_CHIP_ID        0x00
+#define R_BMI160_CHIP_ID_VALUE     0xD1
+#define R_BMI160_ERR_REG        0x02
+#define R_BMI160_PMU_STATUS     0x03
+#define R_BMI160_PMU_STATUS_ACC_SHIFT 4
+#define R_BMI160_DATA_ACC_X     0x12
+#define R_BMI160_SENSORTIME_0   0x18
+#define R_BMI160_STATUS         0x1B
+#define R_BMI160_STATUS_DRDY_ACC   0x80
+#define R_BMI160_INT_STATUS_0   0x1C
+#define R_BMI160_INT_STATUS_0_S_TAP 0x20
+#define R_BMI160_INT_STATUS_1   0x1D
+#define R_BMI160_INT_STATUS_1_DRDY  0x10
+#define R_BMI160_INT_STATUS_1_FFULL 0x20
+#define R_BMI160_INT_STATUS_1_FWM   0x40
+#define R_BMI160_INT_STATUS_2   0x1E
+#define R_BMI160_INT_STATUS_2_TAP_X 0x10
+#define R_BMI160_INT_STATUS_2_TAP_SIGN 0x80
+#define R_BMI160_FIFO_LENGTH_0  0x22
+#define R_BMI160_FIFO_LENGTH_1  0x23
+#define R_BMI160_FIFO_DATA      0x24
+#define R_BMI160_ACC_CONF       0x40
+#define R_BMI160_ACC_RANGE      0x41
+#define R_BMI160_GYR_CONF       0x42
+#define R_BMI160_MAG_CONF       0x44
+#define R_BMI160_FIFO_DOWNS     0x45
+#define R_BMI160_FIFO_CONFIG_0  0x46
+#define R_BMI160_FIFO_CONFIG_1  0x47
+#define R_BMI160_FIFO_CONFIG_1_HEADER 0x10
+#define R_BMI160_FIFO_CONFIG_1_ACC    0x40
+#define R_BMI160_INT_EN_0       0x50
+#define R_BMI160_INT_EN_0_S_TAP    0x20
+#define R_BMI160_INT_EN_1       0x51
+#define R_BMI160_INT_EN_1_DRDY     0x10
+#define R_BMI160_INT_EN_1_FFULL    0x20
+#define R_BMI160_INT_EN_1_FWM      0x40
+#define R_BMI160_INT_OUT_CTRL   0x53
+#define R_BMI160_INT_MAP_0      0x55
+#define R_BMI160_INT_MAP_1      0x56
+#define R_BMI160_INT_MAP_2      0x57
+#define R_BMI160_CMD            0x7E
+#define R_BMI160_MAX            0x80
+
+#define BMI160_CMD_ACC_PMU_BASE     0x10    /* 0x10-0x12: suspend/normal/low power */
+#define BMI160_CMD_FIFO_FLUSH       0xB0
+#define BMI160_CMD_INT_RESET        0xB1
+#define BMI160_CMD_SOFTRESET        0xB6
+
+#define BMI160_PMU_SUSPEND          0
+
+#define BMI160_FIFO_BYTES           1024
+#define BMI160_FIFO_HEADER_ACC      0x84
+#define BMI160_FIFO_EMPTY           0x80
+#define BMI160_FRAME_BYTES          6
+/* Headerless frames are the smallest, so they set the ring size */
+#define BMI160_FIFO_MAX_FRAMES      (BMI160_FIFO_BYTES / BMI160_FRAME_BYTES)
+
+/* SENSORTIME counts in 39.0625us ticks */
+#define BMI160_SENSORTIME_NS        39063
+
+#define BMI160_NUM_INTS             2
+
+#define TYPE_PEBBLE_BMI160 "pebble-bmi160"
+#define PEBBLE_BMI160(obj) OBJECT_CHECK(PebbleBmi160, (obj), TYPE_PEBBLE_BMI160)
+
+typedef struct PebbleBmi160 {
+    I2CSlave parent_obj;
+
+    qemu_irq irq[BMI160_NUM_INTS];
+
+    uint8_t regs[R_BMI160_MAX];
+    uint8_t ptr;
+    bool ptr_pending;
+
+    /* FIFO of x, y, z triples in sensor units; fifo_pos is the number of bytes
+     * of the head frame already read */
+    int16_t fifo[BMI160_FIFO_MAX_FRAMES * 3];
+    uint32_t fifo_start;
+    uint32_t fifo_count;
+    uint32_t fifo_pos;
+} PebbleBmi160;
+
+
+static uint32_t pebble_bmi160_frame_len(PebbleBmi160 *s)
+{
+    bool header = s->regs[R_BMI160_FIFO_CONFIG_1] & R_BMI160_FIFO_CONFIG_1_HEADER;
+    return BMI160_FRAME_BYTES + (header ? 1 : 0);
+}
+
+static uint32_t pebble_bmi160_fifo_capacity(PebbleBmi160 *s)
+{
+    return BMI160_FIFO_BYTES / pebble_bmi160_frame_len(s);
+}
+
+static uint32_t pebble_bmi160_fifo_length(PebbleBmi160 *s)
+{
+    return s->fifo_count * pebble_bmi160_frame_len(s) - s->fifo_pos;
+}
+
+static bool pebble_bmi160_acc_active(PebbleBmi160 *s)
+{
+    return (s->regs[R_BMI160_PMU_STATUS] >> R_BMI160_PMU_STATUS_ACC_SHIFT & 3)
+            != BMI160_PMU_SUSPEND;
+}
+
+
+/* Recompute the FIFO interrupt status and drive INT1/INT2 */
+static void pebble_bmi160_update_irq(PebbleBmi160 *s)
+{
+    uint8_t st1 = s->regs[R_BMI160_INT_STATUS_1]
+                  & ~(R_BMI160_INT_STATUS_1_FWM | R_BMI160_INT_STATUS_1_FFULL
+                      | R_BMI160_INT_STATUS_1_DRDY);
+    uint8_t en1 = s->regs[R_BMI160_INT_EN_1];
+    uint32_t wm = s->regs[R_BMI160_FIFO_CONFIG_0] * 4;
+    uint32_t len = pebble_bmi160_fifo_length(s);
+    int i;
+
+    if ((en1 & R_BMI160_INT_EN_1_FWM) && wm && len >= wm) {
+        st1 |= R_BMI160_INT_STATUS_1_FWM;
+    }
+    if ((en1 & R_BMI160_INT_EN_1_FFULL)
+        && s->fifo_count >= pebble_bmi160_fifo_capacity(s)) {
+        st1 |= R_BMI160_INT_STATUS_1_FFULL;
+    }
+    if ((en1 & R_BMI160_INT_EN_1_DRDY)
+        && (s->regs[R_BMI160_STATUS] & R_BMI160_STATUS_DRDY_ACC)) {
+        st1 |= R_BMI160_INT_STATUS_1_DRDY;
+    }
+    s->regs[R_BMI160_INT_STATUS_1] = st1;
+
+    for (i = 0; i < BMI160_NUM_INTS; i++) {
+        /* INT_MAP_1 holds the data interrupts, INT2 in the low nibble */
+        uint8_t map0 = s->regs[i ? R_BMI160_INT_MAP_2 : R_BMI160_INT_MAP_0];
+        uint8_t map1 = s->regs[R_BMI160_INT_MAP_1] >> (i ? 0 : 4) & 0xF;
+        uint8_t ctrl = s->regs[R_BMI160_INT_OUT_CTRL] >> (i * 4) & 0xF;
+        bool active = (s->regs[R_BMI160_INT_STATUS_0] & map0
+                       & R_BMI160_INT_STATUS_0_S_TAP)
+                      || ((st1 & R_BMI160_INT_STATUS_1_FFULL) && (map1 & 0x2))
+                      || ((st1 & R_BMI160_INT_STATUS_1_FWM) && (map1 & 0x4))
+                      || ((st1 & R_BMI160_INT_STATUS_1_DRDY) && (map1 & 0x8));
+        bool active_high = ctrl & 0x2;
+
+        if (!(ctrl & 0x8)) {
+            active = false;
+        }
+        qemu_set_irq(s->irq[i], active == active_high);
+    }
+}
+
+
+static void pebble_bmi160_fifo_flush(PebbleBmi160 *s)
+{
+    s->fifo_start = 0;
+    s->fifo_count = 0;
+    s->fifo_pos = 0;
+}
+
+/* Next FIFO byte. An empty FIFO reads as 0x80. */
+static uint8_t pebble_bmi160_fifo_read(PebbleBmi160 *s)
+{
+    uint32_t pos = s->fifo_pos;
+    uint8_t r;
+
+    if (s->fifo_count == 0) {
+        return BMI160_FIFO_EMPTY;
+    }
+    if (pebble_bmi160_frame_len(s) > BMI160_FRAME_BYTES) {
+        if (pos == 0) {
+            s->fifo_pos++;
+            return BMI160_FIFO_HEADER_ACC;
+        }
+        pos--;
+    }
+
+    int16_t v = s->fifo[s->fifo_start * 3 + pos / 2];
+    r = (pos & 1) ? (uint16_t)v >> 8 : v & 0xFF;
+
+    if (++s->fifo_pos == pebble_bmi160_frame_len(s)) {
+        s->fifo_pos = 0;
+        s->fifo_start = (s->fifo_start + 1) % BMI160_FIFO_MAX_FRAMES;
+        s->fifo_count--;
+    }
+    return r;
+}
+
+
+static uint8_t pebble_bmi160_read(PebbleBmi160 *s, uint8_t reg)
+{
+    uint8_t r;
+
+    switch (reg) {
+    case R_BMI160_SENSORTIME_0 ... R_BMI160_SENSORTIME_0 + 2: {
+        uint64_t t = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) / BMI160_SENSORTIME_NS;
+        return t >> ((reg - R_BMI160_SENSORTIME_0) * 8);
+    }
+    case R_BMI160_FIFO_LENGTH_0:
+        return pebble_bmi160_fifo_length(s) & 0xFF;
+    case R_BMI160_FIFO_LENGTH_1:
+        return pebble_bmi160_fifo_length(s) >> 8 & 0x7;
+    case R_BMI160_FIFO_DATA:
+        r = pebble_bmi160_fifo_read(s);
+        pebble_bmi160_update_irq(s);
+        return r;
+    case R_BMI160_DATA_ACC_X + 5:
+        /* Reading the last data byte completes the sample */
+        r = s->regs[reg];
+        s->regs[R_BMI160_STATUS] &= ~R_BMI160_STATUS_DRDY_ACC;
+        pebble_bmi160_update_irq(s);
+        return r;
+    case R_BMI160_INT_STATUS_0:
+        /* Tap is reported once */
+        r = s->regs[reg];
+        s->regs[reg] &= ~R_BMI160_INT_STATUS_0_S_TAP;
+        pebble_bmi160_update_irq(s);
+        return r;
+    default:
+        return s->regs[reg];
+    }
+}
+
+static void pebble_bmi160_reset(DeviceState *dev);
+
+static void pebble_bmi160_command(PebbleBmi160 *s, uint8_t cmd)
+{
+    switch (cmd) {
+    case BMI160_CMD_ACC_PMU_BASE ... BMI160_CMD_ACC_PMU_BASE + 2:
+        s->regs[R_BMI160_PMU_STATUS] &= ~(3 << R_BMI160_PMU_STATUS_ACC_SHIFT);
+        s->regs[R_BMI160_PMU_STATUS] |= (cmd - BMI160_CMD_ACC_PMU_BASE)
+                                        << R_BMI160_PMU_STATUS_ACC_SHIFT;
+        break;
+    case BMI160_CMD_FIFO_FLUSH:
+        pebble_bmi160_fifo_flush(s);
+        break;
+    case BMI160_CMD_INT_RESET:
+        s->regs[R_BMI160_INT_STATUS_0] = 0;
+        s->regs[R_BMI160_INT_STATUS_2] = 0;
+        break;
+    case BMI160_CMD_SOFTRESET:
+        pebble_bmi160_reset(DEVICE(s));
+        break;
+    default:
+        qemu_log_mask(LOG_UNIMP, "%s: unsupported command 0x%02x\n", __func__, cmd);
+        break;
+    }
+}
+
+static void pebble_bmi160_write(PebbleBmi160 *s, uint8_t reg, uint8_t data)
+{
+    if (reg == R_BMI160_CMD) {
+        pebble_bmi160_command(s, data);
+    } else if (reg >= R_BMI160_ACC_CONF) {
+        /* Changing frame format or sources invalidates what is queued */
+        if (reg == R_BMI160_FIFO_CONFIG_1 && data != s->regs[reg]) {
+            pebble_bmi160_fifo_flush(s);
+        }
+        s->regs[reg] = data;
+    } else {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: write to read-only register 0x%02x\n",
+                      __func__, reg);
+    }
+    pebble_bmi160_update_irq(s);
+}
+
+
+static int pebble_bmi160_event(I2CSlave *i2c, enum i2c_event event)
+{
+    PebbleBmi160 *s = PEBBLE_BMI160(i2c);
+
+    if (event == I2C_START_SEND) {
+        s->ptr_pending = true;
+    }
+    return 0;
+}
+
+static int pebble_bmi160_send(I2CSlave *i2c, uint8_t data)
+{
+    PebbleBmi160 *s = PEBBLE_BMI160(i2c);
+
+    if (s->ptr_pending) {
+        s->ptr = data & (R_BMI160_MAX - 1);
+        s->ptr_pending = false;
+    } else {
+        DPRINTF("write 0x%02x = 0x%02x\n", s->ptr, data);
+        pebble_bmi160_write(s, s->ptr, data);
+        s->ptr = (s->ptr + 1) & (R_BMI160_MAX - 1);
+    }
+    return 0;
+}
+
+static uint8_t pebble_bmi160_recv(I2CSlave *i2c)
+{
+    PebbleBmi160 *s = PEBBLE_BMI160(i2c);
+    uint8_t r = pebble_bmi160_read(s, s->ptr);
+
+    if (s->ptr != R_BMI160_FIFO_DATA) {
+        s->ptr = (s->ptr + 1) & (R_BMI160_MAX - 1);
+    }
+    return r;
+}
+
+
+/* Host samples are in milli-g */
+static int16_t pebble_bmi160_scale(PebbleBmi160 *s, int16_t mg)
+{
+    int32_t lsb_per_g;
+
+    switch (s->regs[R_BMI160_ACC_RANGE] & 0xF) {
+    case 0x5:
+        lsb_per_g = 8192;
+        break;
+    case 0x8:
+        lsb_per_g = 4096;
+        break;
+    case 0xC:
+        lsb_per_g = 2048;
+        break;
+    default:
+        lsb_per_g = 16384;
+        break;
+    }
+    return MIN(MAX((int32_t)mg * lsb_per_g / 1000, INT16_MIN), INT16_MAX);
+}
+
+/* Until the firmware powers the accelerometer up it is not driving this part
+ * (the QEMU firmware builds use their control channel driver instead), so the
+ * host's packets are left for that driver. */
+static bool pebble_bmi160_sink_samples(void *opaque, const PblAccelSample *samples,
+                                       uint32_t n, uint32_t *avail)
+{
+    PebbleBmi160 *s = opaque;
+    bool to_fifo = s->regs[R_BMI160_FIFO_CONFIG_1] & R_BMI160_FIFO_CONFIG_1_ACC;
+    uint32_t capacity = pebble_bmi160_fifo_capacity(s);
+    uint32_t i;
+
+    if (!pebble_bmi160_acc_active(s)) {
+        return false;
+    }
+    for (i = 0; i < n; i++) {
+        int16_t v[3] = {
+            pebble_bmi160_scale(s, samples[i].x),
+            pebble_bmi160_scale(s, samples[i].y),
+            pebble_bmi160_scale(s, samples[i].z),
+        };
+        int j;
+
+        for (j = 0; j < 3; j++) {
+            s->regs[R_BMI160_DATA_ACC_X + j * 2] = v[j] & 0xFF;
+            s->regs[R_BMI160_DATA_ACC_X + j * 2 + 1] = (uint16_t)v[j] >> 8;
+        }
+        s->regs[R_BMI160_STATUS] |= R_BMI160_STATUS_DRDY_ACC;
+
+        if (to_fifo) {
+            if (s->fifo_count >= capacity) {
+                /* Full: like the part, drop the oldest frame. A partially
+                 * read frame stays so the reader does not lose sync. */
+                if (s->fifo_pos) {
+                    break;
+                }
+                s->fifo_start = (s->fifo_start + 1) % BMI160_FIFO_MAX_FRAMES;
+                s->fifo_count--;
+            }
+            uint32_t slot = (s->fifo_start + s->fifo_count) % BMI160_FIFO_MAX_FRAMES;
+            memcpy(&s->fifo[slot * 3], v, sizeof(v));
+            s->fifo_count++;
+        }
+    }
+    DPRINTF("queued %u of %u samples, fifo %u frames\n", i, n, s->fifo_count);
+
+    *avail = to_fifo ? capacity - s->fifo_count : capacity;
+    pebble_bmi160_update_irq(s);
+    return true;
+}
+
+static bool pebble_bmi160_sink_tap(void *opaque, uint8_t axis, int8_t direction)
+{
+    PebbleBmi160 *s = opaque;
+
+    if (!pebble_bmi160_acc_active(s)) {
+        return false;
+    }
+    if (s->regs[R_BMI160_INT_EN_0] & R_BMI160_INT_EN_0_S_TAP) {
+        s->regs[R_BMI160_INT_STATUS_0] |= R_BMI160_INT_STATUS_0_S_TAP;
+        s->regs[R_BMI160_INT_STATUS_2] = (R_BMI160_INT_STATUS_2_TAP_X << axis)
+                                         | (direction < 0 ? R_BMI160_INT_STATUS_2_TAP_SIGN : 0);
+        pebble_bmi160_update_irq(s);
+    }
+    return true;
+}
+
+static const PblAccelSinkOps pebble_bmi160_sink_ops = {
+    .samples = pebble_bmi160_sink_samples,
+    .tap = pebble_bmi160_sink_tap,
+};
+
+
+static void pebble_bmi160_reset(DeviceState *dev)
+{
+    PebbleBmi160 *s = PEBBLE_BMI160(dev);
+
+    memset(s->regs, 0, sizeof(s->regs));
+    s->regs[R_BMI160_CHIP_ID] = R_BMI160_CHIP_ID_VALUE;
+    s->regs[R_BMI160_ACC_CONF] = 0x28;
+    s->regs[R_BMI160_ACC_RANGE] = 0x03;
+    s->regs[R_BMI160_GYR_CONF] = 0x28;
+    s->regs[R_BMI160_MAG_CONF] = 0x0B;
+    s->regs[R_BMI160_FIFO_DOWNS] = 0x88;
+    s->regs[R_BMI160_FIFO_CONFIG_0] = 0x80;
+    s->regs[R_BMI160_FIFO_CONFIG_1] = R_BMI160_FIFO_CONFIG_1_HEADER;
+    s->ptr = 0;
+    s->ptr_pending = false;
+    pebble_bmi160_fifo_flush(s);
+    pebble_bmi160_update_irq(s);
+}
+
+static void pebble_bmi160_realize(DeviceState *dev, Error **errp)
+{
+    PebbleBmi160 *s = PEBBLE_BMI160(dev);
+
+    qdev_init_gpio_out_named(dev, s->irq, "int", BMI160_NUM_INTS);
+    pebble_sensor_register_accel(&pebble_bmi160_sink_ops, s);
+}
+
+static int pebble_bmi160_post_load(void *opaque, int version_id)
+{
+    PebbleBmi160 *s = opaque;
+
+    if (s->fifo_start >= BMI160_FIFO_MAX_FRAMES
+        || s->fifo_count > BMI160_FIFO_MAX_FRAMES
+        || s->fifo_pos >= BMI160_FRAME_BYTES + 1
+        || s->ptr >= R_BMI160_MAX) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_pebble_bmi160 = {
+    .name = TYPE_PEBBLE_BMI160,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = pebble_bmi160_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_I2C_SLAVE(parent_obj, PebbleBmi160),
+        VMSTATE_UINT8_ARRAY(regs, PebbleBmi160, R_BMI160_MAX),
+        VMSTATE_UINT8(ptr, PebbleBmi160),
+        VMSTATE_BOOL(ptr_pending, PebbleBmi160),
+        VMSTATE_INT16_ARRAY(fifo, PebbleBmi160, BMI160_FIFO_MAX_FRAMES * 3),
+        VMSTATE_UINT32(fifo_start, PebbleBmi160),
+        VMSTATE_UINT32(fifo_count, PebbleBmi160),
+        VMSTATE_UINT32(fifo_pos, PebbleBmi160),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void pebble_bmi160_class_init(ObjectClass *klass, const void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    I2CSlaveClass *k = I2C_SLAVE_CLASS(klass);
+
+    dc->realize = pebble_bmi160_realize;
+    dc->vmsd = &vmstate_pebble_bmi160;
+    device_class_set_legacy_reset(dc, pebble_bmi160_reset);
+    k->event = pebble_bmi160_event;
+    k->send = pebble_bmi160_send;
+    k->recv = pebble_bmi160_recv;
+}
+
+static const TypeInfo pebble_bmi160_info = {
+    .name = TYPE_PEBBLE_BMI160,
+    .parent = TYPE_I2C_SLAVE,
+    .instance_size = sizeof(PebbleBmi160),
+    .class_init = pebble_bmi160_class_init
+};
+
+static void
+pebble_bmi160_register_types(void)
+{
+    type_register_static(&pebble_bmi160_info);
+}
+
+type_init(pebble_bmi160_register_types)
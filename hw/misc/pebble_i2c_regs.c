@@ -0,0 +1,177 @@
+/*
+ * Pebble I2C register-file parts.
+ *
+ * Board parts that the firmware only probes and configures: they ACK their
+ * address, present their ID registers and keep whatever is written to them.
+ * Each part is a subtype that supplies its register reset values. Register
+ * pointer semantics are the usual ones: the first byte of a write selects the
+ * register and later bytes (written or read) auto-increment it.
+ *
+ *   pebble-max14690   Maxim MAX14690 PMIC (charger, LDOs, buck regulators)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/i2c/i2c.h"
+#include "migration/vmstate.h"
+#include "qemu/log.h"
+
+//#define DEBUG_PEBBLE_I2C_REGS
+#ifdef DEBUG_PEBBLE_I2C_REGS
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("PEBBLE_I2C_REGS: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define PEBBLE_I2C_REGS_MAX 256
+
+#define TYPE_PEBBLE_I2C_REGS "pebble-i2c-regs"
+#define PEBBLE_I2C_REGS(obj) \
+    OBJECT_CHECK(PebbleI2CRegs, (obj), TYPE_PEBBLE_I2C_REGS)
+#define PEBBLE_I2C_REGS_GET_CLASS(obj) \
+    OBJECT_GET_CLASS(PebbleI2CRegsClass, (obj), TYPE_PEBBLE_I2C_REGS)
+#define PEBBLE_I2C_REGS_CLASS(klass) \
+    OBJECT_CLASS_CHECK(PebbleI2CRegsClass, (klass), TYPE_PEBBLE_I2C_REGS)
+
+typedef struct {
+    uint8_t reg;
+    uint8_t value;
+} PebbleI2CRegsReset;
+
+typedef struct PebbleI2CRegsClass {
+    I2CSlaveClass parent_class;
+
+    const PebbleI2CRegsReset *reset;
+    uint32_t num_reset;
+} PebbleI2CRegsClass;
+
+typedef struct PebbleI2CRegs {
+    I2CSlave parent_obj;
+
+    uint8_t regs[PEBBLE_I2C_REGS_MAX];
+    uint8_t ptr;
+    bool ptr_pending;
+} PebbleI2CRegs;
+
+
+static int pebble_i2c_regs_event(I2CSlave *i2c, enum i2c_event event)
+{
+    PebbleI2CRegs *s = PEBBLE_I2C_REGS(i2c);
+
+    if (event == I2C_START_SEND) {
+        s->ptr_pending = true;
+    }
+    return 0;
+}
+
+static int pebble_i2c_regs_send(I2CSlave *i2c, uint8_t data)
+{
+    PebbleI2CRegs *s = PEBBLE_I2C_REGS(i2c);
+
+    if (s->ptr_pending) {
+        s->ptr = data;
+        s->ptr_pending = false;
+    } else {
+        DPRINTF("%s: write 0x%02x = 0x%02x\n",
+                object_get_typename(OBJECT(s)), s->ptr, data);
+        s->regs[s->ptr++] = data;
+    }
+    return 0;
+}
+
+static uint8_t pebble_i2c_regs_recv(I2CSlave *i2c)
+{
+    PebbleI2CRegs *s = PEBBLE_I2C_REGS(i2c);
+
+    return s->regs[s->ptr++];
+}
+
+static void pebble_i2c_regs_reset(DeviceState *dev)
+{
+    PebbleI2CRegs *s = PEBBLE_I2C_REGS(dev);
+    PebbleI2CRegsClass *k = PEBBLE_I2C_REGS_GET_CLASS(dev);
+    uint32_t i;
+
+    memset(s->regs, 0, sizeof(s->regs));
+    for (i = 0; i < k->num_reset; i++) {
+        s->regs[k->reset[i].reg] = k->reset[i].value;
+    }
+    s->ptr = 0;
+    s->ptr_pending = false;
+}
+
+static const VMStateDescription vmstate_pebble_i2c_regs = {
+    .name = TYPE_PEBBLE_I2C_REGS,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_I2C_SLAVE(parent_obj, PebbleI2CRegs),
+        VMSTATE_UINT8_ARRAY(regs, PebbleI2CRegs, PEBBLE_I2C_REGS_MAX),
+        VMSTATE_UINT8(ptr, PebbleI2CRegs),
+        VMSTATE_BOOL(ptr_pending, PebbleI2CRegs),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void pebble_i2c_regs_class_init(ObjectClass *klass, const void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    I2CSlaveClass *k = I2C_SLAVE_CLASS(klass);
+
+    dc->vmsd = &vmstate_pebble_i2c_regs;
+    device_class_set_legacy_reset(dc, pebble_i2c_regs_reset);
+    k->event = pebble_i2c_regs_event;
+    k->send = pebble_i2c_regs_send;
+    k->recv = pebble_i2c_regs_recv;
+}
+
+static const TypeInfo pebble_i2c_regs_info = {
+    .name = TYPE_PEBBLE_I2C_REGS,
+    .parent = TYPE_I2C_SLAVE,
+    .instance_size = sizeof(PebbleI2CRegs),
+    .class_size = sizeof(PebbleI2CRegsClass),
+    .class_init = pebble_i2c_regs_class_init,
+    .abstract = true
+};
+
+
+/* MAX14690: ChipId 0x01. Charger and regulator status read as idle. */
+static const PebbleI2CRegsReset pebble_max14690_reset[] = {
+    { 0x00, 0x01 },     /* ChipId */
+};
+
+static void pebble_max14690_class_init(ObjectClass *klass, const void *data)
+{
+    PebbleI2CRegsClass *k = PEBBLE_I2C_REGS_CLASS(klass);
+
+    k->reset = pebble_max14690_reset;
+    k->num_reset = ARRAY_SIZE(pebble_max14690_reset);
+}
+
+static const TypeInfo pebble_max14690_info = {
+    .name = "pebble-max14690",
+    .parent = TYPE_PEBBLE_I2C_REGS,
+    .class_init = pebble_max14690_class_init
+};
+
+static void
+pebble_i2c_regs_register_types(void)
+{
+    type_register_static(&pebble_i2c_regs_info);
+    type_register_static(&pebble_max14690_info);
+}
+
+type_init(pebble_i2c_regs_register_types)
@@ -0,0 +1,433 @@
+/*
+ * Pebble magnetometer: Freescale MAG3110 on I2C
+ *
+ * The field is not simulated sample by sample. The host sets a heading and a
+ * calibration status (control channel Compass packets through
+ * pebble_sensor_compass(), or the "heading" / "calib-status" properties with
+ * qom-set on /machine/pebble-mag3110), and each measurement only marks the
+ * output stale. The X/Y/Z values are computed from the current heading the
+ * first time the firmware reads them after a measurement, so a fast heading
+ * sweep costs nothing until the firmware actually looks.
+ *
+ * Measurements run on QEMU_CLOCK_VIRTUAL: continuously at the DR/OS output
+ * rate while CTRL_REG1.AC is set, or once per CTRL_REG1.TM trigger. Each one
+ * sets DR_STATUS.ZYXDR (ZYXOW if unread) and raises the "int" GPIO output,
+ * which is cleared again by reading the last output register.
+ *
+ * The model is a horizontal field of 20 uT pointing at magnetic north plus a
+ * vertical component. Until the host reports the compass as calibrated a
+ * fixed hard-iron offset is added, which the firmware's calibration has to
+ * remove. The user offset registers are subtracted unless CTRL_REG2.RAW is set.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include <math.h>
+#include "hw/i2c/i2c.h"
+#include "hw/irq.h"
+#include "hw/arm/pebble.h"
+#include "migration/vmstate.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/log.h"
+#include "qemu/timer.h"
+
+//#define DEBUG_PEBBLE_MAG3110
+#ifdef DEBUG_PEBBLE_MAG3110
+#define DPRINTF(fmt, ...)                                       \
+    do { printf("PEBBLE_MAG3110: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...)
+#endif
+
+#define R_MAG_DR_STATUS         0x00
+#define R_MAG_DR_STATUS_ZYXDR      0x08
+#define R_MAG_DR_STATUS_ZYXOW      0x80
+#define R_MAG_OUT_X_MSB         0x01
+#define R_MAG_OUT_Z_MSB         0x05
+#define R_MAG_OUT_Z_LSB         0x06
+#define R_MAG_WHO_AM_I          0x07
+#define R_MAG_WHO_AM_I_VALUE       0xC4
+#define R_MAG_SYSMOD            0x08
+#define R_MAG_OFF_X_MSB         0x09
+#define R_MAG_OFF_Z_LSB         0x0E
+#define R_MAG_DIE_TEMP          0x0F
+#define R_MAG_CTRL_REG1         0x10
+#define R_MAG_CTRL_REG1_AC         0x01
+#define R_MAG_CTRL_REG1_TM         0x02
+#define R_MAG_CTRL_REG1_FR         0x04
+#define R_MAG_CTRL_REG2         0x11
+#define R_MAG_CTRL_REG2_MAG_RST    0x10
+#define R_MAG_CTRL_REG2_RAW        0x20
+#define R_MAG_MAX               0x12
+
+/* 80 Hz at DR = OS = 0, halving for each step of either */
+#define MAG_BASE_PERIOD_NS      12500000LL
+
+/* Field strengths in output LSBs (0.1 uT) */
+#define MAG_FIELD_HORIZONTAL    200
+#define MAG_FIELD_VERTICAL      (-400)
+static const int16_t mag_hard_iron[3] = { 300, -150, 100 };
+
+/* CompassStatus from the firmware's QEMU protocol */
+#define MAG_CALIB_CALIBRATED    2
+
+#define TYPE_PEBBLE_MAG3110 "pebble-mag3110"
+#define PEBBLE_MAG3110(obj) OBJECT_CHECK(PebbleMag3110, (obj), TYPE_PEBBLE_MAG3110)
+
+typedef struct PebbleMag3110 {
+    I2CSlave parent_obj;
+
+    qemu_irq irq;
+    QEMUTimer *timer;
+
+    uint8_t regs[R_MAG_MAX];
+    uint8_t ptr;
+    bool ptr_pending;
+
+    /* Host input. heading: 0x10000 is 360 degrees */
+    uint32_t heading;
+    uint8_t calib_status;
+
+    /* A measurement happened since the output registers were computed */
+    bool stale;
+    /* The firmware has written to the part, so it drives it natively */
+    bool in_use;
+} PebbleMag3110;
+
+
+static int64_t pebble_mag3110_period_ns(PebbleMag3110 *s)
+{
+    uint8_t cr1 = s->regs[R_MAG_CTRL_REG1];
+    int shift = (cr1 >> 5) + (cr1 >> 3 & 3);
+
+    return MAG_BASE_PERIOD_NS << shift;
+}
+
+static void pebble_mag3110_update_irq(PebbleMag3110 *s)
+{
+    qemu_set_irq(s->irq, !!(s->regs[R_MAG_DR_STATUS] & R_MAG_DR_STATUS_ZYXDR));
+}
+
+static void pebble_mag3110_update_sysmod(PebbleMag3110 *s)
+{
+    if (!(s->regs[R_MAG_CTRL_REG1] & R_MAG_CTRL_REG1_AC)) {
+        s->regs[R_MAG_SYSMOD] = 0;
+    } else {
+        s->regs[R_MAG_SYSMOD] = (s->regs[R_MAG_CTRL_REG2] & R_MAG_CTRL_REG2_RAW) ? 1 : 2;
+    }
+}
+
+/* Fill OUT_X..OUT_Z from the current heading */
+static void pebble_mag3110_compute(PebbleMag3110 *s)
+{
+    double theta = (double)s->heading * 2 * M_PI / 0x10000;
+    int32_t v[3] = {
+        lround(MAG_FIELD_HORIZONTAL * cos(theta)),
+        lround(-MAG_FIELD_HORIZONTAL * sin(theta)),
+        MAG_FIELD_VERTICAL,
+    };
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (s->calib_status != MAG_CALIB_CALIBRATED) {
+            v[i] += mag_hard_iron[i];
+        }
+        if (!(s->regs[R_MAG_CTRL_REG2] & R_MAG_CTRL_REG2_RAW)) {
+            /* User offsets are 15 bit, left justified */
+            int16_t off = (s->regs[R_MAG_OFF_X_MSB + i * 2] << 8)
+                          | s->regs[R_MAG_OFF_X_MSB + i * 2 + 1];
+            v[i] -= off >> 1;
+        }
+        v[i] = MIN(MAX(v[i], INT16_MIN), INT16_MAX);
+        s->regs[R_MAG_OUT_X_MSB + i * 2] = (uint16_t)v[i] >> 8;
+        s->regs[R_MAG_OUT_X_MSB + i * 2 + 1] = v[i] & 0xFF;
+    }
+    s->stale = false;
+    DPRINTF("heading 0x%x -> %d %d %d\n", s->heading, v[0], v[1], v[2]);
+}
+
+static void pebble_mag3110_measure(void *opaque)
+{
+    PebbleMag3110 *s = opaque;
+
+    if (s->regs[R_MAG_DR_STATUS] & R_MAG_DR_STATUS_ZYXDR) {
+        s->regs[R_MAG_DR_STATUS] |= R_MAG_DR_STATUS_ZYXOW;
+    }
+    s->regs[R_MAG_DR_STATUS] |= R_MAG_DR_STATUS_ZYXDR;
+    s->stale = true;
+
+    /* A trigger is a single measurement, AC keeps going */
+    s->regs[R_MAG_CTRL_REG1] &= ~R_MAG_CTRL_REG1_TM;
+    if (s->regs[R_MAG_CTRL_REG1] & R_MAG_CTRL_REG1_AC) {
+        timer_mod(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                            + pebble_mag3110_period_ns(s));
+    }
+    pebble_mag3110_update_irq(s);
+}
+
+static void pebble_mag3110_write_ctrl1(PebbleMag3110 *s, uint8_t data)
+{
+    uint8_t old = s->regs[R_MAG_CTRL_REG1];
+
+    s->regs[R_MAG_CTRL_REG1] = data;
+    if (data & R_MAG_CTRL_REG1_TM) {
+        /* Triggered measurement, unless one is already in progress */
+        if (!timer_pending(s->timer)) {
+            timer_mod(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                                + pebble_mag3110_period_ns(s));
+        }
+    } else if ((data & R_MAG_CTRL_REG1_AC) && (!(old & R_MAG_CTRL_REG1_AC)
+                                               || (old ^ data) & 0xF8)) {
+        timer_mod(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                            + pebble_mag3110_period_ns(s));
+    } else if (!(data & R_MAG_CTRL_REG1_AC)) {
+        timer_del(s->timer);
+    }
+    pebble_mag3110_update_sysmod(s);
+}
+
+
+static uint8_t pebble_mag3110_read(PebbleMag3110 *s, uint8_t reg)
+{
+    bool fast = s->regs[R_MAG_CTRL_REG1] & R_MAG_CTRL_REG1_FR;
+    uint8_t r;
+
+    if (reg >= R_MAG_OUT_X_MSB && reg <= R_MAG_OUT_Z_LSB && s->stale) {
+        pebble_mag3110_compute(s);
+    }
+    r = s->regs[reg];
+
+    /* Reading the last output byte completes the sample */
+    if (reg == (fast ? R_MAG_OUT_Z_MSB : R_MAG_OUT_Z_LSB)) {
+        s->regs[R_MAG_DR_STATUS] &= ~(R_MAG_DR_STATUS_ZYXDR | R_MAG_DR_STATUS_ZYXOW);
+        pebble_mag3110_update_irq(s);
+    }
+    return r;
+}
+
+static void pebble_mag3110_write(PebbleMag3110 *s, uint8_t reg, uint8_t data)
+{
+    s->in_use = true;
+
+    switch (reg) {
+    case R_MAG_OFF_X_MSB ... R_MAG_OFF_Z_LSB:
+        s->regs[reg] = data;
+        break;
+    case R_MAG_CTRL_REG1:
+        pebble_mag3110_write_ctrl1(s, data);
+        break;
+    case R_MAG_CTRL_REG2:
+        /* Mag_RST is a one-shot sensor reset */
+        s->regs[reg] = data & ~R_MAG_CTRL_REG2_MAG_RST;
+        pebble_mag3110_update_sysmod(s);
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: write to read-only register 0x%02x\n",
+                      __func__, reg);
+        break;
+    }
+}
+
+
+static int pebble_mag3110_event(I2CSlave *i2c, enum i2c_event event)
+{
+    PebbleMag3110 *s = PEBBLE_MAG3110(i2c);
+
+    if (event == I2C_START_SEND) {
+        s->ptr_pending = true;
+    }
+    return 0;
+}
+
+static int pebble_mag3110_send(I2CSlave *i2c, uint8_t data)
+{
+    PebbleMag3110 *s = PEBBLE_MAG3110(i2c);
+
+    if (s->ptr_pending) {
+        s->ptr = data;
+        s->ptr_pending = false;
+    } else {
+        DPRINTF("write 0x%02x = 0x%02x\n", s->ptr, data);
+        if (s->ptr < R_MAG_MAX) {
+            pebble_mag3110_write(s, s->ptr, data);
+        }
+        s->ptr++;
+    }
+    return 0;
+}
+
+static uint8_t pebble_mag3110_recv(I2CSlave *i2c)
+{
+    PebbleMag3110 *s = PEBBLE_MAG3110(i2c);
+    bool fast = s->regs[R_MAG_CTRL_REG1] & R_MAG_CTRL_REG1_FR;
+    uint8_t r = 0;
+
+    if (s->ptr < R_MAG_MAX) {
+        r = pebble_mag3110_read(s, s->ptr);
+    }
+
+    /* Auto-increment wraps the output block back to DR_STATUS; fast read
+     * skips the LSBs */
+    if (fast && s->ptr >= R_MAG_OUT_X_MSB && s->ptr < R_MAG_OUT_Z_MSB) {
+        s->ptr += 2;
+    } else if (s->ptr == (fast ? R_MAG_OUT_Z_MSB : R_MAG_OUT_Z_LSB)) {
+        s->ptr = R_MAG_DR_STATUS;
+    } else {
+        s->ptr++;
+    }
+    return r;
+}
+
+
+static void pebble_mag3110_set(PebbleMag3110 *s, uint32_t heading, uint8_t calib_status)
+{
+    s->heading = heading & 0xFFFF;
+    s->calib_status = calib_status;
+}
+
+static bool pebble_mag3110_sink(void *opaque, uint32_t heading, uint8_t calib_status)
+{
+    PebbleMag3110 *s = opaque;
+
+    /* Leave the packet for the firmware's QEMU driver if it is not using us */
+    if (!s->in_use) {
+        return false;
+    }
+    pebble_mag3110_set(s, heading, calib_status);
+    return true;
+}
+
+static void pebble_mag3110_get_heading(Object *obj, Visitor *v, const char *name,
+                                       void *opaque, Error **errp)
+{
+    PebbleMag3110 *s = PEBBLE_MAG3110(obj);
+
+    visit_type_uint32(v, name, &s->heading, errp);
+}
+
+static void pebble_mag3110_set_heading(Object *obj, Visitor *v, const char *name,
+                                       void *opaque, Error **errp)
+{
+    PebbleMag3110 *s = PEBBLE_MAG3110(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    pebble_mag3110_set(s, value, s->calib_status);
+}
+
+static void pebble_mag3110_get_calib(Object *obj, Visitor *v, const char *name,
+                                     void *opaque, Error **errp)
+{
+    PebbleMag3110 *s = PEBBLE_MAG3110(obj);
+
+    visit_type_uint8(v, name, &s->calib_status, errp);
+}
+
+static void pebble_mag3110_set_calib(Object *obj, Visitor *v, const char *name,
+                                     void *opaque, Error **errp)
+{
+    PebbleMag3110 *s = PEBBLE_MAG3110(obj);
+    uint8_t value;
+
+    if (!visit_type_uint8(v, name, &value, errp)) {
+        return;
+    }
+    pebble_mag3110_set(s, s->heading, value);
+}
+
+
+static void pebble_mag3110_reset(DeviceState *dev)
+{
+    PebbleMag3110 *s = PEBBLE_MAG3110(dev);
+
+    timer_del(s->timer);
+    memset(s->regs, 0, sizeof(s->regs));
+    s->regs[R_MAG_WHO_AM_I] = R_MAG_WHO_AM_I_VALUE;
+    s->regs[R_MAG_DIE_TEMP] = 25;
+    s->ptr = 0;
+    s->ptr_pending = false;
+    s->stale = true;
+    s->in_use = false;
+    pebble_mag3110_update_irq(s);
+}
+
+static void pebble_mag3110_realize(DeviceState *dev, Error **errp)
+{
+    PebbleMag3110 *s = PEBBLE_MAG3110(dev);
+
+    qdev_init_gpio_out_named(dev, &s->irq, "int", 1);
+    s->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, pebble_mag3110_measure, s);
+    pebble_sensor_register_compass(pebble_mag3110_sink, s);
+}
+
+static const VMStateDescription vmstate_pebble_mag3110 = {
+    .name = TYPE_PEBBLE_MAG3110,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_I2C_SLAVE(parent_obj, PebbleMag3110),
+        VMSTATE_TIMER_PTR(timer, PebbleMag3110),
+        VMSTATE_UINT8_ARRAY(regs, PebbleMag3110, R_MAG_MAX),
+        VMSTATE_UINT8(ptr, PebbleMag3110),
+        VMSTATE_BOOL(ptr_pending, PebbleMag3110),
+        VMSTATE_UINT32(heading, PebbleMag3110),
+        VMSTATE_UINT8(calib_status, PebbleMag3110),
+        VMSTATE_BOOL(stale, PebbleMag3110),
+        VMSTATE_BOOL(in_use, PebbleMag3110),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void pebble_mag3110_class_init(ObjectClass *klass, const void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    I2CSlaveClass *k = I2C_SLAVE_CLASS(klass);
+
+    dc->realize = pebble_mag3110_realize;
+    dc->vmsd = &vmstate_pebble_mag3110;
+    device_class_set_legacy_reset(dc, pebble_mag3110_reset);
+    k->event = pebble_mag3110_event;
+    k->send = pebble_mag3110_send;
+    k->recv = pebble_mag3110_recv;
+
+    object_class_property_add(klass, "heading", "uint32",
+                              pebble_mag3110_get_heading,
+                              pebble_mag3110_set_heading, NULL, NULL);
+    object_class_property_set_description(klass, "heading",
+            "Magnetic heading, 0x10000 is 360 degrees");
+    object_class_property_add(klass, "calib-status", "uint8",
+                              pebble_mag3110_get_calib,
+                              pebble_mag3110_set_calib, NULL, NULL);
+    object_class_property_set_description(klass, "calib-status",
+            "CompassStatus: 0 invalid, 1 calibrating, 2 calibrated");
+}
+
+static const TypeInfo pebble_mag3110_info = {
+    .name = TYPE_PEBBLE_MAG3110,
+    .parent = TYPE_I2C_SLAVE,
+    .instance_size = sizeof(PebbleMag3110),
+    .class_init = pebble_mag3110_class_init
+};
+
+static void
+pebble_mag3110_register_types(void)
+{
+    type_register_static(&pebble_mag3110_info);
+}
+
+type_init(pebble_mag3110_register_types)
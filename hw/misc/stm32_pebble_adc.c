@@ -28,6 +28,7 @@
 #include "hw/sysbus.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
 #include "qapi/error.h"
 
@@ -222,12 +223,24 @@ stm32f2xx_adc_realize(DeviceState *dev, Error **errp)
 }
 
 
+static const VMStateDescription vmstate_stm32f2xx_adc = {
+    .name = "stm32f2xx_adc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32_2DARRAY(regs, stm32_adc, 3, R_ADC_MAX),
+        VMSTATE_UINT32(ccr, stm32_adc),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void
 stm32f2xx_adc_class_init(ObjectClass *klass, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = stm32f2xx_adc_realize;
+    dc->vmsd = &vmstate_stm32f2xx_adc;
     device_class_set_legacy_reset(dc, f2xx_adc_reset);
 }
 
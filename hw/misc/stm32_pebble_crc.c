@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "hw/sysbus.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
 #include "qapi/error.h"
 
@@ -206,11 +207,23 @@ f2xx_crc_reset(DeviceState *ds)
 }
 
 
+static const VMStateDescription vmstate_f2xx_crc = {
+    .name = "f2xx_crc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(crc, f2xx_crc),
+        VMSTATE_UINT8(idr, f2xx_crc),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void
 f2xx_crc_class_init(ObjectClass *klass, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = f2xx_crc_realize;
+    dc->vmsd = &vmstate_f2xx_crc;
     device_class_set_legacy_reset(dc, f2xx_crc_reset);
 }
 
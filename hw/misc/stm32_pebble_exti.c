@@ -22,6 +22,7 @@
 #include "qemu/osdep.h"
 #include "hw/sysbus.h"
 #include "hw/arm/stm32_common.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "qemu/log.h"
 
@@ -368,11 +369,26 @@ void stm32_exti_set_gpio_array(Stm32Exti *s, stm32f2xx_gpio **gpio)
     s->stm32_gpio = gpio;
 }
 
+static const VMStateDescription vmstate_stm32_exti = {
+    .name = TYPE_STM32_EXTI,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(EXTI_IMR, Stm32Exti),
+        VMSTATE_UINT32(EXTI_RTSR, Stm32Exti),
+        VMSTATE_UINT32(EXTI_FTSR, Stm32Exti),
+        VMSTATE_UINT32(EXTI_SWIER, Stm32Exti),
+        VMSTATE_UINT32(EXTI_PR, Stm32Exti),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void stm32_exti_class_init(ObjectClass *klass, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = stm32_exti_realize;
+    dc->vmsd = &vmstate_stm32_exti;
     device_class_set_legacy_reset(dc, stm32_exti_reset);
 }
 
@@ -30,6 +30,7 @@
 #include "hw/qdev-properties.h"
 #include "hw/arm/stm32_common.h"
 #include "hw/i2c/i2c.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
 #include "qapi/error.h"
 
@@ -124,6 +125,10 @@ typedef struct f2xx_i2c {
 
     int32_t rx;
     int rx_full;
+    bool rx_nacked;
+    /* Byte held in the shift register while DR is still full (BTF) */
+    uint8_t rx_shift;
+    bool rx_shift_full;
     uint16_t regs[R_I2C_MAX];
 
 } f2xx_i2c;
@@ -164,6 +169,35 @@ static void f2xx_i2c_update_irq(f2xx_i2c *s) {
 
 
 
+/* Clock bytes in from the addressed slave while there is room for them: the
+ * first lands in DR (RxNE), the next waits in the shift register with the
+ * clock stretched (BTF), which is what the RM0090 N>2 read sequence polls for
+ * before clearing ACK. Each byte is ACKed or NACKed according to CR1.ACK as
+ * it arrives; a NACKed byte ends the read, as does STOP. */
+static void f2xx_i2c_recv_fill(f2xx_i2c *s)
+{
+    while (!s->rx_nacked && !s->rx_shift_full &&
+           (s->regs[R_I2C_SR2] & R_I2C_SR2_MSL_BIT) &&
+           !(s->regs[R_I2C_SR2] & R_I2C_SR2_TRA_BIT)) {
+        uint8_t data = i2c_recv(s->bus);
+
+        s->rx_nacked = !(s->regs[R_I2C_CR1] & R_I2C_CR1_ACK_BIT);
+        if (s->rx_nacked) {
+            i2c_nack(s->bus);
+        }
+        if (!s->rx_full) {
+            s->rx = data;
+            s->rx_full = 1;
+            s->regs[R_I2C_SR1] |= R_I2C_SR1_RxNE_BIT;
+        } else {
+            s->rx_shift = data;
+            s->rx_shift_full = true;
+            s->regs[R_I2C_SR1] |= R_I2C_SR1_BTF_BIT;
+        }
+    }
+}
+
+
 static uint64_t
 f2xx_i2c_read(void *arg, hwaddr offset, unsigned size)
 {
@@ -183,20 +217,29 @@ f2xx_i2c_read(void *arg, hwaddr offset, unsigned size)
           (unsigned)offset << 2);
     }
 
-    /* SR1 read is part of the flag-clearing sequence */
-    if (offset == R_I2C_SR1) {
-        s->rx_full = 0;
-    }
-    /* Reading SR2 after SR1 clears ADDR and STOPF */
+    /* Reading SR2 after SR1 clears ADDR and STOPF. Once ADDR is cleared a
+     * receiver starts clocking in the first byte. */
     if (offset == R_I2C_SR2) {
+        bool addr = s->regs[R_I2C_SR1] & R_I2C_SR1_ADDR_BIT;
         s->regs[R_I2C_SR1] &= ~(R_I2C_SR1_ADDR_BIT | R_I2C_SR1_STOPF_BIT);
+        if (addr && !(s->regs[R_I2C_SR2] & R_I2C_SR2_TRA_BIT)) {
+            f2xx_i2c_recv_fill(s);
+        }
         f2xx_i2c_update_irq(s);
     }
-    /* Reading DR returns received byte */
+    /* Reading DR returns the received byte and moves up any byte waiting in
+     * the shift register, which frees it for the slave's next byte */
     if (offset == R_I2C_DR && s->rx_full) {
         r = s->rx & 0xFF;
-        s->rx_full = 0;
-        s->regs[R_I2C_SR1] &= ~R_I2C_SR1_RxNE_BIT;
+        s->regs[R_I2C_SR1] &= ~R_I2C_SR1_BTF_BIT;
+        if (s->rx_shift_full) {
+            s->rx = s->rx_shift;
+            s->rx_shift_full = false;
+        } else {
+            s->rx_full = 0;
+            s->regs[R_I2C_SR1] &= ~R_I2C_SR1_RxNE_BIT;
+        }
+        f2xx_i2c_recv_fill(s);
         f2xx_i2c_update_irq(s);
     }
 
@@ -229,18 +272,26 @@ f2xx_i2c_write(void *arg, hwaddr offset, uint64_t data, unsigned size)
     switch (offset) {
     case R_I2C_CR1:
         s->regs[offset] = data;
-        if (data & R_I2C_CR1_START_BIT) {
-            /* Match QEMU 2.5 behavior: immediately fail with bus error.
-             * No I2C slave devices are emulated, so any transfer would NACK.
-             * Setting BERR lets the firmware error ISR handle it instantly
-             * instead of going through the full SB→address→AF chain that
-             * causes ~3s timeout per probe. */
-            s->regs[R_I2C_SR1] |= R_I2C_SR1_BERR_BIT;
+        if ((data & R_I2C_CR1_START_BIT) && (data & R_I2C_CR1_PE_BIT)) {
+            /* (Repeated) START: the bus is ours at once, the address goes
+             * out on the next DR write. The whole address phase then runs
+             * inside that access, so a probe costs no virtual time. */
+            s->regs[R_I2C_SR1] |= R_I2C_SR1_SB_BIT;
+            s->regs[R_I2C_SR1] &= ~(R_I2C_SR1_ADDR_BIT | R_I2C_SR1_BTF_BIT |
+                                      R_I2C_SR1_TxE_BIT | R_I2C_SR1_RxNE_BIT);
+            s->regs[R_I2C_SR2] |= R_I2C_SR2_MSL_BIT | R_I2C_SR2_BUSY_BIT;
             s->regs[offset] &= ~R_I2C_CR1_START_BIT;
+            s->rx_full = 0;
+            s->rx_nacked = false;
+            s->rx_shift_full = false;
         }
         if (data & R_I2C_CR1_STOP_BIT) {
             /* STOP condition → end any ongoing transfer, leave master mode */
-            i2c_end_transfer(s->bus);
+            if (s->regs[R_I2C_SR2] & R_I2C_SR2_MSL_BIT) {
+                i2c_end_transfer(s->bus);
+            }
+            s->regs[R_I2C_SR1] &= ~(R_I2C_SR1_SB_BIT | R_I2C_SR1_ADDR_BIT |
+                                      R_I2C_SR1_BTF_BIT | R_I2C_SR1_TxE_BIT);
             s->regs[R_I2C_SR2] &= ~(R_I2C_SR2_MSL_BIT | R_I2C_SR2_BUSY_BIT |
                                       R_I2C_SR2_TRA_BIT);
             s->regs[offset] &= ~R_I2C_CR1_STOP_BIT;
@@ -249,6 +300,8 @@ f2xx_i2c_write(void *arg, hwaddr offset, uint64_t data, unsigned size)
             /* PE disabled → reset all status */
             s->regs[R_I2C_SR1] = 0;
             s->regs[R_I2C_SR2] = 0;
+            s->rx_full = 0;
+            s->rx_shift_full = false;
         }
         break;
 
@@ -259,17 +312,21 @@ f2xx_i2c_write(void *arg, hwaddr offset, uint64_t data, unsigned size)
             int is_recv = data & 1;
             s->regs[R_I2C_SR1] &= ~R_I2C_SR1_SB_BIT;
             if (i2c_start_transfer(s->bus, addr, is_recv)) {
-                /* NACK → no slave at this address */
+                /* NACK → no slave at this address. We stay master until the
+                 * firmware sends STOP, as on hardware. */
+                DPRINTF("%s: no slave at 0x%02x\n", __func__, addr);
                 s->regs[R_I2C_SR1] |= R_I2C_SR1_AF_BIT;
-                s->regs[R_I2C_SR2] &= ~(R_I2C_SR2_MSL_BIT |
-                                          R_I2C_SR2_BUSY_BIT);
-            } else {
+            } else if (is_recv) {
                 /* ACK → slave responded, address phase complete */
+                s->regs[R_I2C_SR1] |= R_I2C_SR1_ADDR_BIT;
+                s->regs[R_I2C_SR2] &= ~R_I2C_SR2_TRA_BIT;
+            } else {
                 s->regs[R_I2C_SR1] |= R_I2C_SR1_ADDR_BIT | R_I2C_SR1_TxE_BIT;
-                if (!is_recv) {
-                    s->regs[R_I2C_SR2] |= R_I2C_SR2_TRA_BIT;
-                }
+                s->regs[R_I2C_SR2] |= R_I2C_SR2_TRA_BIT;
             }
+        } else if (!(s->regs[R_I2C_SR2] & R_I2C_SR2_TRA_BIT)) {
+            qemu_log_mask(LOG_GUEST_ERROR, "%s: DR write while not transmitting\n",
+                          __func__);
         } else {
             /* Data byte transfer */
             if (i2c_send(s->bus, (uint8_t)data)) {
@@ -319,6 +376,8 @@ f2xx_i2c_reset(DeviceState *dev)
     memset(s->regs, 0, sizeof(s->regs));
     s->rx = 0;
     s->rx_full = 0;
+    s->rx_nacked = false;
+    s->rx_shift_full = false;
     qemu_set_irq(s->evt_irq, 0);
     qemu_set_irq(s->err_irq, 0);
 }
@@ -341,12 +400,28 @@ static const Property f2xx_i2c_properties[] = {
     DEFINE_PROP_INT32("periph", struct f2xx_i2c, periph, -1),
 };
 
+static const VMStateDescription vmstate_f2xx_i2c = {
+    .name = "f2xx_i2c",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_INT32(rx, f2xx_i2c),
+        VMSTATE_INT32(rx_full, f2xx_i2c),
+        VMSTATE_UINT16_ARRAY(regs, f2xx_i2c, R_I2C_MAX),
+        VMSTATE_BOOL(rx_nacked, f2xx_i2c),
+        VMSTATE_UINT8(rx_shift, f2xx_i2c),
+        VMSTATE_BOOL(rx_shift_full, f2xx_i2c),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void
 f2xx_i2c_class_init(ObjectClass *c, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(c);
 
     dc->realize = f2xx_i2c_realize;
+    dc->vmsd = &vmstate_f2xx_i2c;
     device_class_set_legacy_reset(dc, f2xx_i2c_reset);
     device_class_set_props(dc, f2xx_i2c_properties);
 }
@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "hw/sysbus.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 #include "qemu/timer.h"
 #include "qemu/log.h"
 #include "qapi/error.h"
@@ -163,11 +164,22 @@ f2xx_pwr_realize(DeviceState *dev, Error **errp)
     s->regs[R_PWR_CSR] = 0;
 }
 
+static const VMStateDescription vmstate_f2xx_pwr = {
+    .name = "f2xx_pwr",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, f2xx_pwr, R_PWR_MAX),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void
 f2xx_pwr_class_init(ObjectClass *klass, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = f2xx_pwr_realize;
+    dc->vmsd = &vmstate_f2xx_pwr;
     device_class_set_legacy_reset(dc, f2xx_pwr_reset);
 }
 
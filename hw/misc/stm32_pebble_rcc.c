@@ -24,6 +24,7 @@
 #include "hw/sysbus.h"
 #include "hw/arm/stm32_common.h"
 #include "hw/arm/stm32_clktree.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "qemu/timer.h"
 #include "qemu/log.h"
@@ -214,6 +215,9 @@ do { printf("STM32F2XX_RCC: " fmt , ## __VA_ARGS__); } while (0)
 #define RCC_APB1ENR_SPI3EN_BIT   15
 #define RCC_APB1ENR_SPI2EN_BIT   14
 #define RCC_APB1ENR_WWDGEN_BIT   11
+#define RCC_APB1ENR_TIM14EN_BIT  8
+#define RCC_APB1ENR_TIM13EN_BIT  7
+#define RCC_APB1ENR_TIM12EN_BIT  6
 #define RCC_APB1ENR_TIM7EN_BIT   5
 #define RCC_APB1ENR_TIM6EN_BIT   4
 #define RCC_APB1ENR_TIM5EN_BIT   3
@@ -356,7 +360,9 @@ typedef struct Stm32f2xxRcc {
 
     HCLK, /* Output from AHB Prescaler */
     PCLK1, /* Output from APB1 Prescaler */
-    PCLK2; /* Output from APB2 Prescaler */
+    PCLK2, /* Output from APB2 Prescaler */
+    TIMCLK1, /* APB1 timer clock: PCLK1, doubled when APB1 is divided */
+    TIMCLK2; /* APB2 timer clock: PCLK2, doubled when APB2 is divided */
 
     /* Register Values */
     uint32_t
@@ -391,6 +397,13 @@ typedef struct Stm32f2xxRcc {
     uint16_t
     RCC_PLLI2SCFGR_PLLN;
 
+    /* RCC_CR, RCC_BDCR and RCC_CSR are built from the clock states when read.
+     * These hold their values across a migration (see stm32_rcc_pre_save). */
+    uint32_t
+    vmstate_RCC_CR,
+    vmstate_RCC_BDCR,
+    vmstate_RCC_CSR;
+
 } Stm32f2xxRcc;
 
 #define TYPE_STM32F2XX_RCC "stm32f2xx_rcc"
@@ -625,16 +638,20 @@ static void stm32_rcc_RCC_CFGR_write(Stm32f2xxRcc *s, uint32_t new_value, bool i
     s->RCC_CFGR_PPRE2 = (new_value & RCC_CFGR_PPRE2_MASK) >> RCC_CFGR_PPRE2_START;
     if(s->RCC_CFGR_PPRE2 < 0x4) {
         clktree_set_scale(s->PCLK2, 1, 1);
+        clktree_set_scale(s->TIMCLK2, 1, 1);
     } else {
-        clktree_set_scale(s->PCLK2, 1, 2 * (s->RCC_CFGR_PPRE2 - 3));
+        clktree_set_scale(s->PCLK2, 1, 1 << (s->RCC_CFGR_PPRE2 - 3));
+        clktree_set_scale(s->TIMCLK2, 2, 1);
     }
 
     /* PPRE1 */
     s->RCC_CFGR_PPRE1 = (new_value & RCC_CFGR_PPRE1_MASK) >> RCC_CFGR_PPRE1_START;
     if(s->RCC_CFGR_PPRE1 < 4) {
         clktree_set_scale(s->PCLK1, 1, 1);
+        clktree_set_scale(s->TIMCLK1, 1, 1);
     } else {
-        clktree_set_scale(s->PCLK1, 1, 2 * (s->RCC_CFGR_PPRE1 - 3));
+        clktree_set_scale(s->PCLK1, 1, 1 << (s->RCC_CFGR_PPRE1 - 3));
+        clktree_set_scale(s->TIMCLK1, 2, 1);
     }
 
     /* HPRE */
@@ -770,6 +787,11 @@ static void stm32_rcc_RCC_APB2ENR_write(Stm32f2xxRcc *s, uint32_t new_value,
     stm32_rcc_periph_enable(s, new_value, init, STM32_SYSCFG, RCC_APB2ENR_SYSCFGEN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32_UART1, RCC_APB2ENR_USART1EN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32_UART6, RCC_APB2ENR_USART6EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM1, RCC_APB2ENR_TIM1EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM8, RCC_APB2ENR_TIM8EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM9, RCC_APB2ENR_TIM9EN);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM10, RCC_APB2ENR_TIM10EN);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM11, RCC_APB2ENR_TIM11EN);
 
     s->RCC_APB2ENR = new_value & RCC_APB2ENR_MASK;
 }
@@ -791,6 +813,15 @@ static void stm32_rcc_RCC_APB1ENR_write(Stm32f2xxRcc *s, uint32_t new_value,
                             RCC_APB1ENR_USART3EN_BIT);
     stm32_rcc_periph_enable(s, new_value, init, STM32_UART2,
                             RCC_APB1ENR_USART2EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM2, RCC_APB1ENR_TIM2EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM3, RCC_APB1ENR_TIM3EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM4, RCC_APB1ENR_TIM4EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM5, RCC_APB1ENR_TIM5EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM6, RCC_APB1ENR_TIM6EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM7, RCC_APB1ENR_TIM7EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM12, RCC_APB1ENR_TIM12EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM13, RCC_APB1ENR_TIM13EN_BIT);
+    stm32_rcc_periph_enable(s, new_value, init, STM32_TIM14, RCC_APB1ENR_TIM14EN_BIT);
 
     /* 0b00110110111111101100100111111111 */
     s->RCC_APB1ENR = new_value & 0x36fec9ff;
@@ -1112,6 +1143,12 @@ static void stm32_rcc_init_clk(Stm32f2xxRcc *s)
     // Clock source for APB2 peripherals:
     s->PCLK2 = clktree_create_clk("PCLK2", 0, 1, true, 60000000, 0, s->HCLK, NULL);
 
+    // Timer clocks, twice the APB clock when its prescaler divides
+    s->TIMCLK1 = clktree_create_clk("TIMCLK1", 1, 1, true, CLKTREE_NO_MAX_FREQ, 0,
+                                    s->PCLK1, NULL);
+    s->TIMCLK2 = clktree_create_clk("TIMCLK2", 1, 1, true, CLKTREE_NO_MAX_FREQ, 0,
+                                    s->PCLK2, NULL);
+
     /* Peripheral clocks */
     s->PERIPHCLK[STM32_GPIOA] =
         clktree_create_clk("GPIOA", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
@@ -1164,6 +1201,23 @@ static void stm32_rcc_init_clk(Stm32f2xxRcc *s)
     s->PERIPHCLK[STM32_UART8] =
         clktree_create_clk("UART8", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->PCLK1, NULL);
 
+    {
+        static const char *const tim_names[] = {
+            "TIM1", "TIM2", "TIM3", "TIM4", "TIM5", "TIM6", "TIM7",
+            "TIM8", "TIM9", "TIM10", "TIM11", "TIM12", "TIM13", "TIM14",
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(tim_names); i++) {
+            stm32_periph_t periph = STM32_TIM1 + i;
+            bool apb2 = periph == STM32_TIM1 || periph == STM32_TIM8
+                        || (periph >= STM32_TIM9 && periph <= STM32_TIM11);
+            s->PERIPHCLK[periph] =
+                clktree_create_clk(tim_names[i], 1, 1, false, CLKTREE_NO_MAX_FREQ, 0,
+                                   apb2 ? s->TIMCLK2 : s->TIMCLK1, NULL);
+        }
+    }
+
 
     s->PERIPHCLK[STM32_DCMI_PERIPH] =
         clktree_create_clk("DCMI", 1, 1, false, CLKTREE_NO_MAX_FREQ, 0, s->HCLK, NULL);
@@ -1225,11 +1279,92 @@ void stm32_rcc_check_periph_clk(Stm32Rcc *rcc, stm32_periph_t periph)
     }
 }
 
+void stm32_rcc_set_periph_clk_irq(Stm32Rcc *rcc, stm32_periph_t periph,
+                                  qemu_irq periph_irq)
+{
+    Stm32f2xxRcc *s = (Stm32f2xxRcc *)rcc;
+
+    if (s == NULL || periph >= STM32_PERIPH_COUNT || s->PERIPHCLK[periph] == NULL) {
+        return;
+    }
+    clktree_adduser(s->PERIPHCLK[periph], periph_irq);
+}
+
+uint32_t stm32_rcc_get_periph_freq(Stm32Rcc *rcc, stm32_periph_t periph)
+{
+    Stm32f2xxRcc *s = (Stm32f2xxRcc *)rcc;
+
+    if (s == NULL || periph >= STM32_PERIPH_COUNT || s->PERIPHCLK[periph] == NULL) {
+        return 0;
+    }
+    return clktree_get_output_freq(s->PERIPHCLK[periph]);
+}
+
+static int stm32_rcc_pre_save(void *opaque)
+{
+    Stm32f2xxRcc *s = (Stm32f2xxRcc *)opaque;
+
+    s->vmstate_RCC_CR = stm32_rcc_RCC_CR_read(s);
+    s->vmstate_RCC_BDCR = stm32_rcc_RCC_BDCR_read(s);
+    s->vmstate_RCC_CSR = stm32_rcc_RCC_CSR_read(s);
+    return 0;
+}
+
+/* The clock tree is not migrated directly. Replay the register values through
+ * the write handlers instead, oscillators first, so that every Clk ends up with
+ * the same enable state, scale and selected input as on the source. */
+static int stm32_rcc_post_load(void *opaque, int version_id)
+{
+    Stm32f2xxRcc *s = (Stm32f2xxRcc *)opaque;
+
+    stm32_rcc_RCC_CSR_write(s, s->vmstate_RCC_CSR, true);
+    stm32_rcc_RCC_BDCR_write(s, s->vmstate_RCC_BDCR, true);
+    stm32_rcc_RCC_CR_write(s, s->vmstate_RCC_CR, true);
+    stm32_rcc_RCC_PLLCFGR_write(s, s->RCC_PLLCFGR, true);
+    if (s->RCC_PLLI2SCFGR) {
+        stm32_rcc_RCC_PLLI2SCFGR_write(s, s->RCC_PLLI2SCFGR, true);
+    }
+    stm32_rcc_RCC_CFGR_write(s, stm32_rcc_RCC_CFGR_read(s), true);
+    stm32_rcc_RCC_AHB1ENR_write(s, s->RCC_AHB1ENR, true);
+    stm32_rcc_RCC_AHB2ENR_write(s, s->RCC_AHB2ENR, true);
+    stm32_rcc_RCC_AHB3ENR_write(s, s->RCC_AHB3ENR, true);
+    stm32_rcc_RCC_APB1ENR_write(s, s->RCC_APB1ENR, true);
+    stm32_rcc_RCC_APB2ENR_write(s, s->RCC_APB2ENR, true);
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_rcc = {
+    .name = TYPE_STM32F2XX_RCC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = stm32_rcc_pre_save,
+    .post_load = stm32_rcc_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(RCC_CIR, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_APB1ENR, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_APB2ENR, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_PPRE1, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_PPRE2, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_HPRE, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_AHB1ENR, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_AHB2ENR, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_AHB3ENR, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_CFGR_SW, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_PLLCFGR, Stm32f2xxRcc),
+        VMSTATE_UINT32(RCC_PLLI2SCFGR, Stm32f2xxRcc),
+        VMSTATE_UINT32(vmstate_RCC_CR, Stm32f2xxRcc),
+        VMSTATE_UINT32(vmstate_RCC_BDCR, Stm32f2xxRcc),
+        VMSTATE_UINT32(vmstate_RCC_CSR, Stm32f2xxRcc),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void stm32_rcc_class_init(ObjectClass *klass, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = stm32_rcc_realize;
+    dc->vmsd = &vmstate_stm32_rcc;
     device_class_set_legacy_reset(dc, stm32_rcc_reset);
     device_class_set_props(dc, stm32_rcc_properties);
 }
@@ -22,6 +22,7 @@
 #include "qemu/osdep.h"
 #include "hw/sysbus.h"
 #include "hw/arm/stm32_common.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "qemu/log.h"
 
@@ -270,11 +271,49 @@ static const Property stm32_syscfg_properties[] = {
     DEFINE_PROP_BIT("boot1", Stm32Syscfg, boot_pins, 1, 0), /* BOOT1 pin */
 };
 
+/* EXTI line routing lives in the GPIO devices and is not migrated. The machine
+ * is reset before an incoming state is loaded, which routes every line to
+ * GPIOA, so move each line over to the port selected in the loaded EXTICRs. */
+static int stm32_syscfg_post_load(void *opaque, int version_id)
+{
+    Stm32Syscfg *s = (Stm32Syscfg *)opaque;
+    unsigned index, i;
+
+    for (index = 0; index < SYSCFG_EXTICR_COUNT; index++) {
+        for (i = 0; i < SYSCFG_EXTI_PER_CR; i++) {
+            unsigned exti_line = (index * SYSCFG_EXTI_PER_CR) + i;
+            unsigned gpio_index = (s->SYSCFG_EXTICR[index] >> (i * 4)) & 0xf;
+
+            if (gpio_index != 0) {
+                stm32_exti_reset_gpio(s->stm32_exti, exti_line, 0);
+                stm32_exti_set_gpio(s->stm32_exti, exti_line, gpio_index);
+            }
+        }
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_stm32_syscfg = {
+    .name = TYPE_STM32F2XX_SYSCFG,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = stm32_syscfg_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(USART1_REMAP, Stm32Syscfg),
+        VMSTATE_UINT32(USART2_REMAP, Stm32Syscfg),
+        VMSTATE_UINT32(USART3_REMAP, Stm32Syscfg),
+        VMSTATE_UINT32(SYSCFG_MEMRMP, Stm32Syscfg),
+        VMSTATE_UINT32_ARRAY(SYSCFG_EXTICR, Stm32Syscfg, SYSCFG_EXTICR_COUNT),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void stm32_syscfg_class_init(ObjectClass *klass, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = stm32_syscfg_realize;
+    dc->vmsd = &vmstate_stm32_syscfg;
     device_class_set_legacy_reset(dc, stm32_syscfg_reset);
     device_class_set_props(dc, stm32_syscfg_properties);
 }
@@ -30,6 +30,7 @@
 #include "hw/qdev-properties.h"
 #include "hw/arm/stm32_common.h"
 #include "hw/ssi/ssi.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
 #include "qapi/error.h"
 
@@ -181,6 +182,58 @@ stm32f2xx_spi_write(void *arg, hwaddr addr, uint64_t data, unsigned size)
     }
 }
 
+/* The peripheral a burst can go to: the only device on the bus, selected,
+ * and implementing the bulk interface. */
+static DeviceState *
+stm32f2xx_spi_bulk_target(Stm32Spi *s)
+{
+    BusChild *kid = QTAILQ_FIRST(&BUS(s->spi)->children);
+    SSIPeripheral *dev;
+    SSIPeripheralClass *ssc;
+
+    if (!kid || QTAILQ_NEXT(kid, sibling) ||
+        !object_dynamic_cast(OBJECT(kid->child), TYPE_STM32_SPI_BULK)) {
+        return NULL;
+    }
+    dev = SSI_PERIPHERAL(kid->child);
+    ssc = SSI_PERIPHERAL_GET_CLASS(dev);
+    if ((ssc->cs_polarity == SSI_CS_LOW && dev->cs) ||
+        (ssc->cs_polarity == SSI_CS_HIGH && !dev->cs)) {
+        return NULL;
+    }
+    return kid->child;
+}
+
+void
+stm32f2xx_spi_write_bulk(DeviceState *dev, const uint8_t *buf, uint32_t len)
+{
+    Stm32Spi *s = (Stm32Spi *)dev;
+    DeviceState *target = NULL;
+    uint32_t done = 0;
+
+    if (!(s->regs[R_CR1] & (R_CR1_LSBFIRST | R_CR1_DFF))) {
+        target = stm32f2xx_spi_bulk_target(s);
+    }
+    if (target) {
+        done = STM32_SPI_BULK_GET_CLASS(target)->transfer_bulk(target, buf, len);
+    }
+    if (done) {
+        /* Same end state as done writes to DR: the last reply is in DR and
+         * every byte after the first overran the unread one before it. */
+        if ((s->regs[R_SR] & R_SR_RXNE) || done > 1) {
+            s->regs[R_SR] |= R_SR_OVR;
+        }
+        s->regs[R_DR] = 0;
+        s->regs[R_SR] |= R_SR_RXNE | R_SR_TXE;
+        stm32f2xx_spi_update_irq(s);
+    }
+
+    /* Whatever the peripheral did not take goes through the register path */
+    for (; done < len; done++) {
+        stm32f2xx_spi_write(s, R_DR << 2, buf[done], 1);
+    }
+}
+
 static const MemoryRegionOps stm32f2xx_spi_ops = {
     .read = stm32f2xx_spi_read,
     .write = stm32f2xx_spi_write,
@@ -219,27 +272,47 @@ static const Property stm32f2xx_spi_properties[] = {
     DEFINE_PROP_INT32("periph", Stm32Spi, periph, -1),
 };
 
+static const VMStateDescription vmstate_stm32f2xx_spi = {
+    .name = "stm32f2xx_spi",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_INT32(rx, Stm32Spi),
+        VMSTATE_INT32(rx_full, Stm32Spi),
+        VMSTATE_UINT16_ARRAY(regs, Stm32Spi, R_MAX),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void
 stm32f2xx_spi_class_init(ObjectClass *c, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(c);
 
     dc->realize = stm32f2xx_spi_realize;
+    dc->vmsd = &vmstate_stm32f2xx_spi;
     device_class_set_legacy_reset(dc, stm32f2xx_spi_reset);
     device_class_set_props(dc, stm32f2xx_spi_properties);
 }
 
 static const TypeInfo stm32f2xx_spi_info = {
-    .name = "stm32f2xx_spi",
+    .name = TYPE_STM32F2XX_SPI,
     .parent = TYPE_SYS_BUS_DEVICE,
     .instance_size = sizeof(struct stm32f2xx_spi_s),
     .class_init = stm32f2xx_spi_class_init
 };
 
+static const TypeInfo stm32_spi_bulk_info = {
+    .name = TYPE_STM32_SPI_BULK,
+    .parent = TYPE_INTERFACE,
+    .class_size = sizeof(Stm32SpiBulkClass),
+};
+
 static void
 stm32f2xx_spi_register_types(void)
 {
     type_register_static(&stm32f2xx_spi_info);
+    type_register_static(&stm32_spi_bulk_info);
 }
 
 type_init(stm32f2xx_spi_register_types)
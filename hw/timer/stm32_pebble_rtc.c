@@ -22,17 +22,27 @@
 /*
  * QEMU stm32f2xx RTC emulation
  * Ported to QEMU 10.x APIs.
+ *
+ * The calendar runs on QEMU's RTC clock (-rtc clock=host|rt|vm, host by
+ * default) and starts from the -rtc base date. With clock=vm it advances
+ * with QEMU_CLOCK_VIRTUAL, so under -icount the guest's seconds follow its
+ * instruction stream and a run is reproducible from any starting date.
+ *
+ * TR and DR are not ticked. They are computed from the clock when read, and
+ * the alarm timer is armed directly for the next ALRMAR/ALRMBR match, so an
+ * idle watch with no alarm enabled costs no host wakeups at all.
  */
 #include "qemu/osdep.h"
-#include <sys/time.h>
 #include "hw/sysbus.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "qemu/bcd.h"
 #include "qemu/cutils.h"
 #include "system/rtc.h"
+#include "system/system.h"
 #include "qemu/timer.h"
 #include "hw/arm/stm32_common.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
 #include "qapi/error.h"
 
@@ -64,6 +74,7 @@
 #define R_RTC_ISR_RESET 0x00000007
 #define R_RTC_ISR_RSF   0x00000020
 #define R_RTC_ISR_WUT   0x00000400
+#define R_RTC_ISR_FLAGS 0x00007f00  /* ALRAF..TAMP2F, rc_w0 */
 
 #define R_RTC_PRER   (0x10 / 4)
 #define R_RTC_PRER_PREDIV_A_MASK 0x7f
@@ -90,6 +101,10 @@
 
 #define DEBUG_ALARM(x...)
 
+// How far ahead to look for an alarm match. A date alarm for the 31st can be two
+// months away; one that can never match (e.g. the 32nd) gives up after a year.
+#define F2XX_RTC_ALARM_SEARCH_DAYS 366
+
 typedef struct f2xx_rtc {
     SysBusDevice  parent_obj;
     MemoryRegion  iomem;
@@ -98,11 +113,17 @@ typedef struct f2xx_rtc {
     qemu_irq      irq[2];
     qemu_irq      wut_irq;
 
-    // target_us = host_us + host_to_target_offset_us
+    // target_us = host_us + host_to_target_offset_us, where host_us is the RTC clock
+    // (rtc_clock) in microseconds
     int64_t       host_to_target_offset_us;
 
-    // target time in ticks (seconds according to the RTC registers)
-    time_t        ticks;
+    // target time in ticks (seconds according to the RTC registers) when TR/DR were
+    // last brought up to date; alarms are checked from here onwards
+    int64_t       ticks;
+
+    // next tick at which each alarm matches, after ticks as of when the alarm or the
+    // calendar was last set, or -1 if it never does. Reads only compare against it.
+    int64_t       alarm_next[2];
 
     uint32_t      regs[R_RTC_MAX];
     int           wp_count; /* Number of correct writes to WP reg */
@@ -110,7 +131,10 @@ typedef struct f2xx_rtc {
 
 
 // Update target date and time from the host
-static void f2xx_update_current_date_and_time(void *arg);
+static void f2xx_rtc_sync(f2xx_rtc *s);
+static void f2xx_alarm_schedule(f2xx_rtc *s);
+static void f2xx_alarm_update_irq(f2xx_rtc *s, int unit);
+static void f2xx_alarm_update_next(f2xx_rtc *s);
 
 
 // Compute the period for the clock (seconds increments) in nanoseconds
@@ -163,13 +187,21 @@ f2xx_wut_period_ns(f2xx_rtc *s, uint32_t counter)
 }
 
 
+// Current time of the clock the calendar runs on, in microseconds
+static int64_t
+f2xx_rtc_clock_us(void)
+{
+    return qemu_clock_get_ns(rtc_clock) / 1000;
+}
+
+
 // Set the time and registers based on the content of the passed in tm struct
 static void
 f2xx_rtc_set_time_and_date_registers(f2xx_rtc *s, struct tm *tm)
 {
     uint8_t wday;
 
-    wday = tm->tm_wday == 0 ? tm->tm_wday : 7;
+    wday = tm->tm_wday == 0 ? 7 : tm->tm_wday;
     s->regs[R_RTC_TR] = to_bcd(tm->tm_sec) |
                         to_bcd(tm->tm_min) << 8 |
                         to_bcd(tm->tm_hour) << 16;
@@ -180,6 +212,27 @@ f2xx_rtc_set_time_and_date_registers(f2xx_rtc *s, struct tm *tm)
 }
 
 
+// Apply local timezone offset if provided via environment (e.g. from browser JS).
+// TZ_OFFSET_SEC is seconds east of UTC (e.g. -28800 for PST). It only applies
+// when following the host's wall clock; other clocks start from the -rtc base,
+// which is already the time the watch should show.
+static int64_t
+f2xx_rtc_tz_offset_us(void)
+{
+    static int64_t tz_offset_us = 0;
+    static int tz_checked = 0;
+
+    if (!tz_checked && rtc_clock == QEMU_CLOCK_HOST) {
+        const char *tz_str = getenv("TZ_OFFSET_SEC");
+        if (tz_str) {
+            tz_offset_us = (int64_t)atoi(tz_str) * 1000000LL;
+        }
+        tz_checked = 1;
+    }
+    return tz_offset_us;
+}
+
+
 // Compute what time we want in the target based on the host's current date and time.
 // This takes into consideration the host_to_target_offset_us we have computed and captured
 // previously.
@@ -192,24 +245,11 @@ f2xx_rtc_compute_target_time_from_host_time(f2xx_rtc *s, uint64_t rtc_period_ns,
                                             struct tm *target_tm)
 {
     // Get the host time in microseconds
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    int64_t host_time_us = tv.tv_sec * 1000000LL + (tv.tv_usec);
-
-    // Apply local timezone offset if provided via environment (e.g. from browser JS).
-    // TZ_OFFSET_SEC is seconds east of UTC (e.g. -28800 for PST).
-    static int64_t tz_offset_us = 0;
-    static int tz_checked = 0;
-    if (!tz_checked) {
-        const char *tz_str = getenv("TZ_OFFSET_SEC");
-        if (tz_str) {
-            tz_offset_us = (int64_t)atoi(tz_str) * 1000000LL;
-        }
-        tz_checked = 1;
-    }
+    int64_t host_time_us = f2xx_rtc_clock_us();
 
     // Compute the target time by adding the offset
-    int64_t target_time_us = host_time_us + s->host_to_target_offset_us + tz_offset_us;
+    int64_t target_time_us = host_time_us + s->host_to_target_offset_us +
+                             f2xx_rtc_tz_offset_us();
 
     // Convert to target ticks according period set in the RTC
     time_t target_time_ticks = (target_time_us * 1000) / rtc_period_ns;
@@ -265,9 +305,7 @@ f2xx_rtc_compute_host_to_target_offset(f2xx_rtc *s, int64_t period_ns, time_t ta
     int64_t target_time_us = target_ticks * period_ns / 1000;
 
     // Get the host time in microseconds
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    int64_t host_time_us = tv.tv_sec * 1000000LL + (tv.tv_usec);
+    int64_t host_time_us = f2xx_rtc_clock_us();
 
     // Get the host to target offset in micro seconds
     return target_time_us - host_time_us;
@@ -289,9 +327,10 @@ f2xx_rtc_read(void *arg, hwaddr addr, unsigned int size)
         return 0;
     }
 
-    // If reading the time or date register, make sure they are brought up to date first
-    if (addr == R_RTC_TR || addr == R_RTC_DR) {
-        f2xx_update_current_date_and_time(s);
+    // If reading the time or date register (or the alarm flags), make sure they are
+    // brought up to date first
+    if (addr == R_RTC_TR || addr == R_RTC_DR || addr == R_RTC_ISR) {
+        f2xx_rtc_sync(s);
     }
 
     uint32_t value = s->regs[addr];
@@ -317,9 +356,7 @@ f2xx_rtc_read(void *arg, hwaddr addr, unsigned int size)
         uint64_t full_cycle_us = f2xx_clock_period_ns(s) / 1000;
 
         // What fraction of a full cycle are we in?
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        int64_t host_time_us = tv.tv_sec * 1000000LL + (tv.tv_usec);
+        int64_t host_time_us = f2xx_rtc_clock_us();
         host_time_us += s->host_to_target_offset_us;
 
         int64_t host_mod = host_time_us % full_cycle_us;
@@ -356,6 +393,8 @@ f2xx_rtc_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
     int offset = addr & 0x3;
     bool    compute_new_target_offset = false;
     bool    update_wut = false;
+    bool    update_alarms = false;
+    bool    update_alarm_next = false;
 
     DPRINTF("%s: addr: 0x%llx, data: 0x%llx, size: %d\n", __func__, addr, data, size);
 
@@ -405,20 +444,33 @@ f2xx_rtc_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
                       (unsigned int)addr << 2, offset);
         return;
     }
+    // Raise any alarm that matched under the old settings before changing them
+    if (addr == R_RTC_TR || addr == R_RTC_DR || addr == R_RTC_CR || addr == R_RTC_ISR
+            || addr == R_RTC_PRER || addr == R_RTC_ALRMAR || addr == R_RTC_ALRMBR) {
+        f2xx_rtc_sync(s);
+        update_alarms = true;
+    }
     switch(addr) {
     case R_RTC_TR:
     case R_RTC_DR:
         compute_new_target_offset = true;
+        update_alarm_next = true;
         break;
     case R_RTC_CR:
         if ((data & R_RTC_CR_WUTE) != (s->regs[R_RTC_CR] & R_RTC_CR_WUTE)) {
             update_wut = true;
         }
+        // Enabling an alarm or changing the hour format moves its next match
+        if ((data ^ s->regs[R_RTC_CR]) & (3 << R_RTC_CR_ALRAE_BIT | R_RTC_CR_FMT_MASK)) {
+            update_alarm_next = true;
+        }
         break;
     case R_RTC_ISR:
-        if ((data & 1<<8) == 0 && (s->regs[R_RTC_ISR] & 1<<8) != 0) {
-            DPRINTF("f2xx rtc isr lowered\n");
-            qemu_irq_lower(s->irq[0]);
+        // The event flags can only be cleared
+        data = (data & ~R_RTC_ISR_FLAGS) | (data & s->regs[R_RTC_ISR] & R_RTC_ISR_FLAGS);
+        // Clearing ALRAF/ALRBF re-arms that alarm from the current second
+        if (s->regs[R_RTC_ISR] & ~data & (3 << 8)) {
+            update_alarm_next = true;
         }
         if ((data & 1<<10) == 0 && (s->regs[R_RTC_ISR] & 1<<10) != 0) {
             DPRINTF("f2xx rtc WUT isr lowered\n");
@@ -431,12 +483,14 @@ f2xx_rtc_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
          * would need to account for the time already elapsed, and then update
          * the timer for the remaining period.
          */
+        update_alarm_next = true;
         break;
     case R_RTC_WUTR:
         update_wut = true;
         break;
     case R_RTC_ALRMAR:
     case R_RTC_ALRMBR:
+        update_alarm_next = true;
         break;
     case R_RTC_TAFCR:
         if (data) {
@@ -460,6 +514,18 @@ f2xx_rtc_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
         // Update the host to target offset as well
         s->host_to_target_offset_us = f2xx_rtc_compute_host_to_target_offset(s,
         								f2xx_clock_period_ns(s), s->ticks);
+        // The new time is where alarms are checked from
+        s->ticks = f2xx_rtc_compute_target_time_from_host_time(s, f2xx_clock_period_ns(s),
+                                                               &target_tm);
+    }
+
+    if (update_alarm_next) {
+        f2xx_alarm_update_next(s);
+    }
+    if (update_alarms) {
+        f2xx_alarm_update_irq(s, 0);
+        f2xx_alarm_update_irq(s, 1);
+        f2xx_alarm_schedule(s);
     }
 
     // Do we need to update the timer for the wake-up-timer?
@@ -467,7 +533,7 @@ f2xx_rtc_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
         if (s->regs[R_RTC_CR] & R_RTC_CR_WUTE) {
             int64_t elapsed = f2xx_wut_period_ns(s, s->regs[R_RTC_WUTR]);
             DPRINTF("%s: scheduling WUT to fire in %f ms\n", __func__, (float)elapsed/1000000.0);
-            timer_mod(s->wu_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + elapsed);
+            timer_mod(s->wu_timer, qemu_clock_get_ns(rtc_clock) + elapsed);
         } else {
             DPRINTF("%s: Cancelling WUT\n", __func__);
             qemu_set_irq(s->wut_irq, 0);
@@ -477,103 +543,192 @@ f2xx_rtc_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
 }
 
 
+// Day (of month, or of week with WDSEL) match for the day described by tm
 static bool
-f2xx_alarm_match(f2xx_rtc *s, uint32_t alarm_reg)
+f2xx_alarm_day_match(uint32_t alarm_reg, const struct tm *tm)
+{
+    if (alarm_reg & (1u<<31)) {
+        return true; /* Day masked. */
+    }
+    if (alarm_reg & (1<<30)) { /* Day is week day, 1 = Monday .. 7 = Sunday. */
+        return ((alarm_reg>>24) & 0xf) == (tm->tm_wday == 0 ? 7 : tm->tm_wday);
+    }
+    return from_bcd((alarm_reg>>24) & 0x3f) == tm->tm_mday;
+}
+
+// Return the first second of the day, at or after 'from' (seconds since midnight),
+// that matches the hour, minute and second fields of the alarm, or -1 if none does.
+static int
+f2xx_alarm_match_in_day(f2xx_rtc *s, uint32_t alarm_reg, int from)
 {
-    uint32_t tr = s->regs[R_RTC_TR];
+    int from_h = from / 3600, from_m = (from / 60) % 60, from_s = from % 60;
+    int alarm_h = -1, alarm_m = -1, alarm_s = -1;
+    int h, m;
 
-    if ((alarm_reg & (1<<7)) == 0 && (tr & 0x7f) != (alarm_reg & 0x7f)) {
-        /* Seconds match requested, but do not match. */
-        return false;
+    if ((alarm_reg & (1<<7)) == 0) {
+        alarm_s = from_bcd(alarm_reg & 0x7f);
     }
-    if ((alarm_reg & (1<<15)) == 0 && (tr & 0x7f00) != (alarm_reg & 0x7f00)) {
-        /* Minutes match requested, but do not match. */
-        return false;
+    if ((alarm_reg & (1<<15)) == 0) {
+        alarm_m = from_bcd((alarm_reg>>8) & 0x7f);
     }
-    if ((alarm_reg & (1<<23)) == 0 && (tr & 0x7f0000) != (alarm_reg & 0x7f0000)) {
-        /* Hours match requested, but do not match. */
-        return false;
+    if ((alarm_reg & (1<<23)) == 0) {
+        alarm_h = from_bcd((alarm_reg>>16) & 0x3f);
+        if (s->regs[R_RTC_CR] & R_RTC_CR_FMT_MASK) {
+            alarm_h = alarm_h % 12 + ((alarm_reg & (1<<22)) ? 12 : 0);
+        }
     }
-    if ((alarm_reg & (1<<31)) == 0) { /* Day match. */
-        uint32_t dr = s->regs[R_RTC_DR];
-        if (alarm_reg & (1<<30)) { /* Day is week day. */
-            if (((alarm_reg>>24) & 0xf) != ((dr>>13) & 0xf)) {
-                return false;
+
+    for (h = from_h; h < 24; h++) {
+        if (alarm_h >= 0 && h != alarm_h) {
+            continue;
+        }
+        for (m = (h == from_h) ? from_m : 0; m < 60; m++) {
+            int first_s = (h == from_h && m == from_m) ? from_s : 0;
+
+            if (alarm_m >= 0 && m != alarm_m) {
+                continue;
+            }
+            if (alarm_s < 0) {
+                return h * 3600 + m * 60 + first_s;
             }
-        } else { /* Day is day of month. */
-            if (((alarm_reg>>24) & 0x3f) != (dr & 0x3f)) {
-                return false;
+            if (alarm_s >= first_s && alarm_s < 60) {
+                return h * 3600 + m * 60 + alarm_s;
             }
         }
     }
-    return true;
+    return -1;
 }
 
-static void
-f2xx_alarm_check(f2xx_rtc *s, int unit)
+// Return the first tick after 'after' at which the alarm matches, or -1 if there is
+// none within F2XX_RTC_ALARM_SEARCH_DAYS.
+static time_t
+f2xx_alarm_next_match(f2xx_rtc *s, uint32_t alarm_reg, time_t after)
 {
-    uint32_t cr = s->regs[R_RTC_CR];
-    uint32_t isr = s->regs[R_RTC_ISR];
+    time_t from = after + 1;
+    time_t day = from - from % 86400;
+    int d;
 
-    if ((cr & 1<<(R_RTC_CR_ALRAE_BIT + unit)) == 0) {
-        return; /* Not enabled. */
-    }
+    for (d = 0; d < F2XX_RTC_ALARM_SEARCH_DAYS; d++, day += 86400) {
+        struct tm day_tm;
+        int sec;
 
-    if ((isr & 1<<(R_RTC_CR_ALRAE_BIT + unit)) == 0) {
-        if (f2xx_alarm_match(s, s->regs[R_RTC_ALRMAR + unit])) {
-            isr |= 1<<(8 + unit);
-            s->regs[R_RTC_ISR] = isr;
-            DPRINTF("f2xx rtc alarm activated 0x%x 0x%x\n", isr, cr);
+        gmtime_r(&day, &day_tm);
+        if (!f2xx_alarm_day_match(alarm_reg, &day_tm)) {
+            continue;
+        }
+        sec = f2xx_alarm_match_in_day(s, alarm_reg, d == 0 ? from - day : 0);
+        if (sec >= 0) {
+            return day + sec;
         }
     }
-	qemu_set_irq(s->irq[unit], cr & 1<<(12 + unit) && isr & 1<<(8 + unit));
+    return -1;
+}
+
+// Is the alarm enabled and waiting for its next match?
+static bool
+f2xx_alarm_armed(f2xx_rtc *s, int unit)
+{
+    return (s->regs[R_RTC_CR] & 1<<(R_RTC_CR_ALRAE_BIT + unit)) != 0 &&
+           (s->regs[R_RTC_ISR] & 1<<(8 + unit)) == 0;
+}
+
+static void
+f2xx_alarm_update_irq(f2xx_rtc *s, int unit)
+{
+    qemu_set_irq(s->irq[unit], (s->regs[R_RTC_CR] & 1<<(12 + unit)) &&
+                               (s->regs[R_RTC_ISR] & 1<<(8 + unit)));
 }
 
 // This method updates the current time and date registers to match the current
 // host time. While it advances the target time, it checks for alarms that need to fire.
 static void
-f2xx_update_current_date_and_time(void *arg)
+f2xx_rtc_sync(f2xx_rtc *s)
 {
-    f2xx_rtc *s = arg;
-    uint64_t period_ns = f2xx_clock_period_ns(s);
-
     struct tm new_target_tm;
     time_t new_target_ticks = f2xx_rtc_compute_target_time_from_host_time(s,
-                                  period_ns, &new_target_tm);
-
-
-    // Normally, we would advance the target ticks until we catch up to the host ticks and
-    // check for an alarm at each tick. But, if the clocks got too far off (host or target
-    // changed time), just jam in the new target time without checking alarms
-    int delta = new_target_ticks - s->ticks;
-    //DPRINTF("%s: advancing target by %d ticks\n", __func__, delta);
-    if (delta < 0 || delta > 1000) {
-        printf("DEBUG_STM32F2XX_RTC %s: detected %d mismatch between host and target ticks, "
-              "jamming new host time into RTC without checking for alarms\n", __func__, delta);
-        s->ticks = new_target_ticks;
-        f2xx_rtc_set_time_and_date_registers(s, &new_target_tm);
-    } else {
-        while (s->ticks != new_target_ticks) {
-            s->ticks += 1;
-            gmtime_r(&s->ticks, &new_target_tm);
-            f2xx_rtc_set_time_and_date_registers(s, &new_target_tm);
+                                  f2xx_clock_period_ns(s), &new_target_tm);
+    bool backwards;
+    int unit;
+
+    // A match anywhere between the last sync and now raises the alarm, however
+    // far the clock has moved. If the clock went backwards, just jam in the new time
+    // and look for the next matches from there.
+    if (new_target_ticks > s->ticks) {
+        for (unit = 0; unit < 2; unit++) {
+            int64_t match = s->alarm_next[unit];
+
+            if (!f2xx_alarm_armed(s, unit)) {
+                continue;
+            }
+            if (match >= 0 && match <= new_target_ticks) {
+                s->regs[R_RTC_ISR] |= 1<<(8 + unit);
+                DPRINTF("f2xx rtc alarm activated 0x%x 0x%x\n", s->regs[R_RTC_ISR],
+                        s->regs[R_RTC_CR]);
+            }
+            f2xx_alarm_update_irq(s, unit);
+        }
+    }
+    backwards = new_target_ticks < s->ticks;
+    s->ticks = new_target_ticks;
+    if (backwards) {
+        f2xx_alarm_update_next(s);
+    }
+    f2xx_rtc_set_time_and_date_registers(s, &new_target_tm);
+}
+
+// Search for each alarm's next match after the current tick. Only done when the
+// alarm, its enable or flag, or the calendar is written, never on register reads.
+static void
+f2xx_alarm_update_next(f2xx_rtc *s)
+{
+    int unit;
 
-            f2xx_alarm_check(s, 0);
-            f2xx_alarm_check(s, 1);
+    for (unit = 0; unit < 2; unit++) {
+        s->alarm_next[unit] = f2xx_alarm_next_match(s, s->regs[R_RTC_ALRMAR + unit],
+                                                    s->ticks);
+    }
+}
+
+// Arm the alarm timer for the earliest upcoming ALRMAR/ALRMBR match. Nothing runs
+// while neither alarm is armed.
+static void
+f2xx_alarm_schedule(f2xx_rtc *s)
+{
+    time_t next = -1;
+    int unit;
+
+    for (unit = 0; unit < 2; unit++) {
+        int64_t match = s->alarm_next[unit];
+
+        if (!f2xx_alarm_armed(s, unit)) {
+            continue;
+        }
+        if (match >= 0 && (next < 0 || match < next)) {
+            next = match;
         }
     }
+    if (next < 0) {
+        timer_del(s->timer);
+        return;
+    }
 
-    // Reschedule tick timer to run one tick from now to check for alarms again
-    timer_mod(s->timer, qemu_clock_get_ns(QEMU_CLOCK_HOST) + period_ns);
+    // Invert f2xx_rtc_compute_target_time_from_host_time(), rounding up to the
+    // microsecond so the tick has been reached when the timer runs
+    int64_t target_ns = (int64_t)next * f2xx_clock_period_ns(s);
+    int64_t host_ns = target_ns -
+                      (s->host_to_target_offset_us + f2xx_rtc_tz_offset_us()) * 1000;
+    timer_mod(s->timer, host_ns > 0 ? DIV_ROUND_UP(host_ns, 1000) * 1000 : 0);
 }
 
 
-// This timer runs on every tick (usually second)
+// This timer fires at the next alarm match
 static void
 f2xx_timer(void *arg)
 {
     f2xx_rtc *s = arg;
-    f2xx_update_current_date_and_time(s);
+
+    f2xx_rtc_sync(s);
+    f2xx_alarm_schedule(s);
 }
 
 
@@ -605,7 +760,7 @@ f2xx_wu_timer(void *arg)
 
     // Reschedule again
     int64_t elapsed = f2xx_wut_period_ns(s, s->regs[R_RTC_WUTR]);
-    timer_mod(s->wu_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + elapsed);
+    timer_mod(s->wu_timer, qemu_clock_get_ns(rtc_clock) + elapsed);
 }
 
 
@@ -620,6 +775,14 @@ void f2xx_rtc_set_extra_bkup_reg(void *opaque, uint32_t idx, uint32_t value)
     s->regs[R_RTC_BKPxR_LAST + 1 + idx] = value;
 }
 
+uint32_t f2xx_rtc_get_extra_bkup_reg(void *opaque, uint32_t idx)
+{
+    f2xx_rtc *s = (f2xx_rtc *)opaque;
+
+    assert(idx < STM32F2XX_RTC_NUM_EXTRA_BKUP_REG);
+    return s->regs[R_RTC_BKPxR_LAST + 1 + idx];
+}
+
 
 
 static const MemoryRegionOps f2xx_rtc_ops = {
@@ -655,8 +818,7 @@ f2xx_rtc_realize(DeviceState *dev, Error **errp)
     s->regs[R_RTC_PRER] = R_RTC_PRER_RESET;
     s->regs[R_RTC_WUTR] = R_RTC_WUTR_RESET;
 
-    uint32_t period_ns = f2xx_clock_period_ns(s);
-    DPRINTF("%s: period: %d ns\n", __func__, period_ns);
+    DPRINTF("%s: period: %d ns\n", __func__, (int)f2xx_clock_period_ns(s));
 
     // Init the time and date registers from the time on the host as the default
     s->host_to_target_offset_us = 0;
@@ -670,18 +832,51 @@ f2xx_rtc_realize(DeviceState *dev, Error **errp)
     s->ticks = mktimegm(&now);
     s->host_to_target_offset_us = f2xx_rtc_compute_host_to_target_offset(s,
                                         f2xx_clock_period_ns(s), s->ticks);
+    f2xx_alarm_update_next(s);
+
+    // Nothing to wait for until the guest enables an alarm
+    s->timer = timer_new_ns(rtc_clock, f2xx_timer, s);
 
-    s->timer = timer_new_ns(QEMU_CLOCK_HOST, f2xx_timer, s);
-    timer_mod(s->timer, qemu_clock_get_ns(QEMU_CLOCK_HOST) + period_ns);
+    s->wu_timer = timer_new_ns(rtc_clock, f2xx_wu_timer, s);
+}
+
+// The target clock is derived from the RTC clock through the migrated offset, which
+// also fixes the sub-second phase. The tick alarms were last checked at and the
+// wakeup timer deadline are migrated, so under clock=vm both the alarms and the
+// WUT interrupt fire at the same virtual time as in the saved run.
+static int
+f2xx_rtc_post_load(void *opaque, int version_id)
+{
+    f2xx_rtc *s = opaque;
 
-    s->wu_timer = timer_new_ns(QEMU_CLOCK_REALTIME, f2xx_wu_timer, s);
+    // Raise anything that matched between the save and now
+    f2xx_alarm_update_next(s);
+    f2xx_rtc_sync(s);
+    f2xx_alarm_schedule(s);
+    return 0;
 }
 
+static const VMStateDescription vmstate_f2xx_rtc = {
+    .name = "f2xx_rtc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = f2xx_rtc_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, f2xx_rtc, R_RTC_MAX),
+        VMSTATE_INT64(host_to_target_offset_us, f2xx_rtc),
+        VMSTATE_INT32(wp_count, f2xx_rtc),
+        VMSTATE_INT64(ticks, f2xx_rtc),
+        VMSTATE_TIMER_PTR(wu_timer, f2xx_rtc),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void
 f2xx_rtc_class_init(ObjectClass *klass, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = f2xx_rtc_realize;
+    dc->vmsd = &vmstate_f2xx_rtc;
     device_class_set_legacy_reset(dc, f2xx_rtc_reset);
 }
 
@@ -22,6 +22,11 @@
 /*
  * QEMU stm32f2xx TIM emulation
  * Ported to QEMU 10.x APIs.
+ *
+ * Only the up-counting time base is modelled. The counter is not ticked:
+ * CNT is derived on read from QEMU_CLOCK_VIRTUAL and the timer clock in the
+ * RCC clock tree, and the QEMU timer is only armed for the next overflow
+ * when the guest has asked to be told about it (UIE, or one-pulse mode).
  */
 #include "qemu/osdep.h"
 #include "hw/sysbus.h"
@@ -29,6 +34,7 @@
 #include "hw/qdev-properties.h"
 #include "hw/arm/stm32_common.h"
 #include "qemu/timer.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
 #include "qapi/error.h"
 
@@ -66,6 +72,19 @@
 #define R_TIM_OR     (0x50 / 4)
 #define R_TIM_MAX    (0x54 / 4)
 
+#define TIM_CR1_CEN   0x0001
+#define TIM_CR1_UDIS  0x0002
+#define TIM_CR1_URS   0x0004
+#define TIM_CR1_OPM   0x0008
+#define TIM_CR1_DIR_CMS 0x0070
+#define TIM_CR1_ARPE  0x0080
+#define TIM_DIER_UIE  0x0001
+#define TIM_SR_UIF    0x0001
+#define TIM_EGR_UG    0x0001
+
+/* Counter tick used when no RCC is linked (the historical 32kHz) */
+#define TIM_FALLBACK_TICK_NS 31250
+
 static const char *f2xx_tim_reg_names[] = {
     ENUM_STRING(R_TIM_CR1),
     ENUM_STRING(R_TIM_CR2),
@@ -99,23 +118,153 @@ typedef struct f2xx_tim {
 
     qemu_irq pwm_ratio_changed;
     qemu_irq pwm_enable;
+
+    stm32_periph_t periph;
+    Stm32Rcc *stm32_rcc;
+
+    /* Virtual time at which the running counter was 0 */
+    int64_t start_ns;
+    /* Prescaler in use; PSC writes only take effect at the next update event */
+    uint32_t psc_active;
+    /* Timer clock the counter runs on, as last reported by the RCC. 0 while
+     * the RCC gates it, which freezes the counter at regs[R_TIM_CNT]. */
+    uint32_t clk_freq;
 } f2xx_tim;
 
+static bool
+f2xx_tim_has_rcc(f2xx_tim *s)
+{
+    return s->stm32_rcc && s->periph != STM32_PERIPH_UNDEFINED;
+}
+
 static uint32_t
-f2xx_tim_period(f2xx_tim *s)
+f2xx_tim_clk_freq(f2xx_tim *s)
+{
+    if (!f2xx_tim_has_rcc(s)) {
+        return 0;
+    }
+    return stm32_rcc_get_periph_freq(s->stm32_rcc, s->periph);
+}
+
+/* A linked timer whose clock is off does not count */
+static bool
+f2xx_tim_gated(f2xx_tim *s)
 {
-    /* FIXME: hard coded to 32kHz */
-    return 31250;
+    return f2xx_tim_has_rcc(s) && s->clk_freq == 0;
+}
+
+static int64_t
+f2xx_tim_ticks_to_ns(f2xx_tim *s, uint64_t ticks)
+{
+    if (!f2xx_tim_has_rcc(s)) {
+        return ticks * TIM_FALLBACK_TICK_NS;
+    }
+    if (s->clk_freq == 0) {
+        return 0;
+    }
+    return muldiv64(ticks * (s->psc_active + 1), NANOSECONDS_PER_SECOND,
+                    s->clk_freq);
+}
+
+static uint64_t
+f2xx_tim_ns_to_ticks(f2xx_tim *s, int64_t ns)
+{
+    if (ns <= 0) {
+        return 0;
+    }
+    if (!f2xx_tim_has_rcc(s)) {
+        return ns / TIM_FALLBACK_TICK_NS;
+    }
+    if (s->clk_freq == 0) {
+        return 0;
+    }
+    return muldiv64(ns, s->clk_freq, NANOSECONDS_PER_SECOND) / (s->psc_active + 1);
 }
 
+/* Time between update events: the counter runs 0..ARR. 0 when ARR is 0,
+ * which blocks the counter. */
 static int64_t
-f2xx_tim_next_transition(f2xx_tim *s, int64_t current_time)
+f2xx_tim_period(f2xx_tim *s)
 {
-    if (s->regs[R_TIM_CR1] & 0x70) {
-        qemu_log_mask(LOG_UNIMP, "f2xx tim, only upedge-aligned mode supported\n");
-        return -1;
+    if (s->regs[R_TIM_ARR] == 0) {
+        return 0;
+    }
+    return f2xx_tim_ticks_to_ns(s, (uint64_t)s->regs[R_TIM_ARR] + 1);
+}
+
+static void
+f2xx_tim_update_irq(f2xx_tim *s)
+{
+    qemu_set_irq(s->irq, (s->regs[R_TIM_SR] & TIM_SR_UIF)
+                         && (s->regs[R_TIM_DIER] & TIM_DIER_UIE));
+}
+
+static uint32_t
+f2xx_tim_count(f2xx_tim *s, int64_t now)
+{
+    uint64_t ticks;
+
+    if (!(s->regs[R_TIM_CR1] & TIM_CR1_CEN) || f2xx_tim_gated(s)) {
+        return s->regs[R_TIM_CNT];
+    }
+    ticks = f2xx_tim_ns_to_ticks(s, now - s->start_ns);
+    return MIN(ticks, s->regs[R_TIM_ARR]);
+}
+
+/* Overflow at the end of the running period */
+static void
+f2xx_tim_overflow(f2xx_tim *s)
+{
+    if (!(s->regs[R_TIM_CR1] & TIM_CR1_UDIS)) {
+        s->regs[R_TIM_SR] |= TIM_SR_UIF;
+        s->psc_active = s->regs[R_TIM_PSC];
+    }
+    if (s->regs[R_TIM_CR1] & TIM_CR1_OPM) {
+        s->regs[R_TIM_CR1] &= ~TIM_CR1_CEN;
+        s->regs[R_TIM_CNT] = 0;
+        qemu_set_irq(s->pwm_enable, 0);
+    }
+}
+
+/* Bring the counter up to date with 'now', accounting for every overflow
+ * that has happened since it was last looked at. */
+static void
+f2xx_tim_sync(f2xx_tim *s, int64_t now)
+{
+    int64_t period;
+
+    if (!(s->regs[R_TIM_CR1] & TIM_CR1_CEN)) {
+        return;
+    }
+    period = f2xx_tim_period(s);
+    if (period <= 0 || now - s->start_ns < period) {
+        return;
+    }
+
+    /* The first overflow may latch a new prescaler, which changes the
+     * length of all the periods after it. */
+    s->start_ns += period;
+    f2xx_tim_overflow(s);
+    if (!(s->regs[R_TIM_CR1] & TIM_CR1_CEN)) {
+        return;
+    }
+    period = f2xx_tim_period(s);
+    if (period > 0 && now - s->start_ns >= period) {
+        s->start_ns += (now - s->start_ns) / period * period;
+    }
+}
+
+static void
+f2xx_tim_schedule(f2xx_tim *s)
+{
+    int64_t period = f2xx_tim_period(s);
+
+    if ((s->regs[R_TIM_CR1] & TIM_CR1_CEN) && period > 0
+        && (s->regs[R_TIM_DIER] & TIM_DIER_UIE || s->regs[R_TIM_CR1] & TIM_CR1_OPM)) {
+        timer_mod(s->timer, s->start_ns + period);
+    } else {
+        timer_del(s->timer);
     }
-    return current_time + f2xx_tim_period(s) * s->regs[R_TIM_ARR];
 }
 
 static void
@@ -123,14 +272,48 @@ f2xx_tim_timer(void *arg)
 {
     f2xx_tim *s = arg;
 
-    if (s->regs[R_TIM_CR1] & 1) {
-        timer_mod(s->timer, f2xx_tim_next_transition(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)));
+    f2xx_tim_sync(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    f2xx_tim_update_irq(s);
+    f2xx_tim_schedule(s);
+}
+
+/* The RCC changed the timer clock. Account for the time run at the old rate,
+ * park the position in CNT and restart from it at the new one; a gated clock
+ * leaves the counter frozen there until the clock comes back. */
+static void
+f2xx_tim_clk_changed(void *opaque, int n, int level)
+{
+    f2xx_tim *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t freq = f2xx_tim_clk_freq(s);
+
+    if (freq == s->clk_freq) {
+        return;
+    }
+    if (s->regs[R_TIM_CR1] & TIM_CR1_CEN) {
+        f2xx_tim_sync(s, now);
+        s->regs[R_TIM_CNT] = f2xx_tim_count(s, now);
     }
-    if (!(s->regs[R_TIM_SR] & 1)) {
-        //printf("f2xx tim timer expired, setting int\n");
-        s->regs[R_TIM_SR] |= 1;
+    DPRINTF("%s clock %u -> %u Hz\n", s->parent_obj.parent_obj.id,
+            s->clk_freq, freq);
+    s->clk_freq = freq;
+    if (s->regs[R_TIM_CR1] & TIM_CR1_CEN) {
+        s->start_ns = now - f2xx_tim_ticks_to_ns(s, s->regs[R_TIM_CNT]);
     }
-    qemu_set_irq(s->irq, 1);
+    f2xx_tim_update_irq(s);
+    f2xx_tim_schedule(s);
+}
+
+void stm32_timer_set_rcc(Stm32Timer *timer, Stm32Rcc *rcc)
+{
+    f2xx_tim *s = (f2xx_tim *)timer;
+
+    s->stm32_rcc = rcc;
+    if (f2xx_tim_has_rcc(s)) {
+        stm32_rcc_set_periph_clk_irq(rcc, s->periph,
+                                     qemu_allocate_irq(f2xx_tim_clk_changed, s, 0));
+    }
+    s->clk_freq = f2xx_tim_clk_freq(s);
 }
 
 static uint64_t
@@ -146,11 +329,23 @@ f2xx_tim_read(void *arg, hwaddr addr, unsigned int size)
           (unsigned int)addr << 2);
         return 0;
     }
+    if (addr == R_TIM_CR1 || addr == R_TIM_SR || addr == R_TIM_CNT) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+        f2xx_tim_sync(s, now);
+        f2xx_tim_update_irq(s);
+        if (addr == R_TIM_CNT) {
+            s->regs[R_TIM_CNT] = f2xx_tim_count(s, now);
+        }
+    }
     r = (s->regs[addr] >> offset * 8) & ((1ull << (8 * size)) - 1);
     switch (addr) {
     case R_TIM_CR1:
     case R_TIM_DIER:
     case R_TIM_SR:
+    case R_TIM_CNT:
+    case R_TIM_PSC:
+    case R_TIM_ARR:
         break;
     default:
         qemu_log_mask(LOG_UNIMP, "f2xx tim unimplemented read 0x%x+%u size %u val 0x%x\n",
@@ -167,6 +362,7 @@ f2xx_tim_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
 {
     f2xx_tim *s = arg;
     int offset = addr & 0x3;
+    int64_t now;
 
     addr >>= 2;
 
@@ -191,31 +387,70 @@ f2xx_tim_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
         abort();
     }
 
+    /* Everything below may change the period or the flags, so account for
+     * any overflow that has already happened first. */
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    f2xx_tim_sync(s, now);
+
     switch(addr) {
     case R_TIM_CR1:
-        if (data & ~1) {
-            qemu_log_mask(LOG_UNIMP, "f2xx tim non-zero CR1 unimplemented\n");
+        if (data & TIM_CR1_DIR_CMS) {
+            qemu_log_mask(LOG_UNIMP, "f2xx tim, only upedge-aligned mode supported\n");
         }
-        if ((s->regs[addr] & 1) == 0 && data & 1) {
-            //printf("f2xx tim started\n");
-            timer_mod(s->timer, f2xx_tim_next_transition(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)));
+        if ((s->regs[addr] & TIM_CR1_CEN) == 0 && data & TIM_CR1_CEN) {
+            s->start_ns = now - f2xx_tim_ticks_to_ns(s, s->regs[R_TIM_CNT]);
             qemu_set_irq(s->pwm_enable, 1);
-        } else if (s->regs[addr] & 1 && (data & 1) == 0) {
-            timer_del(s->timer);
+        } else if (s->regs[addr] & TIM_CR1_CEN && (data & TIM_CR1_CEN) == 0) {
+            s->regs[R_TIM_CNT] = f2xx_tim_count(s, now);
             qemu_set_irq(s->pwm_enable, 0);
         }
         s->regs[addr] = data;
+        f2xx_tim_schedule(s);
         break;
     case R_TIM_SR:
-        if (s->regs[addr] & 1 && (data & 1) == 0) {
-            //printf("f2xx tim clearing int\n");
-            qemu_set_irq(s->irq, 0);
-        }
         s->regs[addr] &= data;
+        f2xx_tim_update_irq(s);
         break;
     case R_TIM_EGR:
-        qemu_log_mask(LOG_UNIMP, "f2xx tim unimplemented write EGR+%u size %u val 0x%x\n",
-          offset, size, (unsigned int)data);
+        if (data & TIM_EGR_UG) {
+            /* Reinitialize the counter and the prescaler */
+            s->regs[R_TIM_CNT] = 0;
+            s->start_ns = now;
+            if (!(s->regs[R_TIM_CR1] & TIM_CR1_UDIS)) {
+                s->psc_active = s->regs[R_TIM_PSC];
+                if (!(s->regs[R_TIM_CR1] & TIM_CR1_URS)) {
+                    s->regs[R_TIM_SR] |= TIM_SR_UIF;
+                }
+            }
+            f2xx_tim_update_irq(s);
+            f2xx_tim_schedule(s);
+        }
+        if (data & ~TIM_EGR_UG) {
+            qemu_log_mask(LOG_UNIMP, "f2xx tim unimplemented write EGR+%u size %u val 0x%x\n",
+              offset, size, (unsigned int)data);
+        }
+        break;
+    case R_TIM_CNT:
+        s->regs[addr] = data;
+        if (s->regs[R_TIM_CR1] & TIM_CR1_CEN) {
+            s->start_ns = now - f2xx_tim_ticks_to_ns(s, data);
+            f2xx_tim_schedule(s);
+        }
+        break;
+    case R_TIM_PSC:
+        /* Preloaded: s->psc_active picks it up at the next update event */
+        s->regs[addr] = data & 0xffff;
+        break;
+    case R_TIM_DIER:
+        s->regs[addr] = data;
+        f2xx_tim_update_irq(s);
+        f2xx_tim_schedule(s);
+        break;
+    case R_TIM_ARR:
+        /* ARPE preloading is not modelled: a new ARR applies to the
+         * running period straight away. */
+        s->regs[addr] = data;
+        f2xx_tim_schedule(s);
         break;
     case R_TIM_CCER:
         // Capture/Compare Enable register
@@ -253,9 +488,6 @@ f2xx_tim_write(void *arg, hwaddr addr, uint64_t data, unsigned int size)
         // Capture/Compare mode register 2
         s->regs[addr] = data;
         break;
-    case R_TIM_DIER:
-    case R_TIM_PSC:
-    case R_TIM_ARR:
     case R_TIM_CCR1:
     case R_TIM_CCR2:
         s->regs[addr] = data;
@@ -283,6 +515,9 @@ static void f2xx_tim_reset(DeviceState *dev)
 
     timer_del(s->timer);
     memset(&s->regs, 0, sizeof(s->regs));
+    s->start_ns = 0;
+    s->psc_active = 0;
+    s->clk_freq = f2xx_tim_clk_freq(s);
 }
 
 
@@ -301,12 +536,34 @@ f2xx_tim_realize(DeviceState *dev, Error **errp)
     qdev_init_gpio_out_named(dev, &s->pwm_enable, "pwm_enable", 1);
 }
 
+static const VMStateDescription vmstate_f2xx_tim = {
+    .name = "f2xx_tim",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(regs, f2xx_tim, R_TIM_MAX),
+        VMSTATE_TIMER_PTR(timer, f2xx_tim),
+        VMSTATE_INT64(start_ns, f2xx_tim),
+        VMSTATE_UINT32(psc_active, f2xx_tim),
+        /* The RCC's clock-change notifications during its own load rebase
+         * the counter from this rate */
+        VMSTATE_UINT32(clk_freq, f2xx_tim),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const Property f2xx_tim_properties[] = {
+    DEFINE_PROP_INT32("periph", f2xx_tim, periph, STM32_PERIPH_UNDEFINED),
+};
+
 static void
 f2xx_tim_class_init(ObjectClass *klass, const void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = f2xx_tim_realize;
+    dc->vmsd = &vmstate_f2xx_tim;
     device_class_set_legacy_reset(dc, f2xx_tim_reset);
+    device_class_set_props(dc, f2xx_tim_properties);
 }
 
 static const TypeInfo
@@ -61,18 +61,33 @@ typedef struct {
 #define STM32F4XX_UART_COUNT  8
 #define STM32F4XX_TIM_COUNT   14
 #define STM32F4XX_SPI_COUNT   6
+#define STM32F4XX_I2C_COUNT   3
 
 #define STM32F7XX_GPIO_COUNT  11
 #define STM32F7XX_UART_COUNT  8
 #define STM32F7XX_TIM_COUNT   14
 #define STM32F7XX_SPI_COUNT   6
 
+/* A part on one of the I2C buses. Boards list theirs in i2c_sensors, ending
+ * at the first entry with a NULL type; irq_gpio is -1 when the part's
+ * interrupt line is not wired. Addresses with no entry NACK. */
+#define PBL_MAX_I2C_SENSORS 4
+
+typedef struct {
+    const char *type;
+    int i2c;            /* controller index, 0 = I2C1 */
+    uint8_t addr;       /* 7-bit slave address */
+    int irq_gpio;
+    int irq_pin;
+} PblI2CSensorMap;
+
 typedef struct {
     int dbgserial_uart_index;
     int pebble_control_uart_index;
 
     PblButtonMap button_map[PBL_NUM_BUTTONS];
     uint32_t gpio_idr_masks[STM32F4XX_GPIO_COUNT];
+    PblI2CSensorMap i2c_sensors[PBL_MAX_I2C_SENSORS];
 
     /* memory sizes in KBytes */
     uint32_t flash_size;
@@ -92,6 +107,7 @@ typedef struct {
 /* SoC context returned from init functions */
 struct stm32f4xx {
     DeviceState *spi_dev[STM32F4XX_SPI_COUNT];
+    DeviceState *i2c_dev[STM32F4XX_I2C_COUNT];
     DeviceState *qspi_dev;
 };
 
@@ -127,6 +143,39 @@ void pebble_connect_uarts(Stm32Uart *uart[], const PblBoardConfig *board_config)
 void pebble_init_buttons(Stm32Gpio *gpio[], const PblButtonMap *map);
 DeviceState *pebble_init_board(Stm32Gpio *gpio[], qemu_irq display_vibe);
 
+/* Host sensor input, from the control channel (see pebble.c). Each setter
+ * returns true when QEMU consumed the update natively and false when the
+ * packet should still go to the firmware's QEMU driver over the UART.
+ * Emulated sensors register a sink to take their updates natively. */
+typedef struct {
+    int16_t x;
+    int16_t y;
+    int16_t z;
+} PblAccelSample;
+
+/* Sink callbacks return false when the firmware is not using the emulated
+ * part (e.g. it talks to its QEMU driver instead), so the packet is forwarded */
+typedef struct {
+    /* Queue n samples; set *avail to the room left, in samples */
+    bool (*samples)(void *opaque, const PblAccelSample *samples, uint32_t n,
+                    uint32_t *avail);
+    /* Report a tap (axis 0-2 for x-z, direction +1 or -1) */
+    bool (*tap)(void *opaque, uint8_t axis, int8_t direction);
+} PblAccelSinkOps;
+
+void pebble_sensor_register_accel(const PblAccelSinkOps *ops, void *opaque);
+void pebble_sensor_register_compass(
+        bool (*set)(void *opaque, uint32_t heading, uint8_t calib_status),
+        void *opaque);
+
+bool pebble_sensor_accel_samples(const PblAccelSample *samples, uint32_t n,
+                                 uint32_t *avail);
+bool pebble_sensor_accel_tap(uint8_t axis, int8_t direction);
+/* heading: 0x10000 is 360 degrees */
+bool pebble_sensor_compass(uint32_t heading, uint8_t calib_status);
+bool pebble_sensor_battery(uint8_t pct, bool charger_connected);
+bool pebble_sensor_bt_connection(bool connected);
+
 /* F7xx UART type forward declarations (stub for now) */
 typedef struct Stm32F7xxUart Stm32F7xxUart;
 
@@ -316,6 +316,7 @@ void stm32_exti_reset_gpio(Stm32Exti *s, unsigned exti_line, const uint8_t gpio_
 /* Set the value of one of the QEMU specific extra RTC backup registers.
  * The idx value starts at 0 for the first extra register */
 void f2xx_rtc_set_extra_bkup_reg(void *opaque, uint32_t idx, uint32_t value);
+uint32_t f2xx_rtc_get_extra_bkup_reg(void *opaque, uint32_t idx);
 
 
 /* GPIO */
@@ -399,6 +400,9 @@ void stm32_syscfg_set_links(DeviceState *dev, Stm32Rcc *rcc, Stm32Exti *exti);
 typedef struct Stm32Timer Stm32Timer;
 #define STM32_TIM_COUNT   14
 
+/* Links the timer to the RCC for its timer clock (board/SoC wiring). */
+void stm32_timer_set_rcc(Stm32Timer *timer, Stm32Rcc *rcc);
+
 
 /* LPTIM */
 typedef struct Stm32F7xxLPTimer Stm32F7xxLPTimer;
@@ -423,6 +427,49 @@ void stm32_uart_set_write_handler(Stm32Uart *s, void *obj,
 void stm32_uart_get_rcv_handlers(Stm32Uart *s, IOCanReadHandler **can_read,
                                   IOReadHandler **read, IOEventHandler **event);
 
+/* Sets the RCC whose peripheral clock and BRR give the character time
+ * (board/SoC wiring). Without it, or with the "turbo" property set,
+ * characters move instantly. */
+void stm32_uart_set_rcc(Stm32Uart *s, Stm32Rcc *rcc);
+
+#define STM32_UART_DR_OFFSET 0x04
+
+/* DMA side of the data register, active while CR3 DMAR / DMAT is set. Each
+ * call moves as many bytes as the UART can give or take right now and returns
+ * that count. The "dma-rx-request" / "dma-tx-request" GPIO outputs (two lines
+ * each, for UARTs mapped to two streams) are high while more can be moved. */
+uint32_t stm32_uart_dma_rx(Stm32Uart *s, uint8_t *buf, uint32_t len);
+uint32_t stm32_uart_dma_tx(Stm32Uart *s, const uint8_t *buf, uint32_t len);
+
+
+/* DMA */
+/* Peripheral request inputs of an f2xx_dma, one per stream and channel; a
+ * stream follows the line its CHSEL selects. */
+#define STM32_DMA_REQUEST "dma-request"
+#define STM32_DMA_REQUEST_LINE(stream, channel) ((stream) * 8 + (channel))
+
+
+/* SPI */
+#define TYPE_STM32F2XX_SPI "stm32f2xx_spi"
+#define STM32F2XX_SPI_DR_OFFSET 0x0C
+
+/* Shift len bytes out through the SPI data register in one call, with the same
+ * result as writing them to DR one at a time (used by DMA for bursts). */
+void stm32f2xx_spi_write_bulk(DeviceState *dev, const uint8_t *buf, uint32_t len);
+
+/* Optional interface for SSI peripherals that can consume a run of bytes in one
+ * call. transfer_bulk returns how many bytes it took from the front of buf (their
+ * replies read back as 0); the rest are fed through the per-byte transfer hook. */
+#define TYPE_STM32_SPI_BULK "stm32-spi-bulk"
+
+typedef struct Stm32SpiBulkClass {
+    InterfaceClass parent_class;
+
+    uint32_t (*transfer_bulk)(DeviceState *dev, const uint8_t *buf, uint32_t len);
+} Stm32SpiBulkClass;
+
+DECLARE_CLASS_CHECKERS(Stm32SpiBulkClass, STM32_SPI_BULK, TYPE_STM32_SPI_BULK)
+
 
 /* AFIO */
 #define TYPE_STM32_AFIO "stm32-afio"
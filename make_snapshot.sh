@@ -0,0 +1,171 @@
+#!/bin/bash
+# Produce a pre-booted machine image that index.html can resume from
+#
+# Boots native QEMU to the watchface, then migrates the machine state (RAM,
+# CCM, SDRAM, device state) into a file. The web page restores it with
+# "-incoming file:..." instead of cold-booting through the bootloader and FPGA
+# programming.
+#
+# The 16MB storage flash is not in the image: the boot runs with a flash delta
+# (see hw/arm/pebble_flash_delta.c), which leaves the pflash RAM out of
+# migration, and the sectors the boot wrote are saved as a delta log next to
+# the image. The image resumes on top of the pristine SPI flash plus that log.
+#
+# Usage:
+#   bash make_snapshot.sh [--sdk|--full] [--shift N|auto] [--native]
+#
+# Output (also copied to web/firmware/<variant>/):
+#   firmware/<variant>/qemu_snapshot.bin    machine image
+#   firmware/<variant>/qemu_snapshot.delta  storage flash sectors written by the boot
+#   firmware/<variant>/qemu_snapshot.json   QEMU version and icount mode of the image
+#
+# QEMU cannot load an image saved by a different version. The page runs the
+# version recorded in web/qemu-version.txt by build_wasm.sh (10.1), while
+# build.sh builds native 10.0, so point PEBBLE_SNAPSHOT_QEMU at a native build
+# of the page's version. The script refuses to run on a mismatch; --native
+# skips the check and the web copy, for images only used by native QEMU
+# (pebble_fork.sh). index.html also checks the version and cold-boots on a
+# mismatch.
+#
+# The image must be taken with the same icount setting the page will use
+# (?shift=N; the page cold-boots if they differ), and must be regenerated
+# whenever a device model's VMState changes.
+#
+# Environment variables:
+#   PEBBLE_SNAPSHOT_BOOT_SECS - seconds to let the firmware boot (default: 30)
+#   PEBBLE_SNAPSHOT_QEMU      - native qemu-system-arm to boot
+#                               (default: ../qemu-10.0/build/qemu-system-arm)
+
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+QEMU="${PEBBLE_SNAPSHOT_QEMU:-${SCRIPT_DIR}/../qemu-10.0/build/qemu-system-arm}"
+
+FW_VARIANT="full"
+ICOUNT_ARGS=()
+NATIVE_ONLY=0
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --sdk) FW_VARIANT="sdk" ;;
+        --full) FW_VARIANT="full" ;;
+        --shift) shift; ICOUNT_ARGS=(-icount "shift=$1") ;;
+        --native) NATIVE_ONLY=1 ;;
+        *) echo "Unknown option: $1"; echo "Usage: $0 [--sdk|--full] [--shift N|auto] [--native]"; exit 1 ;;
+    esac
+    shift
+done
+
+FW_DIR="${SCRIPT_DIR}/firmware/${FW_VARIANT}"
+WEB_FW_DIR="${SCRIPT_DIR}/web/firmware/${FW_VARIANT}"
+SNAPSHOT="${FW_DIR}/qemu_snapshot.bin"
+SNAPSHOT_DELTA="${FW_DIR}/qemu_snapshot.delta"
+SNAPSHOT_INFO="${FW_DIR}/qemu_snapshot.json"
+WEB_QEMU_VERSION_FILE="${SCRIPT_DIR}/web/qemu-version.txt"
+BOOT_SECS="${PEBBLE_SNAPSHOT_BOOT_SECS:-30}"
+MON_PORT=55778
+
+if [ ! -f "${FW_DIR}/qemu_micro_flash.bin" ]; then
+    echo "Error: Firmware not found at ${FW_DIR}/"
+    echo "Expected: qemu_micro_flash.bin and qemu_spi_flash.bin"
+    exit 1
+fi
+
+QEMU_VERSION="$("$QEMU" --version 2>/dev/null |
+    sed -n 's/^QEMU emulator version \([0-9.]*\).*/\1/p' || true)"
+if [ -z "${QEMU_VERSION}" ]; then
+    echo "Error: cannot run ${QEMU}"
+    exit 1
+fi
+if [ "$NATIVE_ONLY" = 0 ]; then
+    if [ ! -f "${WEB_QEMU_VERSION_FILE}" ]; then
+        echo "Error: ${WEB_QEMU_VERSION_FILE} not found, run build_wasm.sh first (or pass --native)"
+        exit 1
+    fi
+    WEB_QEMU_VERSION="$(tr -d '[:space:]' < "${WEB_QEMU_VERSION_FILE}")"
+    if [ "${QEMU_VERSION}" != "${WEB_QEMU_VERSION}" ]; then
+        echo "Error: ${QEMU} is QEMU ${QEMU_VERSION}, but the web build runs ${WEB_QEMU_VERSION}."
+        echo "Images do not load across versions; set PEBBLE_SNAPSHOT_QEMU to a native"
+        echo "${WEB_QEMU_VERSION} build, or pass --native for an image only native QEMU uses."
+        exit 1
+    fi
+fi
+
+# The pristine SPI flash stays read-only; everything the firmware writes during
+# boot goes to a fresh delta log that is synced when QEMU exits.
+DELTA_SCRATCH="$(mktemp -u /tmp/pebble_snapshot.XXXXXX.delta)"
+rm -f "${SNAPSHOT}" "${SNAPSHOT_DELTA}" "${SNAPSHOT_INFO}"
+
+cleanup() {
+    kill "$QEMU_PID" 2>/dev/null || true
+    wait "$QEMU_PID" 2>/dev/null || true
+    rm -f "${DELTA_SCRATCH}"
+}
+
+monitor() {
+    echo "$1" | nc -w1 localhost ${MON_PORT} 2>/dev/null || true
+}
+
+echo "=== Booting Pebble QEMU 10.x (emery) for snapshot ==="
+echo "  Firmware: ${FW_VARIANT} PebbleOS"
+echo "  QEMU:     ${QEMU_VERSION}"
+echo "  icount:   ${ICOUNT_ARGS[*]:-off}"
+
+PEBBLE_SPI_FLASH_DELTA="${DELTA_SCRATCH}" \
+"$QEMU" \
+  -machine pebble-snowy-emery-bb \
+  -display none \
+  -kernel "${FW_DIR}/qemu_micro_flash.bin" \
+  -drive if=none,id=spi-flash,file="${FW_DIR}/qemu_spi_flash.bin",format=raw,readonly=on \
+  -serial null \
+  -serial null \
+  -serial null \
+  -monitor tcp::${MON_PORT},server,nowait \
+  ${ICOUNT_ARGS[@]+"${ICOUNT_ARGS[@]}"} \
+  2>/dev/null &
+
+QEMU_PID=$!
+trap cleanup EXIT
+
+echo "Waiting ${BOOT_SECS}s for the watchface..."
+sleep "${BOOT_SECS}"
+
+echo "Saving machine state to ${SNAPSHOT}..."
+monitor "stop"
+monitor "migrate file:${SNAPSHOT}"
+
+for i in $(seq 1 120); do
+    STATUS=$(monitor "info migrate" | tr -d '\r' | grep -m1 -i "status:" || true)
+    case "$STATUS" in
+        *completed*) break ;;
+        *failed*|*cancelled*) echo "Error: migration ${STATUS}"; exit 1 ;;
+    esac
+    sleep 0.5
+done
+
+if [ ! -s "${SNAPSHOT}" ]; then
+    echo "Error: snapshot was not written"
+    exit 1
+fi
+
+# Quitting runs the flash delta's final sync
+monitor "quit"
+wait "$QEMU_PID" 2>/dev/null || true
+
+if [ ! -s "${DELTA_SCRATCH}" ]; then
+    echo "Error: flash delta was not written"
+    exit 1
+fi
+cp "${DELTA_SCRATCH}" "${SNAPSHOT_DELTA}"
+printf '{ "qemu": "%s", "icount": "%s" }\n' \
+    "${QEMU_VERSION}" "${ICOUNT_ARGS[1]:-off}" > "${SNAPSHOT_INFO}"
+
+if [ "$NATIVE_ONLY" = 0 ]; then
+    mkdir -p "${WEB_FW_DIR}"
+    cp "${SNAPSHOT}" "${SNAPSHOT_DELTA}" "${SNAPSHOT_INFO}" "${WEB_FW_DIR}/"
+fi
+
+echo "Done: $(ls -lh "${SNAPSHOT}" | awk '{print $5}') -> ${SNAPSHOT}"
+echo "      $(ls -lh "${SNAPSHOT_DELTA}" | awk '{print $5}') -> ${SNAPSHOT_DELTA}"
+if [ "$NATIVE_ONLY" = 0 ]; then
+    echo "Resume in the browser with: http://localhost:8080/?fw=${FW_VARIANT}&snapshot"
+fi
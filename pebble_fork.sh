@@ -0,0 +1,114 @@
+#!/bin/bash
+# Boot Pebble QEMU once, then run N clones of the booted watch in parallel
+#
+# Intended for test farms: the boot (bootloader, FPGA programming, PebbleOS
+# init) is paid once per host instead of once per test. Each clone resumes
+# from the same machine image and gets its own pebble control and debug
+# serial ports, so pebble-tool / test runners can drive them independently.
+#
+# Usage:
+#   bash pebble_fork.sh [--sdk|--full] [--shift N|auto] [-n N] [--resnapshot]
+#
+# Clone i (0-based) listens on:
+#   pebble control: tcp://localhost:$((PEBBLE_FORK_BASE_PORT + 2*i))
+#   debug serial:   tcp://localhost:$((PEBBLE_FORK_BASE_PORT + 2*i + 1))
+# The port list is also written to /tmp/pebble_fork.ports ("index control debug pid").
+#
+# Clones share the read-only SPI flash image. Each one starts from a private
+# copy of the snapshot's flash delta in /tmp, which takes its flash writes and
+# is discarded on exit (see pebble_flash_delta.c).
+# The UARTs run in turbo mode (no baud rate delays) for install throughput.
+#
+# Environment variables:
+#   PEBBLE_FORK_BASE_PORT - first control port (default: 12400)
+
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+QEMU="${SCRIPT_DIR}/../qemu-10.0/build/qemu-system-arm"
+
+FW_VARIANT="full"
+SHIFT_ARGS=()
+ICOUNT_ARGS=()
+NUM_CLONES=4
+RESNAPSHOT=0
+usage() { echo "Usage: $0 [--sdk|--full] [--shift N|auto] [-n N] [--resnapshot]"; }
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --sdk) FW_VARIANT="sdk" ;;
+        --full) FW_VARIANT="full" ;;
+        --shift) shift; SHIFT_ARGS=(--shift "$1"); ICOUNT_ARGS=(-icount "shift=$1") ;;
+        -n) shift; NUM_CLONES="$1" ;;
+        --resnapshot) RESNAPSHOT=1 ;;
+        *) echo "Unknown option: $1"; usage; exit 1 ;;
+    esac
+    shift
+done
+
+FW_DIR="${SCRIPT_DIR}/firmware/${FW_VARIANT}"
+SNAPSHOT="${FW_DIR}/qemu_snapshot.bin"
+SNAPSHOT_DELTA="${FW_DIR}/qemu_snapshot.delta"
+BASE_PORT="${PEBBLE_FORK_BASE_PORT:-12400}"
+PORTS_FILE="/tmp/pebble_fork.ports"
+DELTA_PREFIX="/tmp/pebble_fork.$$"
+
+if [ ! -f "${FW_DIR}/qemu_micro_flash.bin" ]; then
+    echo "Error: Firmware not found at ${FW_DIR}/"
+    echo "Expected: qemu_micro_flash.bin and qemu_spi_flash.bin"
+    exit 1
+fi
+
+# The machine image must match the icount setting, so rebuild it on request.
+if [ "$RESNAPSHOT" = 1 ] || [ ! -s "${SNAPSHOT}" ] || [ ! -s "${SNAPSHOT_DELTA}" ]; then
+    PEBBLE_SNAPSHOT_QEMU="$QEMU" \
+    bash "${SCRIPT_DIR}/make_snapshot.sh" --native "--${FW_VARIANT}" ${SHIFT_ARGS[@]+"${SHIFT_ARGS[@]}"}
+fi
+
+PIDS=()
+cleanup() {
+    echo ""
+    echo "Stopping ${#PIDS[@]} clones..."
+    kill ${PIDS[@]+"${PIDS[@]}"} 2>/dev/null || true
+    wait 2>/dev/null || true
+    rm -f "${DELTA_PREFIX}".*.delta "${PORTS_FILE}"
+    echo "Done."
+}
+trap cleanup EXIT
+
+echo "=== Starting ${NUM_CLONES} Pebble QEMU 10.x (emery) clones ==="
+echo "  Firmware: ${FW_VARIANT} PebbleOS"
+echo "  icount:   ${ICOUNT_ARGS[*]:-off}"
+echo "  Snapshot: ${SNAPSHOT}"
+echo "  Press Ctrl-C to stop"
+echo ""
+
+: > "${PORTS_FILE}"
+for i in $(seq 0 $((NUM_CLONES - 1))); do
+    CONTROL_PORT=$((BASE_PORT + 2 * i))
+    DEBUG_PORT=$((BASE_PORT + 2 * i + 1))
+
+    cp "${SNAPSHOT_DELTA}" "${DELTA_PREFIX}.${i}.delta"
+    PEBBLE_SPI_FLASH_DELTA="${DELTA_PREFIX}.${i}.delta" \
+    "$QEMU" \
+      -machine pebble-snowy-emery-bb \
+      -display none \
+      -kernel "${FW_DIR}/qemu_micro_flash.bin" \
+      -drive if=none,id=spi-flash,file="${FW_DIR}/qemu_spi_flash.bin",format=raw,readonly=on \
+      -serial null \
+      -serial "tcp::${CONTROL_PORT},server,nowait" \
+      -serial "tcp::${DEBUG_PORT},server,nowait" \
+      -incoming "file:${SNAPSHOT}" \
+      -global stm32-uart.turbo=on \
+      ${ICOUNT_ARGS[@]+"${ICOUNT_ARGS[@]}"} \
+      2>"/tmp/pebble_fork.${i}.log" &
+
+    PIDS+=($!)
+    echo "${i} ${CONTROL_PORT} ${DEBUG_PORT} $!" >> "${PORTS_FILE}"
+    echo "  clone ${i}: control tcp://localhost:${CONTROL_PORT}  debug tcp://localhost:${DEBUG_PORT}  (pid $!)"
+done
+
+echo ""
+echo "Port list: ${PORTS_FILE}"
+echo "Connect with: pebble install --qemu localhost:${BASE_PORT} /path/to/app.pbw"
+
+wait
@@ -0,0 +1,77 @@
+#!/bin/bash
+# Check the I2C master receive path against the RM0090 N>2 read sequence
+#
+# Drives I2C1 over the qtest protocol (no firmware runs) and reads three
+# bytes from the BMI160 at 0x68, starting at ACC_CONF (0x40):
+#   wait BTF (byte 1 in DR, byte 2 in the shift register), clear ACK,
+#   read byte 1, wait BTF, STOP, read byte 2, wait RxNE, read byte 3.
+# Firmware that polls BTF here would spin forever if it is never set.
+#
+# Usage:
+#   bash test_i2c_read.sh
+
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+QEMU="${QEMU:-${SCRIPT_DIR}/../qemu-10.0/build/qemu-system-arm}"
+
+I2C1=0x40005400
+CR1=$((I2C1 + 0x00))
+DR=$((I2C1 + 0x10))
+SR1=$((I2C1 + 0x14))
+SR2=$((I2C1 + 0x18))
+
+# One command per line; every command gets one "OK [value]" reply
+COMMANDS=$(cat <<EOF
+writel $CR1 0x0001
+writel $CR1 0x0101
+writel $DR 0xd0
+readl $SR1
+readl $SR2
+writel $DR 0x40
+writel $CR1 0x0501
+writel $DR 0xd1
+readl $SR1
+readl $SR2
+readl $SR1
+writel $CR1 0x0001
+readl $DR
+readl $SR1
+writel $CR1 0x0201
+readl $DR
+readl $SR1
+readl $DR
+readl $SR1
+EOF
+)
+
+mapfile -t REPLIES < <(echo "$COMMANDS" |
+    "$QEMU" -machine pebble-snowy-emery-bb -accel qtest -qtest stdio \
+            -display none -serial null -serial null -serial null 2>/dev/null |
+    grep '^OK')
+
+# Replies worth checking, by command index, with the expected low bits.
+# The bytes are the BMI160 datasheet reset values of 0x40..0x42.
+check() {
+    local idx=$1 mask=$2 want=$3 what=$4
+    local got=$(( ${REPLIES[$idx]#OK } & mask ))
+    if [ "$got" -ne "$want" ]; then
+        printf 'FAIL: %s: got 0x%x, want 0x%x\n' "$what" "$got" "$want"
+        exit 1
+    fi
+    printf 'ok:   %s = 0x%x\n' "$what" "$got"
+}
+
+if [ "${#REPLIES[@]}" -ne 19 ]; then
+    echo "FAIL: expected 19 qtest replies, got ${#REPLIES[@]}"
+    exit 1
+fi
+
+check 10 0x44 0x44 "SR1 after ADDR clear (RxNE|BTF)"
+check 12 0xff 0x28 "byte 1 (ACC_CONF)"
+check 13 0x44 0x44 "SR1 before STOP (RxNE|BTF)"
+check 15 0xff 0x03 "byte 2 (ACC_RANGE)"
+check 16 0x44 0x40 "SR1 before last byte (RxNE)"
+check 17 0xff 0x28 "byte 3 (GYR_CONF)"
+check 18 0x44 0x00 "SR1 after last byte"
+echo "PASS"
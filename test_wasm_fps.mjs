@@ -2,14 +2,27 @@
 // SDK firmware: boot → press Down → timeline sloth animation
 // Keep pressing Up then Down every 3s to restart animation
 //
-// Usage: node test_wasm_fps.mjs [shift_value]
+// Usage: node test_wasm_fps.mjs [shift_value] [--snapshot]
+//   --snapshot  resume from web/firmware/sdk/qemu_snapshot.bin (see make_snapshot.sh);
+//               shift_value defaults to the icount mode the image was taken with
 
 import { chromium } from 'playwright';
+import { readFileSync } from 'fs';
 
-const shift = process.argv[2] || '3';
-const url = `http://localhost:8080/?fw=sdk&auto&shift=${shift}`;
-const BOOT_WAIT = 180;  // max seconds to wait for first frame
-const SETTLE_TIME = 30; // seconds after display active before sending keys
+const args = process.argv.slice(2);
+const snapshot = args.includes('--snapshot');
+
+// The page cold-boots if ?shift does not match the snapshot's icount mode
+function snapshotShift() {
+    const info = JSON.parse(readFileSync(
+        new URL('web/firmware/sdk/qemu_snapshot.json', import.meta.url), 'utf8'));
+    return info.icount === 'off' ? 'off' : info.icount.replace(/^shift=/, '');
+}
+
+const shift = args.find(a => !a.startsWith('--')) || (snapshot ? snapshotShift() : '3');
+const url = `http://localhost:8080/?fw=sdk&auto&shift=${shift}${snapshot ? '&snapshot' : ''}`;
+const BOOT_WAIT = snapshot ? 30 : 180;  // max seconds to wait for first frame
+const SETTLE_TIME = snapshot ? 5 : 30;  // seconds after display active before sending keys
 const ANIM_DURATION = 90; // seconds to run animation
 
 console.log(`=== WASM FPS Test (shift=${shift}) ===`);
@@ -47,7 +60,7 @@ page.on('console', msg => {
         console.log(`  [${elapsed()}s] ${text}`);
     }
 
-    if (text.includes('[config] icount')) {
+    if (text.includes('[config] icount') || text.includes('[config] boot')) {
         console.log(`  Config: ${text}`);
     }
 });